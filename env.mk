@@ -12,6 +12,9 @@ EXTRA_CFLAGS ?=
 EXTRA_LDFLAGS ?=
 
 DEBUG_BUILD ?=
+# The keys on the PKCS#11 tokens are supported with the header of p11-kit.
+# Set to 1 or 0, or detected with pkg-config if not given.
+PKCS11 ?= $(shell pkg-config --exists p11-kit-1 && echo 1 || echo 0)
 SIGNATURELET_DIR ?= $(TOPDIR)/src/signaturelet
 
 # For the build
@@ -36,3 +39,7 @@ CFLAGS := -std=gnu11 -O2 -DLIBSIGN_VERSION=\"$(LIBSIGN_VERSION)\" \
 ifneq ($(DEBUG_BUILD),)
 	CFLAGS += -ggdb -DDEBUG_BUILD
 endif
+
+ifeq ($(PKCS11),1)
+	CFLAGS += -DLIBSIGN_PKCS11
+endif
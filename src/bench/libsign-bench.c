@@ -0,0 +1,662 @@
+/*
+ * Copyright (c) 2017, Wind River Systems, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1) Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2) Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3) Neither the name of Wind River Systems nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Author:
+ *        Lans Zhang <jia.zhang@windriver.com>
+ */
+
+#include <libsign.h>
+#include <signlet.h>
+#include <signaturelet.h>
+
+/*
+ * The micro-benchmarks of libsign. Each subcommand measures one hot path
+ * and prints a line per configuration.
+ */
+
+typedef struct {
+	const char *name;
+	const char *help;
+	int (*run)(int argc, char *argv[]);
+} bench_command_t;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+show_result(const char *name, size_t size, unsigned long iterations,
+	    uint64_t elapsed)
+{
+	info_cont("%-20s %8zu %10lu %10.1f %10.1f\n", name, size,
+		  iterations, (double)elapsed / iterations,
+		  (double)size * iterations * 1000 / elapsed);
+}
+
+/* The per-call path before the digest objects and contexts were cached */
+static int
+digest_uncached(const EVP_MD *md, uint8_t *data, size_t size,
+		uint8_t *out)
+{
+	unsigned int out_size;
+
+	return !EVP_Digest(data, size, out, &out_size, md, NULL);
+}
+
+static int
+bench_digest(int argc, char *argv[])
+{
+	static const size_t sizes[] = { 64, 1024, 4096, 65536 };
+	unsigned long iterations = 100000;
+	LIBSIGN_DIGEST_ALG digest_alg = LIBSIGN_DIGEST_ALG_SHA256;
+
+	if (argc > 1) {
+		digest_alg = libsign_digest_alg_from_name(argv[1]);
+		if (digest_alg == LIBSIGN_DIGEST_ALG_NONE) {
+			err("Unrecognized digest algorithm %s\n", argv[1]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (argc > 2)
+		iterations = strtoul(argv[2], NULL, 0);
+
+	if (!iterations)
+		return EXIT_FAILURE;
+
+	const EVP_MD *md = EVP_get_digestbyname(libsign_digest_name(digest_alg));
+	if (!md)
+		return EXIT_FAILURE;
+
+	uint8_t *data = malloc(sizes[sizeof(sizes) / sizeof(*sizes) - 1]);
+	if (!data)
+		return EXIT_FAILURE;
+
+	memset(data, 0x5a, sizes[sizeof(sizes) / sizeof(*sizes) - 1]);
+
+	info_cont("%-20s %8s %10s %10s %10s\n", "path", "size", "calls",
+		  "ns/call", "MB/s");
+
+	for (unsigned int i = 0; i < sizeof(sizes) / sizeof(*sizes); ++i) {
+		uint8_t out[EVP_MAX_MD_SIZE];
+		uint64_t start;
+		unsigned long n;
+
+		start = now_ns();
+		for (n = 0; n < iterations; ++n) {
+			if (digest_uncached(md, data, sizes[i], out))
+				goto err;
+		}
+		show_result("EVP_Digest", sizes[i], iterations,
+			    now_ns() - start);
+
+		start = now_ns();
+		for (n = 0; n < iterations; ++n) {
+			uint8_t *digest;
+
+			if (libsign_digest_calculate(digest_alg, data,
+						     sizes[i], &digest))
+				goto err;
+
+			free(digest);
+		}
+		show_result("libsign_digest", sizes[i], iterations,
+			    now_ns() - start);
+	}
+
+	free(data);
+
+	return EXIT_SUCCESS;
+
+err:
+	free(data);
+
+	return EXIT_FAILURE;
+}
+
+static const struct {
+	const char *name;
+	LIBSIGN_PLACEMENT policy;
+} placements[] = {
+	{ "none", LIBSIGN_PLACEMENT_NONE },
+	{ "compact", LIBSIGN_PLACEMENT_COMPACT },
+	{ "scatter", LIBSIGN_PLACEMENT_SCATTER },
+	{ "numa", LIBSIGN_PLACEMENT_NUMA },
+};
+
+/* Sign the files with the worker threads placed by each policy */
+static int
+bench_placement(int argc, char *argv[])
+{
+	if (argc < 5) {
+		err("The key, certificate, jobs and files are required\n");
+		return EXIT_FAILURE;
+	}
+
+	char *end;
+	unsigned long jobs = strtoul(argv[3], &end, 0);
+
+	if (*end || !jobs || jobs > UINT_MAX) {
+		err("Invalid number of jobs %s\n", argv[3]);
+		return EXIT_FAILURE;
+	}
+
+	const char **signed_files = (const char **)argv + 4;
+	unsigned int nr_file = argc - 4;
+	uint64_t size = 0;
+
+	for (unsigned int i = 0; i < nr_file; ++i) {
+		struct stat st;
+
+		if (stat(signed_files[i], &st)) {
+			err("Failed to stat %s\n", signed_files[i]);
+			return EXIT_FAILURE;
+		}
+
+		size += st.st_size;
+	}
+
+	const char *cert_list[] = {
+		argv[2],
+		NULL
+	};
+	signlet_request_t request = {
+		.siglet = "SELoader",
+		.signed_file_list = signed_files,
+		.key = argv[1],
+		.cert_list = cert_list,
+		.digest_alg = LIBSIGN_DIGEST_ALG_SHA256,
+		.cipher_alg = LIBSIGN_CIPHER_ALG_NONE,
+		.durability = LIBSIGN_DURABILITY_NONE,
+		.jobs = jobs,
+	};
+
+	info_cont("%-20s %8s %10s %10s %10s\n", "placement", "files",
+		  "ms", "files/s", "MB/s");
+
+	/*
+	 * The first round is not reported. It warms up the page cache, so
+	 * that all policies read the files from the memory.
+	 */
+	for (int i = -1; i < (int)(sizeof(placements) / sizeof(*placements));
+	     ++i) {
+		const char *id;
+
+		request.placement = i < 0 ? LIBSIGN_PLACEMENT_NONE :
+					    placements[i].policy;
+
+		uint64_t start = now_ns();
+
+		if (signlet_request(&request, &id))
+			return EXIT_FAILURE;
+
+		int rc = signlet_wait(id);
+
+		signlet_finish(id);
+		if (rc)
+			return EXIT_FAILURE;
+
+		uint64_t elapsed = now_ns() - start;
+
+		if (i < 0)
+			continue;
+
+		info_cont("%-20s %8u %10.1f %10.1f %10.1f\n",
+			  placements[i].name, nr_file, (double)elapsed / 1000000,
+			  (double)nr_file * 1000000000 / elapsed,
+			  (double)size * 1000 / elapsed);
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/* The per-file path before the signer sessions */
+static int
+pkcs7_sign_uncached(EVP_PKEY *key, X509 *cert, uint8_t *content,
+		    size_t content_size)
+{
+	PKCS7 *pkcs7 = PKCS7_sign(cert, key, NULL, NULL,
+				  PKCS7_BINARY | PKCS7_PARTIAL);
+	if (!pkcs7)
+		return EXIT_FAILURE;
+
+	int rc = EXIT_FAILURE;
+	BIO *p7bio = PKCS7_dataInit(pkcs7, NULL);
+
+	if (p7bio && BIO_write(p7bio, content, content_size) ==
+		     (int)content_size) {
+		(void)BIO_flush(p7bio);
+		if (PKCS7_dataFinal(pkcs7, p7bio) &&
+		    i2d_PKCS7(pkcs7, NULL) > 0)
+			rc = EXIT_SUCCESS;
+	}
+
+	BIO_free_all(p7bio);
+	PKCS7_free(pkcs7);
+
+	return rc;
+}
+
+/* Sign a digest the way the files are signed in digest-only mode */
+static int
+bench_pkcs7(int argc, char *argv[])
+{
+	unsigned long iterations = 2000;
+
+	if (argc < 3) {
+		err("The key and certificate are required\n");
+		return EXIT_FAILURE;
+	}
+
+	if (argc > 3)
+		iterations = strtoul(argv[3], NULL, 0);
+
+	if (!iterations)
+		return EXIT_FAILURE;
+
+	EVP_PKEY *key = libsign_key_load(argv[1]);
+	X509 *cert = libsign_x509_load(argv[2]);
+	int rc = EXIT_FAILURE;
+
+	if (!key || !cert || signaturelet_load("SELoader"))
+		goto out;
+
+	uint8_t digest[32];
+	uint64_t start;
+	unsigned long n;
+
+	memset(digest, 0x5a, sizeof(digest));
+
+	info_cont("%-20s %8s %10s %10s %10s\n", "path", "size", "calls",
+		  "ns/call", "MB/s");
+
+	start = now_ns();
+	for (n = 0; n < iterations; ++n) {
+		if (pkcs7_sign_uncached(key, cert, digest, sizeof(digest)))
+			goto out;
+	}
+	show_result("PKCS7_sign", sizeof(digest), iterations,
+		    now_ns() - start);
+
+	start = now_ns();
+	for (n = 0; n < iterations; ++n) {
+		uint8_t *sig;
+		size_t sig_size;
+
+		if (signaturelet_sign_digest("SELoader", digest,
+					     sizeof(digest), key, &cert, 1,
+					     &sig, &sig_size, 0))
+			goto out;
+
+		free(sig);
+	}
+	show_result("signer_session", sizeof(digest), iterations,
+		    now_ns() - start);
+
+	rc = EXIT_SUCCESS;
+
+out:
+	libsign_x509_unload(cert);
+	libsign_key_unload(key);
+
+	return rc;
+}
+
+typedef struct {
+	const char *name;
+	int type;
+	/* The bits of RSA key, or the curve of EC key */
+	int param;
+} bench_cipher_t;
+
+static EVP_PKEY *
+generate_key(const bench_cipher_t *cipher)
+{
+	EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(cipher->type, NULL);
+	EVP_PKEY *key = NULL;
+
+	if (!ctx || EVP_PKEY_keygen_init(ctx) <= 0)
+		goto out;
+
+	if (cipher->type == EVP_PKEY_RSA &&
+	    EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, cipher->param) <= 0)
+		goto out;
+
+	if (cipher->type == EVP_PKEY_EC &&
+	    EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, cipher->param) <= 0)
+		goto out;
+
+	if (EVP_PKEY_keygen(ctx, &key) <= 0)
+		key = NULL;
+
+out:
+	EVP_PKEY_CTX_free(ctx);
+
+	return key;
+}
+
+/* A self-signed certificate of the key */
+static X509 *
+generate_cert(EVP_PKEY *key, const char *name)
+{
+	X509 *cert = X509_new();
+	if (!cert)
+		return NULL;
+
+	X509_NAME *subject = X509_get_subject_name(cert);
+	const EVP_MD *md = EVP_PKEY_base_id(key) == EVP_PKEY_ED25519 ?
+			   NULL : EVP_sha256();
+
+	if (!X509_set_version(cert, 2) ||
+	    !ASN1_INTEGER_set(X509_get_serialNumber(cert), 1) ||
+	    !X509_gmtime_adj(X509_getm_notBefore(cert), 0) ||
+	    !X509_gmtime_adj(X509_getm_notAfter(cert), 86400) ||
+	    !X509_NAME_add_entry_by_txt(subject, "CN", MBSTRING_ASC,
+					(const uint8_t *)name, -1, -1, 0) ||
+	    !X509_set_issuer_name(cert, subject) ||
+	    !X509_set_pubkey(cert, key) || !X509_sign(cert, key, md)) {
+		X509_free(cert);
+		return NULL;
+	}
+
+	return cert;
+}
+
+/* Sign a digest with a key of each cipher algorithm */
+static int
+bench_cipher(int argc, char *argv[])
+{
+	static const bench_cipher_t ciphers[] = {
+		{ "rsa-2048", EVP_PKEY_RSA, 2048 },
+		{ "rsa-3072", EVP_PKEY_RSA, 3072 },
+		{ "rsa-4096", EVP_PKEY_RSA, 4096 },
+		{ "ecdsa-p256", EVP_PKEY_EC, NID_X9_62_prime256v1 },
+		{ "ecdsa-p384", EVP_PKEY_EC, NID_secp384r1 },
+		{ "ed25519", EVP_PKEY_ED25519, 0 },
+	};
+	unsigned long iterations = 200;
+
+	if (argc > 1)
+		iterations = strtoul(argv[1], NULL, 0);
+
+	if (!iterations || signaturelet_load("SELoader"))
+		return EXIT_FAILURE;
+
+	uint8_t digest[32];
+
+	memset(digest, 0x5a, sizeof(digest));
+
+	info_cont("%-20s %8s %10s %10s %10s\n", "cipher", "sig size",
+		  "calls", "us/call", "sigs/s");
+
+	for (unsigned int i = 0; i < sizeof(ciphers) / sizeof(*ciphers);
+	     ++i) {
+		EVP_PKEY *key = generate_key(ciphers + i);
+		X509 *cert = key ? generate_cert(key, ciphers[i].name) : NULL;
+		size_t sig_size = 0;
+		uint64_t start;
+		unsigned long n;
+		int rc = EXIT_FAILURE;
+
+		if (!cert) {
+			err("Failed to generate the %s key\n",
+			    ciphers[i].name);
+			goto next;
+		}
+
+		start = now_ns();
+		for (n = 0; n < iterations; ++n) {
+			uint8_t *sig;
+
+			if (signaturelet_sign_digest("SELoader", digest,
+						     sizeof(digest), key,
+						     &cert, 1, &sig,
+						     &sig_size, 0))
+				goto next;
+
+			free(sig);
+		}
+
+		uint64_t elapsed = now_ns() - start;
+
+		info_cont("%-20s %8zu %10lu %10.1f %10.1f\n",
+			  ciphers[i].name, sig_size, iterations,
+			  (double)elapsed / iterations / 1000,
+			  (double)iterations * 1000000000 / elapsed);
+		rc = EXIT_SUCCESS;
+
+next:
+		X509_free(cert);
+		EVP_PKEY_free(key);
+
+		if (rc)
+			return rc;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+typedef struct {
+	EVP_PKEY *key;
+	X509 *cert;
+	unsigned long iterations;
+	int rc;
+} bench_sign_thread_t;
+
+static void *
+sign_thread(void *arg)
+{
+	bench_sign_thread_t *thread = arg;
+	uint8_t digest[32];
+
+	memset(digest, 0x5a, sizeof(digest));
+
+	for (unsigned long n = 0; n < thread->iterations; ++n) {
+		uint8_t *sig;
+		size_t sig_size;
+
+		thread->rc = signaturelet_sign_digest("SELoader", digest,
+						      sizeof(digest),
+						      thread->key,
+						      &thread->cert, 1, &sig,
+						      &sig_size, 0);
+		if (thread->rc)
+			break;
+
+		free(sig);
+	}
+
+	return NULL;
+}
+
+/*
+ * Sign a digest from the increasing number of threads. With a pkcs11:
+ * key, this is the throughput of the sessions pooled for the token.
+ */
+static int
+bench_sign(int argc, char *argv[])
+{
+	unsigned long max_threads = 8;
+	unsigned long iterations = 400;
+
+	if (argc < 3) {
+		err("The key and certificate are required\n");
+		return EXIT_FAILURE;
+	}
+
+	if (argc > 3)
+		max_threads = strtoul(argv[3], NULL, 0);
+
+	if (argc > 4)
+		iterations = strtoul(argv[4], NULL, 0);
+
+	if (!max_threads || max_threads > 256 || !iterations)
+		return EXIT_FAILURE;
+
+	EVP_PKEY *key = libsign_key_load(argv[1]);
+	X509 *cert = libsign_x509_load(argv[2]);
+	int rc = EXIT_FAILURE;
+
+	if (!key || !cert || signaturelet_load("SELoader"))
+		goto out;
+
+	info_cont("%-20s %10s %10s %10s\n", "threads", "calls", "us/call",
+		  "sigs/s");
+
+	for (unsigned long nr_thread = 1; nr_thread <= max_threads;
+	     nr_thread *= 2) {
+		bench_sign_thread_t threads[nr_thread];
+		pthread_t tids[nr_thread];
+		unsigned long i;
+
+		uint64_t start = now_ns();
+
+		for (i = 0; i < nr_thread; ++i) {
+			threads[i].key = key;
+			threads[i].cert = cert;
+			threads[i].iterations = iterations / nr_thread;
+			threads[i].rc = EXIT_SUCCESS;
+
+			if (pthread_create(tids + i, NULL, sign_thread,
+					   threads + i)) {
+				threads[i].rc = EXIT_FAILURE;
+				break;
+			}
+		}
+
+		unsigned long calls = 0;
+
+		while (i--) {
+			pthread_join(tids[i], NULL);
+			calls += threads[i].iterations;
+		}
+
+		uint64_t elapsed = now_ns() - start;
+
+		for (i = 0; i < nr_thread; ++i) {
+			if (threads[i].rc)
+				goto out;
+		}
+
+		char name[32];
+
+		snprintf(name, sizeof(name), "%lu", nr_thread);
+		info_cont("%-20s %10lu %10.1f %10.1f\n", name, calls,
+			  (double)elapsed / calls / 1000,
+			  (double)calls * 1000000000 / elapsed);
+	}
+
+	rc = EXIT_SUCCESS;
+
+out:
+	libsign_x509_unload(cert);
+	libsign_key_unload(key);
+
+	return rc;
+}
+
+static const bench_command_t commands[] = {
+	{
+		"digest",
+		"[<alg> [<iterations>]]\n"
+		"        Per-call overhead of hashing small inputs",
+		bench_digest,
+	},
+	{
+		"placement",
+		"<key> <cert> <jobs> <file>...\n"
+		"        Throughput of signing the files with the workers "
+		"placed by each policy.\n"
+		"        The signatures are written next to the files",
+		bench_placement,
+	},
+	{
+		"pkcs7",
+		"<key> <cert> [<iterations>]\n"
+		"        Per-file cost of the PKCS#7 signature of a digest",
+		bench_pkcs7,
+	},
+	{
+		"cipher",
+		"[<iterations>]\n"
+		"        Signatures per second of each cipher algorithm, "
+		"with the keys generated",
+		bench_cipher,
+	},
+	{
+		"sign",
+		"<key> <cert> [<threads> [<iterations>]]\n"
+		"        Signatures per second from 1 to <threads> threads, "
+		"e.g. with a pkcs11: key\n"
+		"        to measure the pooled sessions of the token",
+		bench_sign,
+	},
+};
+
+static void
+show_usage(const char *prog)
+{
+	info_cont("Usage: %s <command> [arguments]\n"
+		  "Commands:\n", prog);
+
+	for (unsigned int i = 0; i < sizeof(commands) / sizeof(*commands);
+	     ++i)
+		info_cont("    %s %s\n", commands[i].name, commands[i].help);
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc < 2) {
+		show_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	for (unsigned int i = 0; i < sizeof(commands) / sizeof(*commands);
+	     ++i) {
+		if (!strcmp(argv[1], commands[i].name)) {
+			int rc = commands[i].run(argc - 1, argv + 1);
+
+			libsign_fini();
+
+			return rc;
+		}
+	}
+
+	err("Unrecognized command %s\n", argv[1]);
+	show_usage(argv[0]);
+
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,102 @@
+#!/bin/bash
+#
+# Sign with an RSA and an EC key held by a SoftHSM2 token through their
+# PKCS#11 URIs, and verify the signatures with OpenSSL. The keys are
+# imported to a throwaway token, so the system configuration of SoftHSM2
+# is left untouched.
+#
+# It needs softhsm2-util, openssl and xxd, and libsign built with PKCS11=1.
+#
+# Usage: softhsm-sign.sh [<path to libsofthsm2.so>]
+
+set -e
+
+TOPDIR=$(cd "$(dirname "$0")/../.." && pwd)
+SELSIGN=$TOPDIR/src/selsign/selsign
+PIN=1234
+
+export LD_LIBRARY_PATH=$TOPDIR/src/lib:$TOPDIR/src${LD_LIBRARY_PATH:+:$LD_LIBRARY_PATH}
+
+module=$1
+if [ -z "$module" ]; then
+	for m in /usr/lib/softhsm/libsofthsm2.so \
+		 /usr/lib/x86_64-linux-gnu/softhsm/libsofthsm2.so \
+		 /usr/lib64/pkcs11/libsofthsm2.so \
+		 /usr/lib/pkcs11/libsofthsm2.so \
+		 /usr/local/lib/softhsm/libsofthsm2.so; do
+		if [ -f "$m" ]; then
+			module=$m
+			break
+		fi
+	done
+fi
+
+if [ ! -f "$module" ] || ! command -v softhsm2-util >/dev/null; then
+	echo "SoftHSM2 is not found" >&2
+	exit 1
+fi
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+mkdir "$work/tokens"
+cat > "$work/softhsm2.conf" <<EOF
+directories.tokendir = $work/tokens
+objectstore.backend = file
+log.level = ERROR
+EOF
+export SOFTHSM2_CONF=$work/softhsm2.conf
+
+softhsm2-util --init-token --free --label libsign --so-pin 5678 \
+	      --pin $PIN >/dev/null
+
+for i in $(seq 8); do
+	head -c $((i * 4096)) /dev/urandom > "$work/data$i"
+done
+
+id=0
+for alg in rsa ec; do
+	id=$((id + 1))
+
+	case $alg in
+	rsa)
+		openssl genpkey -algorithm RSA \
+			-pkeyopt rsa_keygen_bits:2048 -out "$work/$alg.key"
+		cipher_alg=rsa
+		;;
+	ec)
+		openssl genpkey -algorithm EC \
+			-pkeyopt ec_paramgen_curve:P-256 -out "$work/$alg.key"
+		cipher_alg=ecdsa-p256
+		;;
+	esac
+
+	openssl req -new -x509 -key "$work/$alg.key" -subj "/CN=libsign $alg" \
+		-days 1 -out "$work/$alg.pem" 2>/dev/null
+
+	# Only the token holds the private key from now on
+	softhsm2-util --import "$work/$alg.key" --token libsign --label $alg \
+		      --id $(printf %02x $id) --pin $PIN >/dev/null
+	rm -f "$work/$alg.key"
+
+	uri="pkcs11:token=libsign;object=$alg;type=private"
+	uri="$uri?module-path=$module&pin-value=$PIN"
+
+	# Several threads share the sessions of the key
+	rm -f "$work"/data*.p7b
+	"$SELSIGN" -q --key "$uri" --cert "$work/$alg.pem" \
+		   --cipher-alg $cipher_alg -j4 "$work"/data? >/dev/null
+
+	for i in $(seq 8); do
+		# The signed content is the digest of the file
+		hash=$(sha256sum "$work/data$i" | cut -c1-64)
+		openssl cms -verify -noverify -binary -inform der \
+			-in "$work/data$i.p7b" 2>/dev/null | xxd -p |
+			tr -d '\n' | grep -q "$hash" || {
+			echo "$alg: the signature of data$i fails to verify" >&2
+			exit 1
+		}
+	done
+
+	echo "$alg: signed and verified 8 files with the token key"
+done
@@ -38,6 +38,7 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -53,10 +54,12 @@
 #include <getopt.h>
 #include <dlfcn.h>
 #include <limits.h>
+#include <pthread.h>
 #include <openssl/bio.h>
 #include <openssl/pem.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
+#include <openssl/ec.h>
 #include <openssl/asn1.h>
 #include <openssl/asn1t.h>
 #include <openssl/x509.h>
@@ -147,14 +150,111 @@ typedef enum {
 	LIBSIGN_DIGEST_ALG_MAX
 } LIBSIGN_DIGEST_ALG;
 
+typedef enum {
+	/* OpenSSL EVP digest over the file read to the user space */
+	LIBSIGN_DIGEST_BACKEND_OPENSSL,
+	/*
+	 * Linux AF_ALG hash socket with the file spliced into it.
+	 * Experimental: not verified on a kernel with algif_hash yet.
+	 */
+	LIBSIGN_DIGEST_BACKEND_AF_ALG,
+} LIBSIGN_DIGEST_BACKEND;
+
+typedef enum {
+	/* Read through the page cache with the sequential access hint */
+	LIBSIGN_IO_POLICY_BUFFERED,
+	/* Also keep the readahead of the file a window ahead of the reader */
+	LIBSIGN_IO_POLICY_READAHEAD,
+	/* Bypass the page cache with O_DIRECT where supported */
+	LIBSIGN_IO_POLICY_DIRECT,
+} LIBSIGN_IO_POLICY;
+
+typedef enum {
+	/* Leave the concurrent workers to the scheduler */
+	LIBSIGN_PLACEMENT_NONE,
+	/* Pin the workers to the CPUs in turn, filling up a node first */
+	LIBSIGN_PLACEMENT_COMPACT,
+	/* Pin the workers to the CPUs of the nodes taken in turn */
+	LIBSIGN_PLACEMENT_SCATTER,
+	/* Bind the workers to the nodes taken in turn */
+	LIBSIGN_PLACEMENT_NUMA,
+} LIBSIGN_PLACEMENT;
+
 typedef enum {
 	LIBSIGN_CIPHER_ALG_NONE,
 	LIBSIGN_CIPHER_ALG_RSA,
+	LIBSIGN_CIPHER_ALG_ECDSA_P256,
+	LIBSIGN_CIPHER_ALG_ECDSA_P384,
+	LIBSIGN_CIPHER_ALG_ED25519,
+	LIBSIGN_CIPHER_ALG_MAX
 } LIBSIGN_CIPHER_ALG;
 
+typedef struct {
+	uint8_t *data;
+	size_t size;
+	bool mapped;
+} libsign_file_map_t;
+
+/* The size of chunk read from file when calculating the digest */
+#define LIBSIGN_DIGEST_CHUNK_SIZE	(1024 * 1024)
+
+typedef struct {
+	LIBSIGN_DIGEST_ALG digest_alg;
+	EVP_MD_CTX *md_ctx;
+} libsign_digest_ctx_t;
+
+typedef struct {
+	unsigned int nr_ctx;
+	libsign_digest_ctx_t ctx[LIBSIGN_DIGEST_ALG_MAX];
+} libsign_digest_multi_ctx_t;
+
+typedef enum {
+	/* Atomically replace the output files without syncing them */
+	LIBSIGN_DURABILITY_NONE,
+	/* Sync the output files of a batch at once */
+	LIBSIGN_DURABILITY_BATCH,
+	/* Sync each output file before renaming it */
+	LIBSIGN_DURABILITY_FILE,
+} LIBSIGN_DURABILITY;
+
+/* The maximum number of output files committed by a batch sync */
+#define LIBSIGN_WRITER_MAX_PENDING	1024
+
+/*
+ * Keep every output file in its temporary file until the writer is
+ * committed, whatever the durability policy, so that an aborted writer
+ * leaves none of them behind.
+ */
+#define LIBSIGN_WRITER_FLAGS_DEFERRED	(1 << 0)
+
+typedef struct {
+	char *temp_path;
+	char *path;
+	dev_t dev;
+	bool renamed;
+} libsign_writer_entry_t;
+
+typedef struct {
+	LIBSIGN_DURABILITY durability;
+	unsigned long flags;
+	/* Serialize the pending list among the threads sharing the writer */
+	pthread_mutex_t lock;
+	unsigned int nr_pending;
+	unsigned int max_pending;
+	libsign_writer_entry_t *pending;
+} libsign_writer_t;
+
 extern const char *libsign_git_commit;
 extern const char *libsign_build_machine;
 
+/*
+ * Release the digest objects, the keys and certificates cached, and the
+ * PKCS#11 modules. Only call it once no job is running. The library may
+ * be used again afterwards. Without it, they are reclaimed at exit.
+ */
+void
+libsign_fini(void);
+
 int
 libsign_utils_verbose(void);
 
@@ -164,21 +264,63 @@ libsign_utils_set_verbosity(int verbose);
 bool
 libsign_utils_file_exists(const char *file_path);
 
+int
+libsign_io_set_policy(LIBSIGN_IO_POLICY policy);
+
+LIBSIGN_IO_POLICY
+libsign_io_policy(void);
+
+/* Whether the GNU make jobserver is passed to this process */
+bool
+libsign_jobserver_available(void);
+
 int
 libsign_utils_load_file(const char *path, uint8_t **out_buf,
-			unsigned int *out_size);
+			size_t *out_size);
+
+int
+libsign_utils_read_fd(int fd, libsign_file_map_t *map);
+
+int
+libsign_utils_map_fd(int fd, libsign_file_map_t *map);
+
+int
+libsign_utils_map_file(const char *path, libsign_file_map_t *map);
+
+void
+libsign_utils_unmap_file(libsign_file_map_t *map);
 
 int
 libsign_utils_save_file(const char *file_path, uint8_t *buf,
-			unsigned int size);
+			size_t size);
+
+int
+libsign_writer_init(libsign_writer_t *writer, LIBSIGN_DURABILITY durability,
+		    unsigned long flags);
+
+int
+libsign_writer_save(libsign_writer_t *writer, const char *path,
+		    uint8_t *buf, size_t size);
+
+int
+libsign_writer_commit(libsign_writer_t *writer);
+
+void
+libsign_writer_abort(libsign_writer_t *writer);
 
 void
 libsign_utils_hex_dump(const char *prompt, uint8_t *data,
-		       unsigned int data_size);
+		       size_t data_size);
 
 bool
 libsign_digest_supported(LIBSIGN_DIGEST_ALG digest_alg);
 
+const char *
+libsign_digest_name(LIBSIGN_DIGEST_ALG digest_alg);
+
+LIBSIGN_DIGEST_ALG
+libsign_digest_alg_from_name(const char *name);
+
 int
 libsign_digest_init(LIBSIGN_DIGEST_ALG digest_alg);
 
@@ -187,7 +329,64 @@ libsign_digest_size(LIBSIGN_DIGEST_ALG digest_alg, unsigned int *digest_size);
 
 int
 libsign_digest_calculate(LIBSIGN_DIGEST_ALG digest_alg, uint8_t *data,
-			 unsigned int data_size, uint8_t **digest);
+			 size_t data_size, uint8_t **digest);
+
+/* The maximum number of inputs hashed by a batch in the signlet */
+#define LIBSIGN_DIGEST_BATCH_MAX	16
+
+int
+libsign_digest_batch(LIBSIGN_DIGEST_ALG digest_alg, uint8_t **data,
+		     size_t *data_size, unsigned int nr, uint8_t **digests);
+
+int
+libsign_digest_ctx_init(libsign_digest_ctx_t *ctx,
+			LIBSIGN_DIGEST_ALG digest_alg);
+
+int
+libsign_digest_ctx_update(libsign_digest_ctx_t *ctx, const void *data,
+			  size_t data_size);
+
+int
+libsign_digest_ctx_final(libsign_digest_ctx_t *ctx, uint8_t **digest);
+
+void
+libsign_digest_ctx_release(libsign_digest_ctx_t *ctx);
+
+int
+libsign_digest_multi_init(libsign_digest_multi_ctx_t *ctx,
+			  const LIBSIGN_DIGEST_ALG *digest_algs,
+			  unsigned int nr_digest_alg);
+
+int
+libsign_digest_multi_update(libsign_digest_multi_ctx_t *ctx,
+			    const void *data, size_t data_size);
+
+int
+libsign_digest_multi_final(libsign_digest_multi_ctx_t *ctx,
+			   uint8_t **digests);
+
+void
+libsign_digest_multi_release(libsign_digest_multi_ctx_t *ctx);
+
+int
+libsign_digest_multi_fd(const LIBSIGN_DIGEST_ALG *digest_algs,
+			unsigned int nr_digest_alg, int fd, uint8_t **digests);
+
+int
+libsign_digest_fd(LIBSIGN_DIGEST_ALG digest_alg, int fd, uint8_t **digest);
+
+int
+libsign_digest_file(LIBSIGN_DIGEST_ALG digest_alg, const char *path,
+		    uint8_t **digest);
+
+int
+libsign_digest_selftest(LIBSIGN_DIGEST_BACKEND backend);
+
+int
+libsign_digest_set_backend(LIBSIGN_DIGEST_BACKEND backend);
+
+LIBSIGN_DIGEST_BACKEND
+libsign_digest_backend(void);
 
 EVP_PKEY *
 libsign_key_load(const char *path);
@@ -195,9 +394,22 @@ libsign_key_load(const char *path);
 void
 libsign_key_unload(EVP_PKEY *key);
 
+LIBSIGN_CIPHER_ALG
+libsign_key_cipher_alg(EVP_PKEY *key);
+
+const char *
+libsign_cipher_name(LIBSIGN_CIPHER_ALG cipher_alg);
+
+LIBSIGN_CIPHER_ALG
+libsign_cipher_alg_from_name(const char *name);
+
 X509 *
 libsign_x509_load(const char *path);
 
+int
+libsign_x509_load_bundle(const char *path, X509 **certs,
+			 unsigned int max_cert, unsigned int *nr_cert);
+
 void
 libsign_x509_unload(X509 *cert);
 
@@ -49,12 +49,31 @@ typedef struct __libsign_signaturelet {
 	const char *description;
 	LIBSIGN_DIGEST_ALG digest_alg;
 	LIBSIGN_CIPHER_ALG cipher_alg;
+	/*
+	 * Optional. The cipher algorithms of the key supported besides the
+	 * cipher_alg, terminated by LIBSIGN_CIPHER_ALG_NONE.
+	 */
+	const LIBSIGN_CIPHER_ALG *extra_cipher_algs;
 	bool detached;
+	/*
+	 * The key and the certificates are the references parsed by the
+	 * keystore, shared by all files of a request.
+	 */
 	int (*sign)(libsign_signaturelet_t *siglet, uint8_t *data,
-		    unsigned int data_size, const char *key,
-		    const char **cert_list, unsigned int nr_cert,
-		    uint8_t **out_sig, unsigned int *out_sig_size,
+		    size_t data_size, EVP_PKEY *key,
+		    X509 **cert_list, unsigned int nr_cert,
+		    uint8_t **out_sig, size_t *out_sig_size,
 		    unsigned long flags);
+	/*
+	 * Optional. Sign the digest of the signed content rather than the
+	 * content itself, if neither the content nor the signed data is
+	 * attached to the signature.
+	 */
+	int (*sign_digest)(libsign_signaturelet_t *siglet, uint8_t *digest,
+			   unsigned int digest_size, EVP_PKEY *key,
+			   X509 **cert_list, unsigned int nr_cert,
+			   uint8_t **out_sig, size_t *out_sig_size,
+			   unsigned long flags);
 	const signaturelet_suffix_pattern_t **suffix_pattern;
 } libsign_signaturelet_t;
 
@@ -72,9 +91,23 @@ signaturelet_suffix_pattern(const char *id, unsigned long flags,
 			    const char **suffix_pattern);
 
 int
-signaturelet_sign(const char *id, uint8_t *data, unsigned int data_size,
-		  const char *key, const char **cert_list,
+signaturelet_sign(const char *id, uint8_t *data, size_t data_size,
+		  EVP_PKEY *key, X509 **cert_list,
 		  unsigned int nr_cert, uint8_t **out_sig,
-		  unsigned int *out_sig_size, unsigned long flags);
+		  size_t *out_sig_size, unsigned long flags);
+
+bool
+signaturelet_cipher_supported(const char *id, LIBSIGN_CIPHER_ALG cipher_alg);
+
+bool
+signaturelet_digest_only(const char *id, unsigned long flags,
+			 LIBSIGN_DIGEST_ALG *digest_alg);
+
+int
+signaturelet_sign_digest(const char *id, uint8_t *digest,
+			 unsigned int digest_size, EVP_PKEY *key,
+			 X509 **cert_list, unsigned int nr_cert,
+			 uint8_t **out_sig, size_t *out_sig_size,
+			 unsigned long flags);
 
 #endif	/* SIGNATURELET_H */
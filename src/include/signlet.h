@@ -36,33 +36,138 @@
 
 #include <libsign.h>
 
-#define SIGNLET_MAX_NR_REQUEST			256
 #define SIGNLET_MAX_NR_CERT			16
 
 #define SIGNLET_FLAGS_CONTENT_ATTACHED		(1 << 0)
 #define SIGNLET_FLAGS_DETACHED_SIGNATURE	(1 << 1)
 
+typedef enum {
+	/* Not signed yet */
+	SIGNLET_FILE_PENDING,
+	/* The signature file is written */
+	SIGNLET_FILE_SIGNED,
+	SIGNLET_FILE_FAILED,
+	/* Not signed because the job was cancelled or another file failed */
+	SIGNLET_FILE_CANCELLED,
+	/* Not signed again because the journal has it signed already */
+	SIGNLET_FILE_SKIPPED,
+} SIGNLET_FILE_STATUS;
+
+/*
+ * Called from the worker threads once a file of the job is signed or
+ * failed. The index is the position of the file in the signed file list,
+ * or in the order the file is streamed.
+ */
+typedef void (*signlet_progress_t)(const char *id, unsigned int index,
+				   const char *signed_file,
+				   SIGNLET_FILE_STATUS status, void *data);
+
+/*
+ * Return the next file to be signed in signed_file, and optionally the
+ * path of its signature file in output_file, or set signed_file to NULL
+ * at the end of files. The strings are copied before the next call.
+ * Called from one worker thread at a time. Return EXIT_FAILURE to fail
+ * the job.
+ */
+typedef int (*signlet_next_file_t)(void *data, const char **signed_file,
+				   const char **output_file);
+
 typedef struct {
 	const char *siglet;
 	const char **signed_file_list;
 	const char **output_file_list;
+	/*
+	 * Instead of the lists, the files may be streamed from the callback
+	 * so that only the files in flight are held in memory. The result
+	 * of each file is only reported to the progress callback then, and
+	 * the files are signed by the threads even if the processes is set.
+	 * The signature files of a list request are only committed if all
+	 * files are signed, while those of the streamed files reported
+	 * signed are kept even if the job fails or is cancelled.
+	 */
+	signlet_next_file_t next_file;
+	void *next_file_data;
 	const char *key;
+	/*
+	 * The signer certificate followed by its chain. Each file may hold
+	 * several certificates, PEM-encoded or DER-encoded.
+	 */
 	const char **cert_list;
 	unsigned long flags;
 	LIBSIGN_DIGEST_ALG digest_alg;
+	/*
+	 * The cipher algorithm the key is expected to be of, or
+	 * LIBSIGN_CIPHER_ALG_NONE to use whatever the key is.
+	 */
 	LIBSIGN_CIPHER_ALG cipher_alg;
+	LIBSIGN_DURABILITY durability;
+	/*
+	 * The number of worker threads signing the files concurrently. If
+	 * 0 or 1, the files are passed through a pipeline of the reader,
+	 * digest, sign and writer stages instead, unless a single file is
+	 * signed in the calling thread.
+	 */
+	unsigned int jobs;
+	/*
+	 * If greater than 1, the files are signed by this number of worker
+	 * processes forked after the request is parsed and the siglet is
+	 * loaded, instead of by the threads. The jobs is ignored then.
+	 */
+	unsigned int processes;
+	/*
+	 * How the worker threads or processes are placed on the CPUs. With
+	 * any policy but none, the worker threads split the files among the
+	 * nodes, and the workers on a node take the files of other nodes
+	 * only once its own files are dispatched.
+	 */
+	LIBSIGN_PLACEMENT placement;
+	/*
+	 * The maximum bytes of file data held in memory at once by all
+	 * workers, or 0 if unlimited. A file larger than the limit is
+	 * admitted alone, or streamed if only its digest is signed.
+	 */
+	uint64_t memory_limit;
+	/*
+	 * The additional digests calculated in the same pass as signing,
+	 * terminated by LIBSIGN_DIGEST_ALG_NONE. Each of them is saved to
+	 * <signed_file>.<alg> in the format of sha*sum(1).
+	 */
+	const LIBSIGN_DIGEST_ALG *extra_digest_algs;
+	/*
+	 * The path of the journal recording the signed files, if the job
+	 * may be resumed. The files recorded with the same identity (device,
+	 * inode, size and mtime) and the same signature file are skipped,
+	 * so a file rewritten in place keeping its size and mtime is not
+	 * signed again. With the journal, the signature files done are
+	 * committed even if the job fails or is cancelled.
+	 */
+	const char *journal;
+	/* Optional */
+	signlet_progress_t progress;
+	void *progress_data;
 } signlet_request_t;
 
 int
-signlet_request(signlet_request_t *request);
+signlet_request(signlet_request_t *request, const char **id);
 
 int
 signlet_wait(const char *id);
 
+int
+signlet_wait_any(const char **id);
+
 int
 signlet_cancel(const char *id);
 
 int
 signlet_finish(const char *id);
 
+int
+signlet_file_status(const char *id, unsigned int index,
+		    SIGNLET_FILE_STATUS *status);
+
+/* The peak bytes of file data held in memory by the finished job */
+int
+signlet_memory_peak(const char *id, uint64_t *peak);
+
 #endif	/* SIGNLET_H */
@@ -51,6 +51,12 @@ bcll_init(bcll_t *head)
 	head->next = head->prev = head;
 }
 
+static inline bool
+bcll_empty(const bcll_t *head)
+{
+	return head->next == head;
+}
+
 static inline void
 __bcll_add(bcll_t *head, bcll_t *entry)
 {
@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2017, Wind River Systems, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1) Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2) Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3) Neither the name of Wind River Systems nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Author:
+ *        Lans Zhang <jia.zhang@windriver.com>
+ */
+
+#include "budget.h"
+#include "shared_lock.h"
+
+/* The budget charged to the worker of this process, if it is a worker */
+static budget_t *bound_budget;
+static unsigned int bound_worker;
+
+static size_t
+budget_size(unsigned int nr_worker)
+{
+	return sizeof(budget_t) + nr_worker * sizeof(uint64_t);
+}
+
+budget_t *
+budget_create(uint64_t limit, unsigned int nr_worker)
+{
+	budget_t *budget = mmap(NULL, budget_size(nr_worker),
+				PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (budget == MAP_FAILED)
+		return NULL;
+
+	if (shared_lock_init(&budget->lock, &budget->cond)) {
+		munmap(budget, budget_size(nr_worker));
+		return NULL;
+	}
+
+	/* The anonymous mapping is zero-filled */
+	budget->limit = limit;
+	budget->nr_worker = nr_worker;
+
+	return budget;
+}
+
+void
+budget_destroy(budget_t *budget)
+{
+	pthread_cond_destroy(&budget->cond);
+	pthread_mutex_destroy(&budget->lock);
+	munmap(budget, budget_size(budget->nr_worker));
+}
+
+static uint64_t
+charge_size(budget_t *budget, uint64_t size)
+{
+	if (budget->limit && size > budget->limit)
+		return budget->limit;
+
+	return size;
+}
+
+static void
+charge(budget_t *budget, uint64_t charged)
+{
+	budget->used += charged;
+	if (budget->used > budget->peak)
+		budget->peak = budget->used;
+
+	if (budget == bound_budget)
+		budget->worker_charged[bound_worker] += charged;
+}
+
+uint64_t
+budget_acquire(budget_t *budget, uint64_t size)
+{
+	if (!budget || !size)
+		return 0;
+
+	uint64_t charged = charge_size(budget, size);
+
+	shared_lock(&budget->lock);
+
+	while (budget->limit && budget->used + charged > budget->limit)
+		shared_cond_wait(&budget->cond, &budget->lock);
+
+	charge(budget, charged);
+
+	pthread_mutex_unlock(&budget->lock);
+
+	return charged;
+}
+
+bool
+budget_try_acquire(budget_t *budget, uint64_t size, uint64_t *charged)
+{
+	*charged = 0;
+
+	if (!budget || !size)
+		return true;
+
+	uint64_t charging = charge_size(budget, size);
+	bool admitted = false;
+
+	shared_lock(&budget->lock);
+
+	if (!budget->limit || budget->used + charging <= budget->limit) {
+		charge(budget, charging);
+		*charged = charging;
+		admitted = true;
+	}
+
+	pthread_mutex_unlock(&budget->lock);
+
+	return admitted;
+}
+
+void
+budget_release(budget_t *budget, uint64_t charged)
+{
+	if (!budget || !charged)
+		return;
+
+	shared_lock(&budget->lock);
+	budget->used -= charged;
+	if (budget == bound_budget)
+		budget->worker_charged[bound_worker] -= charged;
+	pthread_mutex_unlock(&budget->lock);
+
+	pthread_cond_broadcast(&budget->cond);
+}
+
+uint64_t
+budget_peak(budget_t *budget)
+{
+	shared_lock(&budget->lock);
+	uint64_t peak = budget->peak;
+	pthread_mutex_unlock(&budget->lock);
+
+	return peak;
+}
+
+void
+budget_bind_worker(budget_t *budget, unsigned int worker)
+{
+	if (!budget || worker >= budget->nr_worker)
+		return;
+
+	bound_budget = budget;
+	bound_worker = worker;
+}
+
+void
+budget_reclaim_worker(budget_t *budget, unsigned int worker)
+{
+	if (!budget || worker >= budget->nr_worker)
+		return;
+
+	shared_lock(&budget->lock);
+	uint64_t charged = budget->worker_charged[worker];
+	budget->used -= charged;
+	budget->worker_charged[worker] = 0;
+	pthread_mutex_unlock(&budget->lock);
+
+	if (charged) {
+		warn("Returned %llu bytes left charged by the worker %u\n",
+		     (unsigned long long)charged, worker);
+		pthread_cond_broadcast(&budget->cond);
+	}
+}
@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2017, Wind River Systems, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1) Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2) Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3) Neither the name of Wind River Systems nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Author:
+ *        Lans Zhang <jia.zhang@windriver.com>
+ */
+
+#ifndef __BUDGET_H__
+#define __BUDGET_H__
+
+#include <libsign.h>
+
+/*
+ * The budget caps the bytes of file data held in memory at once by all
+ * workers of a job, including the worker processes. A request larger
+ * than the limit is charged as the whole limit, so it is admitted
+ * alone rather than never.
+ */
+
+typedef struct {
+	/* Robust and process-shared */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* 0 if unlimited */
+	uint64_t limit;
+	uint64_t used;
+	uint64_t peak;
+	unsigned int nr_worker;
+	/*
+	 * The bytes held by each worker process, returned by the parent
+	 * if the worker dies before releasing them.
+	 */
+	uint64_t worker_charged[];
+} budget_t;
+
+/* The number of the worker processes charging the budget, if any */
+budget_t *
+budget_create(uint64_t limit, unsigned int nr_worker);
+
+void
+budget_destroy(budget_t *budget);
+
+/* Wait until the size is admitted, and return the bytes charged */
+uint64_t
+budget_acquire(budget_t *budget, uint64_t size);
+
+/* Return false without waiting if the size is not admitted now */
+bool
+budget_try_acquire(budget_t *budget, uint64_t size, uint64_t *charged);
+
+void
+budget_release(budget_t *budget, uint64_t charged);
+
+uint64_t
+budget_peak(budget_t *budget);
+
+/* Charge to the worker in the calling process from now on */
+void
+budget_bind_worker(budget_t *budget, unsigned int worker);
+
+/*
+ * Return the bytes left charged by the worker terminated abnormally,
+ * and wake up the workers waiting for them.
+ */
+void
+budget_reclaim_worker(budget_t *budget, unsigned int worker);
+
+#endif	/* __BUDGET_H__ */
@@ -32,6 +32,11 @@
  */
 
 #include <libsign.h>
+#include <sys/socket.h>
+#include <linux/if_alg.h>
+#include "sha256_mb.h"
+#include "io.h"
+#include "digest.h"
 
 #if 0
 static int
@@ -50,6 +55,35 @@ libsign_digest_supported(LIBSIGN_DIGEST_ALG digest_alg)
 	       digest_alg < LIBSIGN_DIGEST_ALG_MAX;
 }
 
+static const char *digest_names[LIBSIGN_DIGEST_ALG_MAX] = {
+	[LIBSIGN_DIGEST_ALG_SHA224] = "sha224",
+	[LIBSIGN_DIGEST_ALG_SHA256] = "sha256",
+	[LIBSIGN_DIGEST_ALG_SHA384] = "sha384",
+	[LIBSIGN_DIGEST_ALG_SHA512] = "sha512",
+	[LIBSIGN_DIGEST_ALG_SHA1] = "sha1",
+};
+
+const char *
+libsign_digest_name(LIBSIGN_DIGEST_ALG digest_alg)
+{
+	if (!libsign_digest_supported(digest_alg))
+		return NULL;
+
+	return digest_names[digest_alg];
+}
+
+LIBSIGN_DIGEST_ALG
+libsign_digest_alg_from_name(const char *name)
+{
+	for (int i = LIBSIGN_DIGEST_ALG_NONE + 1; i < LIBSIGN_DIGEST_ALG_MAX;
+	     ++i) {
+		if (!strcasecmp(name, digest_names[i]))
+			return i;
+	}
+
+	return LIBSIGN_DIGEST_ALG_NONE;
+}
+
 int
 libsign_digest_init(LIBSIGN_DIGEST_ALG digest_alg)
 {
@@ -81,35 +115,178 @@ libsign_digest_init(LIBSIGN_DIGEST_ALG digest_alg)
 	return EXIT_SUCCESS;
 }
 
+/*
+ * The digest objects fetched once from the provider, one per algorithm,
+ * until released by digest_fini()
+ */
+static EVP_MD *digest_mds[LIBSIGN_DIGEST_ALG_MAX];
+static pthread_mutex_t digest_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool digest_fetched;
+
+/* The number of idle contexts kept by each thread for an algorithm */
+#define DIGEST_CTX_POOL_DEPTH		4
+
+typedef struct {
+	unsigned int nr_ctx[LIBSIGN_DIGEST_ALG_MAX];
+	EVP_MD_CTX *ctx[LIBSIGN_DIGEST_ALG_MAX][DIGEST_CTX_POOL_DEPTH];
+} digest_ctx_pool_t;
+
+static pthread_key_t digest_ctx_pool_key;
+static bool digest_ctx_pool_ready;
+
+static void
+release_ctx_pool(void *data)
+{
+	digest_ctx_pool_t *pool = data;
+
+	for (int i = 0; i < LIBSIGN_DIGEST_ALG_MAX; ++i) {
+		while (pool->nr_ctx[i])
+			EVP_MD_CTX_free(pool->ctx[i][--pool->nr_ctx[i]]);
+	}
+
+	free(pool);
+}
+
+static void
+fetch_digests(void)
+{
+	for (int i = LIBSIGN_DIGEST_ALG_NONE + 1; i < LIBSIGN_DIGEST_ALG_MAX;
+	     ++i) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		digest_mds[i] = EVP_MD_fetch(NULL, digest_names[i], NULL);
+#else
+		digest_mds[i] = (EVP_MD *)EVP_get_digestbyname(digest_names[i]);
+#endif
+		if (!digest_mds[i])
+			err("Failed to fetch the digest algorithm %s\n",
+			    digest_names[i]);
+	}
+
+	if (!digest_ctx_pool_ready)
+		digest_ctx_pool_ready = !pthread_key_create(&digest_ctx_pool_key,
+							    release_ctx_pool);
+}
+
 static const EVP_MD *
 to_EVP_MD(LIBSIGN_DIGEST_ALG digest_alg)
 {
-	if (!libsign_digest_supported(digest_alg)) {
+	if (!libsign_digest_supported(digest_alg) ||
+	    digest_alg == LIBSIGN_DIGEST_ALG_NONE) {
 		err("Unsupported digest algorithm %#x\n", digest_alg);
 		return NULL;
 	}
 
-	switch (digest_alg) {
-	case LIBSIGN_DIGEST_ALG_SHA224:
-		return EVP_sha224();
-	case LIBSIGN_DIGEST_ALG_SHA256:
-		return EVP_sha256();
-	case LIBSIGN_DIGEST_ALG_SHA384:
-		return EVP_sha384();
-	case LIBSIGN_DIGEST_ALG_SHA512:
-		return EVP_sha512();
-	case LIBSIGN_DIGEST_ALG_SHA1:
-		return EVP_sha1();
-	default:
-		break;
+	if (!__atomic_load_n(&digest_fetched, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&digest_lock);
+		if (!digest_fetched) {
+			fetch_digests();
+			__atomic_store_n(&digest_fetched, true,
+					 __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&digest_lock);
 	}
 
-	return NULL;
+	return digest_mds[digest_alg];
+}
+
+static digest_ctx_pool_t *
+get_ctx_pool(void)
+{
+	if (!digest_ctx_pool_ready)
+		return NULL;
+
+	digest_ctx_pool_t *pool = pthread_getspecific(digest_ctx_pool_key);
+	if (pool)
+		return pool;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+
+	if (pthread_setspecific(digest_ctx_pool_key, pool)) {
+		free(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+/*
+ * Get a context initialized for the digest algorithm. A context reused
+ * from the pool of the calling thread was used with the same algorithm,
+ * so the provider context is reinitialized rather than fetched again.
+ */
+static EVP_MD_CTX *
+get_md_ctx(LIBSIGN_DIGEST_ALG digest_alg)
+{
+	const EVP_MD *md = to_EVP_MD(digest_alg);
+	if (!md)
+		return NULL;
+
+	digest_ctx_pool_t *pool = get_ctx_pool();
+	EVP_MD_CTX *md_ctx;
+
+	if (pool && pool->nr_ctx[digest_alg])
+		md_ctx = pool->ctx[digest_alg][--pool->nr_ctx[digest_alg]];
+	else {
+		md_ctx = EVP_MD_CTX_new();
+		if (!md_ctx)
+			return NULL;
+	}
+
+	if (!EVP_DigestInit_ex(md_ctx, md, NULL)) {
+		ERR_print_errors_fp(stderr);
+		EVP_MD_CTX_free(md_ctx);
+		return NULL;
+	}
+
+	return md_ctx;
+}
+
+static void
+put_md_ctx(LIBSIGN_DIGEST_ALG digest_alg, EVP_MD_CTX *md_ctx)
+{
+	if (!md_ctx)
+		return;
+
+	digest_ctx_pool_t *pool = get_ctx_pool();
+
+	if (pool && pool->nr_ctx[digest_alg] < DIGEST_CTX_POOL_DEPTH)
+		pool->ctx[digest_alg][pool->nr_ctx[digest_alg]++] = md_ctx;
+	else
+		EVP_MD_CTX_free(md_ctx);
+}
+
+void
+digest_fini(void)
+{
+	if (digest_ctx_pool_ready) {
+		digest_ctx_pool_t *pool;
+
+		pool = pthread_getspecific(digest_ctx_pool_key);
+		if (pool) {
+			pthread_setspecific(digest_ctx_pool_key, NULL);
+			release_ctx_pool(pool);
+		}
+	}
+
+	pthread_mutex_lock(&digest_lock);
+
+	for (int i = 0; i < LIBSIGN_DIGEST_ALG_MAX; ++i) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		EVP_MD_free(digest_mds[i]);
+#endif
+		digest_mds[i] = NULL;
+	}
+
+	__atomic_store_n(&digest_fetched, false, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&digest_lock);
 }
 
 int
 libsign_digest_calculate(LIBSIGN_DIGEST_ALG digest_alg, uint8_t *data,
-			 unsigned int data_size, uint8_t **digest)
+			 size_t data_size, uint8_t **digest)
 {
 	if (!digest)
 		return EXIT_FAILURE;
@@ -117,53 +294,639 @@ libsign_digest_calculate(LIBSIGN_DIGEST_ALG digest_alg, uint8_t *data,
 	if (data_size && !data)
 		return EXIT_FAILURE;
 
-	unsigned int digest_size;
-	int rc = libsign_digest_size(digest_alg, &digest_size);
+	libsign_digest_ctx_t ctx;
+	int rc = libsign_digest_ctx_init(&ctx, digest_alg);
 	if (rc)
 		return rc;
 
-	uint8_t *digest_calc = malloc(digest_size);
-	if (!digest_calc)
+	rc = libsign_digest_ctx_update(&ctx, data, data_size);
+	if (rc) {
+		libsign_digest_ctx_release(&ctx);
+		return rc;
+	}
+
+	return libsign_digest_ctx_final(&ctx, digest);
+}
+
+int
+libsign_digest_ctx_init(libsign_digest_ctx_t *ctx,
+			LIBSIGN_DIGEST_ALG digest_alg)
+{
+	if (!ctx)
+		return EXIT_FAILURE;
+
+	EVP_MD_CTX *md_ctx = get_md_ctx(digest_alg);
+	if (!md_ctx)
+		return EXIT_FAILURE;
+
+	ctx->digest_alg = digest_alg;
+	ctx->md_ctx = md_ctx;
+
+	return EXIT_SUCCESS;
+}
+
+int
+libsign_digest_ctx_update(libsign_digest_ctx_t *ctx, const void *data,
+			  size_t data_size)
+{
+	if (!ctx || !ctx->md_ctx)
 		return EXIT_FAILURE;
 
-	if (!EVP_Digest(data, data_size, digest_calc, &digest_size,
-			to_EVP_MD(digest_alg), NULL)) {
+	if (data_size && !data)
+		return EXIT_FAILURE;
+
+	if (!EVP_DigestUpdate(ctx->md_ctx, data, data_size)) {
 		ERR_print_errors_fp(stderr);
 		return EXIT_FAILURE;
 	}
 
+	return EXIT_SUCCESS;
+}
+
+int
+libsign_digest_ctx_final(libsign_digest_ctx_t *ctx, uint8_t **digest)
+{
+	if (!ctx || !ctx->md_ctx || !digest)
+		return EXIT_FAILURE;
+
+	unsigned int digest_size;
+	int rc = libsign_digest_size(ctx->digest_alg, &digest_size);
+	if (rc)
+		goto out;
+
+	rc = EXIT_FAILURE;
+
+	uint8_t *digest_calc = malloc(digest_size);
+	if (!digest_calc)
+		goto out;
+
+	if (!EVP_DigestFinal_ex(ctx->md_ctx, digest_calc, &digest_size)) {
+		ERR_print_errors_fp(stderr);
+		free(digest_calc);
+		goto out;
+	}
+
 	*digest = digest_calc;
+	rc = EXIT_SUCCESS;
+
+out:
+	libsign_digest_ctx_release(ctx);
+
+	return rc;
+}
+
+/*
+ * The released context goes back to the pool of the calling thread
+ * without being reset.
+ */
+void
+libsign_digest_ctx_release(libsign_digest_ctx_t *ctx)
+{
+	if (!ctx)
+		return;
+
+	put_md_ctx(ctx->digest_alg, ctx->md_ctx);
+	ctx->md_ctx = NULL;
+}
+
+/*
+ * Calculate the digests of a batch of independent inputs. The SHA-256
+ * digests are hashed by the multi-buffer engine in the SIMD lanes if
+ * it is faster on this CPU.
+ */
+int
+libsign_digest_batch(LIBSIGN_DIGEST_ALG digest_alg, uint8_t **data,
+		     size_t *data_size, unsigned int nr, uint8_t **digests)
+{
+	if (!data || !data_size || !digests)
+		return EXIT_FAILURE;
+
+	unsigned int i;
+
+	for (i = 0; i < nr; ++i) {
+		if (data_size[i] && !data[i])
+			return EXIT_FAILURE;
+	}
+
+	if (digest_alg != LIBSIGN_DIGEST_ALG_SHA256 || nr < 2 ||
+	    !sha256_mb_lanes()) {
+		for (i = 0; i < nr; ++i) {
+			if (libsign_digest_calculate(digest_alg, data[i],
+						     data_size[i],
+						     digests + i))
+				goto err;
+		}
+
+		return EXIT_SUCCESS;
+	}
+
+	uint8_t (*digest_calc)[SHA256_MB_DIGEST_SIZE];
+
+	digest_calc = malloc(nr * sizeof(*digest_calc));
+	if (!digest_calc)
+		return EXIT_FAILURE;
+
+	sha256_mb((const uint8_t *const *)data, data_size, nr, digest_calc);
+
+	for (i = 0; i < nr; ++i) {
+		digests[i] = malloc(SHA256_MB_DIGEST_SIZE);
+		if (!digests[i]) {
+			free(digest_calc);
+			goto err;
+		}
+
+		memcpy(digests[i], digest_calc[i], SHA256_MB_DIGEST_SIZE);
+	}
+
+	free(digest_calc);
 
 	return EXIT_SUCCESS;
+
+err:
+	while ((int)--i >= 0)
+		free(digests[i]);
+
+	return EXIT_FAILURE;
 }
 
+static LIBSIGN_DIGEST_BACKEND digest_backend = LIBSIGN_DIGEST_BACKEND_OPENSSL;
+
 int
-libsign_digest_size(LIBSIGN_DIGEST_ALG digest_alg, unsigned int *digest_size)
+libsign_digest_multi_init(libsign_digest_multi_ctx_t *ctx,
+			  const LIBSIGN_DIGEST_ALG *digest_algs,
+			  unsigned int nr_digest_alg)
 {
-	if (!libsign_digest_supported(digest_alg)) {
-		err("Unsupported digest algorithm %#x\n", digest_alg);
+	if (!ctx || !digest_algs || !nr_digest_alg ||
+	    nr_digest_alg > LIBSIGN_DIGEST_ALG_MAX)
 		return EXIT_FAILURE;
+
+	ctx->nr_ctx = 0;
+
+	for (unsigned int i = 0; i < nr_digest_alg; ++i) {
+		if (libsign_digest_ctx_init(ctx->ctx + i, digest_algs[i])) {
+			libsign_digest_multi_release(ctx);
+			return EXIT_FAILURE;
+		}
+
+		++ctx->nr_ctx;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Feed the same chunk to all digests while it is still hot in cache.
+ */
+int
+libsign_digest_multi_update(libsign_digest_multi_ctx_t *ctx,
+			    const void *data, size_t data_size)
+{
+	if (!ctx)
+		return EXIT_FAILURE;
+
+	for (unsigned int i = 0; i < ctx->nr_ctx; ++i) {
+		if (libsign_digest_ctx_update(ctx->ctx + i, data, data_size))
+			return EXIT_FAILURE;
 	}
 
+	return EXIT_SUCCESS;
+}
+
+int
+libsign_digest_multi_final(libsign_digest_multi_ctx_t *ctx,
+			   uint8_t **digests)
+{
+	if (!ctx || !digests)
+		return EXIT_FAILURE;
+
+	unsigned int i;
+
+	for (i = 0; i < ctx->nr_ctx; ++i) {
+		if (libsign_digest_ctx_final(ctx->ctx + i, digests + i))
+			break;
+	}
+
+	if (i == ctx->nr_ctx) {
+		ctx->nr_ctx = 0;
+		return EXIT_SUCCESS;
+	}
+
+	while ((int)--i >= 0)
+		free(digests[i]);
+
+	libsign_digest_multi_release(ctx);
+
+	return EXIT_FAILURE;
+}
+
+void
+libsign_digest_multi_release(libsign_digest_multi_ctx_t *ctx)
+{
+	if (!ctx)
+		return;
+
+	for (unsigned int i = 0; i < ctx->nr_ctx; ++i)
+		libsign_digest_ctx_release(ctx->ctx + i);
+
+	ctx->nr_ctx = 0;
+}
+
+/*
+ * Calculate the digests of a file with the constant memory footprint,
+ * regardless of the file size. The file is read only once for all
+ * digests.
+ */
+int
+libsign_digest_multi_fd(const LIBSIGN_DIGEST_ALG *digest_algs,
+			unsigned int nr_digest_alg, int fd, uint8_t **digests)
+{
+	if (fd < 0 || !digests)
+		return EXIT_FAILURE;
+
+	io_reader_t reader;
+
+	if (io_reader_open(&reader, fd))
+		return EXIT_FAILURE;
+
+	int rc = EXIT_FAILURE;
+	libsign_digest_multi_ctx_t ctx;
+
+	if (libsign_digest_multi_init(&ctx, digest_algs, nr_digest_alg))
+		goto err_ctx_init;
+
+	uint64_t size = 0;
+
+	while (1) {
+		const uint8_t *buf;
+		ssize_t len = io_reader_read(&reader, &buf);
+		if (len < 0)
+			goto err_read;
+
+		if (!len)
+			break;
+
+		if (libsign_digest_multi_update(&ctx, buf, len))
+			goto err_read;
+
+		size += len;
+	}
+
+	if (!size) {
+		err("Empty input file\n");
+		goto err_read;
+	}
+
+	rc = libsign_digest_multi_final(&ctx, digests);
+	goto err_ctx_init;
+
+err_read:
+	libsign_digest_multi_release(&ctx);
+
+err_ctx_init:
+	io_reader_close(&reader);
+
+	return rc;
+}
+
+static const char *
+to_af_alg_name(LIBSIGN_DIGEST_ALG digest_alg)
+{
 	switch (digest_alg) {
 	case LIBSIGN_DIGEST_ALG_SHA224:
-		*digest_size = EVP_MD_size(EVP_sha224());
-		break;
+		return "sha224";
 	case LIBSIGN_DIGEST_ALG_SHA256:
-		*digest_size = EVP_MD_size(EVP_sha256());
-		break;
+		return "sha256";
 	case LIBSIGN_DIGEST_ALG_SHA384:
-		*digest_size = EVP_MD_size(EVP_sha384());
-		break;
+		return "sha384";
 	case LIBSIGN_DIGEST_ALG_SHA512:
-		*digest_size = EVP_MD_size(EVP_sha512());
-		break;
+		return "sha512";
 	case LIBSIGN_DIGEST_ALG_SHA1:
-		*digest_size = EVP_MD_size(EVP_sha1());
-		break;
+		return "sha1";
 	default:
+		break;
+	}
+
+	return NULL;
+}
+
+/* The bound transformation sockets, one per digest algorithm */
+static int af_alg_tfm_fds[LIBSIGN_DIGEST_ALG_MAX];
+
+static int
+af_alg_open(LIBSIGN_DIGEST_ALG digest_alg)
+{
+	if (!libsign_digest_supported(digest_alg))
+		return -1;
+
+	const char *name = to_af_alg_name(digest_alg);
+	if (!name)
+		return -1;
+
+	/* The slot holds the socket plus one, so 0 means not bound yet */
+	int tfm_fd = __atomic_load_n(af_alg_tfm_fds + digest_alg,
+				     __ATOMIC_ACQUIRE) - 1;
+	if (tfm_fd < 0) {
+		struct sockaddr_alg sa = {
+			.salg_family = AF_ALG,
+			.salg_type = "hash",
+		};
+
+		strncpy((char *)sa.salg_name, name, sizeof(sa.salg_name) - 1);
+
+		tfm_fd = socket(AF_ALG, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+		if (tfm_fd < 0) {
+			dbg("AF_ALG is not supported\n");
+			return -1;
+		}
+
+		if (bind(tfm_fd, (struct sockaddr *)&sa, sizeof(sa))) {
+			dbg("AF_ALG doesn't support %s\n", name);
+			close(tfm_fd);
+			return -1;
+		}
+
+		int expected = 0;
+
+		if (!__atomic_compare_exchange_n(af_alg_tfm_fds + digest_alg,
+						 &expected, tfm_fd + 1, false,
+						 __ATOMIC_ACQ_REL,
+						 __ATOMIC_ACQUIRE)) {
+			/* Another thread won the race */
+			close(tfm_fd);
+			tfm_fd = expected - 1;
+		}
+	}
+
+	return accept4(tfm_fd, NULL, 0, SOCK_CLOEXEC);
+}
+
+static int
+af_alg_final(int op_fd, LIBSIGN_DIGEST_ALG digest_alg, uint8_t **digest)
+{
+	unsigned int digest_size;
+
+	if (libsign_digest_size(digest_alg, &digest_size))
+		return EXIT_FAILURE;
+
+	uint8_t *digest_calc = malloc(digest_size);
+	if (!digest_calc)
+		return EXIT_FAILURE;
+
+	if (read(op_fd, digest_calc, digest_size) != (ssize_t)digest_size) {
+		err("Failed to read the digest from AF_ALG\n");
+		free(digest_calc);
+		return EXIT_FAILURE;
+	}
+
+	*digest = digest_calc;
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Splice the pages of the file into the kernel hash through a pipe, so
+ * the file content never reaches the user space.
+ *
+ * Return -1 if the file can't be handled by AF_ALG at all, e.g, the
+ * kernel or the file system doesn't support it. The file offset is
+ * left untouched in this case so the caller can fall back.
+ */
+static int
+af_alg_digest_fd(LIBSIGN_DIGEST_ALG digest_alg, int fd, uint8_t **digest)
+{
+	struct stat st;
+
+	/* Only splice the regular file with the explicit offset */
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode))
+		return -1;
+
+	int op_fd = af_alg_open(digest_alg);
+	if (op_fd < 0)
+		return -1;
+
+	int pipe_fds[2];
+
+	if (pipe2(pipe_fds, O_CLOEXEC)) {
+		close(op_fd);
+		return -1;
+	}
+
+	fcntl(pipe_fds[1], F_SETPIPE_SZ, LIBSIGN_DIGEST_CHUNK_SIZE);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	int rc = -1;
+	loff_t offset = 0;
+	uint64_t hashed = 0;
+
+	while (1) {
+		ssize_t len = splice(fd, &offset, pipe_fds[1], NULL,
+				     LIBSIGN_DIGEST_CHUNK_SIZE, SPLICE_F_MORE);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+
+			/* Nothing is hashed yet, so still able to fall back */
+			if (!offset && errno == EINVAL)
+				goto out;
+
+			err("Failed to splice input file\n");
+			rc = EXIT_FAILURE;
+			goto out;
+		}
+
+		if (!len)
+			break;
+
+		while (len) {
+			ssize_t spliced = splice(pipe_fds[0], NULL, op_fd,
+						 NULL, len, SPLICE_F_MORE);
+			if (spliced < 0) {
+				if (errno == EINTR)
+					continue;
+
+				if (!hashed && errno == EINVAL)
+					goto out;
+
+				err("Failed to splice input file to "
+				    "AF_ALG\n");
+				rc = EXIT_FAILURE;
+				goto out;
+			}
+
+			if (!spliced) {
+				err("AF_ALG stopped accepting input\n");
+				rc = EXIT_FAILURE;
+				goto out;
+			}
+
+			len -= spliced;
+			hashed += spliced;
+		}
+	}
+
+	if (!hashed) {
+		err("Empty input file\n");
+		rc = EXIT_FAILURE;
+		goto out;
+	}
+
+	rc = af_alg_final(op_fd, digest_alg, digest);
+
+out:
+	close(pipe_fds[0]);
+	close(pipe_fds[1]);
+	close(op_fd);
+
+	return rc;
+}
+
+int
+libsign_digest_fd(LIBSIGN_DIGEST_ALG digest_alg, int fd, uint8_t **digest)
+{
+	if (fd < 0 || !digest)
+		return EXIT_FAILURE;
+
+	/* The file spliced into the kernel always goes via the page cache */
+	if (digest_backend == LIBSIGN_DIGEST_BACKEND_AF_ALG &&
+	    libsign_io_policy() != LIBSIGN_IO_POLICY_DIRECT) {
+		int rc = af_alg_digest_fd(digest_alg, fd, digest);
+		if (rc != -1)
+			return rc;
+
+		dbg("Falling back to OpenSSL digest\n");
+	}
+
+	return libsign_digest_multi_fd(&digest_alg, 1, fd, digest);
+}
+
+int
+libsign_digest_file(LIBSIGN_DIGEST_ALG digest_alg, const char *path,
+		    uint8_t **digest)
+{
+	if (!path || !digest)
+		return EXIT_FAILURE;
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		err("Failed to open %s\n", path);
+		return EXIT_FAILURE;
+	}
+
+	int rc = libsign_digest_fd(digest_alg, fd, digest);
+
+	close(fd);
+
+	return rc;
+}
+
+int
+libsign_digest_size(LIBSIGN_DIGEST_ALG digest_alg, unsigned int *digest_size)
+{
+	if (!libsign_digest_supported(digest_alg)) {
+		err("Unsupported digest algorithm %#x\n", digest_alg);
+		return EXIT_FAILURE;
+	}
+
+	if (digest_alg == LIBSIGN_DIGEST_ALG_NONE) {
 		*digest_size = 0;
+		return EXIT_SUCCESS;
+	}
+
+	const EVP_MD *md = to_EVP_MD(digest_alg);
+	if (!md)
+		return EXIT_FAILURE;
+
+	*digest_size = EVP_MD_size(md);
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Check the given backend produces the same digests as OpenSSL, with a
+ * memory file crossing a few chunks so the splice path is exercised.
+ */
+int
+libsign_digest_selftest(LIBSIGN_DIGEST_BACKEND backend)
+{
+	if (backend == LIBSIGN_DIGEST_BACKEND_OPENSSL)
+		return EXIT_SUCCESS;
+
+	if (backend != LIBSIGN_DIGEST_BACKEND_AF_ALG) {
+		err("Unsupported digest backend %d\n", backend);
+		return EXIT_FAILURE;
+	}
+
+	size_t size = LIBSIGN_DIGEST_CHUNK_SIZE * 2 + 4093;
+	uint8_t *data = malloc(size);
+	if (!data)
+		return EXIT_FAILURE;
+
+	for (size_t i = 0; i < size; ++i)
+		data[i] = (uint8_t)(i * 2654435761U >> 13);
+
+	int rc = EXIT_FAILURE;
+	int fd = memfd_create("libsign-digest-selftest", MFD_CLOEXEC);
+	if (fd < 0)
+		goto err_memfd;
+
+	if (write(fd, data, size) != (ssize_t)size)
+		goto err_write;
+
+	LIBSIGN_DIGEST_ALG digest_alg;
+
+	for (digest_alg = LIBSIGN_DIGEST_ALG_SHA224;
+	     digest_alg < LIBSIGN_DIGEST_ALG_MAX; ++digest_alg) {
+		uint8_t *expected, *digest;
+		unsigned int digest_size;
+
+		libsign_digest_size(digest_alg, &digest_size);
+
+		if (libsign_digest_calculate(digest_alg, data, size,
+					     &expected))
+			goto err_write;
+
+		int ret = af_alg_digest_fd(digest_alg, fd, &digest);
+		if (ret) {
+			err("Digest backend AF_ALG is unavailable for %s\n",
+			    to_af_alg_name(digest_alg));
+			free(expected);
+			goto err_write;
+		}
+
+		ret = memcmp(expected, digest, digest_size);
+		free(digest);
+		free(expected);
+		if (ret) {
+			err("Digest backend AF_ALG produced the wrong %s "
+			    "digest\n", to_af_alg_name(digest_alg));
+			goto err_write;
+		}
 	}
 
+	rc = EXIT_SUCCESS;
+
+err_write:
+	close(fd);
+
+err_memfd:
+	free(data);
+
+	return rc;
+}
+
+int
+libsign_digest_set_backend(LIBSIGN_DIGEST_BACKEND backend)
+{
+	if (libsign_digest_selftest(backend))
+		return EXIT_FAILURE;
+
+	digest_backend = backend;
+
 	return EXIT_SUCCESS;
 }
+
+LIBSIGN_DIGEST_BACKEND
+libsign_digest_backend(void)
+{
+	return digest_backend;
+}
@@ -31,7 +31,9 @@
  *        Lans Zhang <jia.zhang@windriver.com>
  */
 
-#include <libsign.h>
+#include "keystore.h"
+#include "pkcs11.h"
+#include "digest.h"
 
 void __attribute__ ((constructor))
 libsign_init(void)
@@ -39,7 +41,16 @@ libsign_init(void)
 	ERR_load_crypto_strings();
 }
 
-void __attribute__((destructor))
+/*
+ * Not a destructor, because it may run after OpenSSL is cleaned up at
+ * exit, or while the executor is still signing.
+ */
+void
 libsign_fini(void)
 {
+	digest_fini();
+	keystore_flush();
+#ifdef LIBSIGN_PKCS11
+	pkcs11_fini();
+#endif
 }
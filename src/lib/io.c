@@ -0,0 +1,317 @@
+/*
+ * Copyright (c) 2017, Wind River Systems, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1) Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2) Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3) Neither the name of Wind River Systems nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Author:
+ *        Lans Zhang <jia.zhang@windriver.com>
+ */
+
+#include <libsign.h>
+#include "io.h"
+#include "placement.h"
+
+/* The maximum number of idle chunk buffers pooled for each node */
+#define IO_BUF_POOL_MAX		16
+
+static LIBSIGN_IO_POLICY io_policy = LIBSIGN_IO_POLICY_BUFFERED;
+
+/* The idle chunk buffer kept by each thread for the next reader */
+static pthread_key_t io_buf_key;
+static pthread_once_t io_buf_once = PTHREAD_ONCE_INIT;
+static bool io_buf_key_ready;
+
+/* The idle chunk buffers left by the exited threads, by the node */
+static pthread_mutex_t io_buf_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static io_buf_t *io_buf_pool[PLACEMENT_MAX_NODE];
+static unsigned int io_buf_pool_size[PLACEMENT_MAX_NODE];
+
+int
+libsign_io_set_policy(LIBSIGN_IO_POLICY policy)
+{
+	if (policy < LIBSIGN_IO_POLICY_BUFFERED ||
+	    policy > LIBSIGN_IO_POLICY_DIRECT) {
+		err("Unsupported I/O policy %d\n", policy);
+		return EXIT_FAILURE;
+	}
+
+	io_policy = policy;
+
+	return EXIT_SUCCESS;
+}
+
+LIBSIGN_IO_POLICY
+libsign_io_policy(void)
+{
+	return io_policy;
+}
+
+static void
+free_buf(io_buf_t *buf)
+{
+	munmap(buf->data, LIBSIGN_DIGEST_CHUNK_SIZE);
+	free(buf);
+}
+
+static void
+pool_buf(void *data)
+{
+	io_buf_t *buf = data;
+
+	pthread_mutex_lock(&io_buf_pool_lock);
+
+	if (io_buf_pool_size[buf->node] < IO_BUF_POOL_MAX) {
+		buf->next = io_buf_pool[buf->node];
+		io_buf_pool[buf->node] = buf;
+		++io_buf_pool_size[buf->node];
+		buf = NULL;
+	}
+
+	pthread_mutex_unlock(&io_buf_pool_lock);
+
+	if (buf)
+		free_buf(buf);
+}
+
+static void
+create_buf_key(void)
+{
+	io_buf_key_ready = !pthread_key_create(&io_buf_key, pool_buf);
+}
+
+/*
+ * The buffer is taken from the node of the calling thread. A new one is
+ * mapped rather than allocated from the heap, so that its pages are
+ * first touched by the reader, on the node the reader is placed on.
+ */
+static io_buf_t *
+get_buf(void)
+{
+	unsigned int node = placement_current_node();
+	io_buf_t *buf;
+
+	pthread_once(&io_buf_once, create_buf_key);
+
+	if (io_buf_key_ready) {
+		buf = pthread_getspecific(io_buf_key);
+		if (buf) {
+			pthread_setspecific(io_buf_key, NULL);
+			if (buf->node == node)
+				return buf;
+
+			/* The thread has moved to another node */
+			pool_buf(buf);
+		}
+	}
+
+	pthread_mutex_lock(&io_buf_pool_lock);
+
+	buf = io_buf_pool[node];
+	if (buf) {
+		io_buf_pool[node] = buf->next;
+		--io_buf_pool_size[node];
+	}
+
+	pthread_mutex_unlock(&io_buf_pool_lock);
+
+	if (buf)
+		return buf;
+
+	buf = malloc(sizeof(*buf));
+	if (!buf)
+		return NULL;
+
+	/* Page aligned as required by O_DIRECT */
+	buf->data = mmap(NULL, LIBSIGN_DIGEST_CHUNK_SIZE,
+			 PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf->data == MAP_FAILED) {
+		free(buf);
+		return NULL;
+	}
+
+	buf->node = node;
+
+	return buf;
+}
+
+static void
+put_buf(io_buf_t *buf)
+{
+	if (io_buf_key_ready && !pthread_getspecific(io_buf_key) &&
+	    !pthread_setspecific(io_buf_key, buf))
+		return;
+
+	pool_buf(buf);
+}
+
+/*
+ * O_DIRECT cannot be set on the descriptor of the caller without
+ * affecting its other users, so the file is opened again.
+ */
+static int
+open_direct(int fd)
+{
+	char path[64];
+
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+
+	int direct_fd = open(path, O_RDONLY | O_DIRECT | O_CLOEXEC);
+	if (direct_fd < 0)
+		dbg("O_DIRECT not available (%s), falling back to the "
+		    "buffered read\n", strerror(errno));
+
+	return direct_fd;
+}
+
+static void
+issue_readahead(io_reader_t *reader)
+{
+	off_t end = reader->offset + IO_READAHEAD_WINDOW;
+
+	if (end > reader->size)
+		end = reader->size;
+
+	/* Top up the window once half of it has been consumed */
+	if (reader->readahead_offset - reader->offset >=
+	    IO_READAHEAD_WINDOW / 2 || reader->readahead_offset >= end)
+		return;
+
+	readahead(reader->fd, reader->readahead_offset,
+		  end - reader->readahead_offset);
+	reader->readahead_offset = end;
+}
+
+int
+io_reader_open(io_reader_t *reader, int fd)
+{
+	if (!reader || fd < 0)
+		return EXIT_FAILURE;
+
+	struct stat st;
+
+	if (fstat(fd, &st)) {
+		err("Failed to stat input file\n");
+		return EXIT_FAILURE;
+	}
+
+	reader->buf = get_buf();
+	if (!reader->buf) {
+		err("Failed to allocate the read buffer\n");
+		return EXIT_FAILURE;
+	}
+
+	reader->fd = fd;
+	reader->direct_fd = -1;
+	reader->policy = io_policy;
+	reader->size = S_ISREG(st.st_mode) ? st.st_size : -1;
+	reader->offset = 0;
+	reader->readahead_offset = 0;
+
+	if (reader->size < 0)
+		return EXIT_SUCCESS;
+
+	switch (reader->policy) {
+	case LIBSIGN_IO_POLICY_BUFFERED:
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		break;
+	case LIBSIGN_IO_POLICY_READAHEAD:
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		posix_fadvise(fd, 0, IO_READAHEAD_WINDOW, POSIX_FADV_WILLNEED);
+		reader->readahead_offset = reader->size < IO_READAHEAD_WINDOW ?
+					   reader->size : IO_READAHEAD_WINDOW;
+		break;
+	case LIBSIGN_IO_POLICY_DIRECT:
+		reader->direct_fd = open_direct(fd);
+		if (reader->direct_fd < 0)
+			posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		break;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Read the next chunk of the file. Return the length of the chunk, 0 at
+ * the end of file, or -1 on error. The chunk is valid until the next
+ * call.
+ */
+ssize_t
+io_reader_read(io_reader_t *reader, const uint8_t **data)
+{
+	ssize_t len;
+
+	if (reader->policy == LIBSIGN_IO_POLICY_READAHEAD && reader->size > 0)
+		issue_readahead(reader);
+
+	while (1) {
+		if (reader->size < 0)
+			len = read(reader->fd, reader->buf->data,
+				   LIBSIGN_DIGEST_CHUNK_SIZE);
+		else if (reader->direct_fd >= 0) {
+			len = pread(reader->direct_fd, reader->buf->data,
+				    LIBSIGN_DIGEST_CHUNK_SIZE, reader->offset);
+			/*
+			 * A short read in the middle of the file leaves the
+			 * offset unaligned for O_DIRECT.
+			 */
+			if (len < 0 && errno == EINVAL) {
+				close(reader->direct_fd);
+				reader->direct_fd = -1;
+				continue;
+			}
+		} else
+			len = pread(reader->fd, reader->buf->data,
+				    LIBSIGN_DIGEST_CHUNK_SIZE, reader->offset);
+
+		if (len >= 0)
+			break;
+
+		if (errno != EINTR) {
+			err("Failed to read input file\n");
+			return -1;
+		}
+	}
+
+	reader->offset += len;
+	*data = reader->buf->data;
+
+	return len;
+}
+
+void
+io_reader_close(io_reader_t *reader)
+{
+	if (!reader || !reader->buf)
+		return;
+
+	if (reader->direct_fd >= 0)
+		close(reader->direct_fd);
+
+	put_buf(reader->buf);
+	reader->buf = NULL;
+}
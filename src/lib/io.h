@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2017, Wind River Systems, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1) Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2) Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3) Neither the name of Wind River Systems nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Author:
+ *        Lans Zhang <jia.zhang@windriver.com>
+ */
+
+#ifndef __IO_H__
+#define __IO_H__
+
+#include <libsign.h>
+
+/*
+ * The reader streams a file in chunks of LIBSIGN_DIGEST_CHUNK_SIZE
+ * according to the I/O policy in effect when it is opened.
+ */
+
+/* The distance the readahead is kept ahead of the reader */
+#define IO_READAHEAD_WINDOW		(8 * LIBSIGN_DIGEST_CHUNK_SIZE)
+
+/* The alignment of the buffer and file offset required by O_DIRECT */
+#define IO_DIRECT_ALIGN			4096
+
+typedef struct io_buf {
+	/* Linked in the pool of the node while idle */
+	struct io_buf *next;
+	/* The node of the thread first reading into the buffer */
+	unsigned int node;
+	uint8_t *data;
+} io_buf_t;
+
+typedef struct {
+	/* The file descriptor given by the caller */
+	int fd;
+	/* The file descriptor opened with O_DIRECT, or -1 */
+	int direct_fd;
+	LIBSIGN_IO_POLICY policy;
+	/* The size of a regular file, or -1 for the stream read with read() */
+	off_t size;
+	off_t offset;
+	off_t readahead_offset;
+	io_buf_t *buf;
+} io_reader_t;
+
+int
+io_reader_open(io_reader_t *reader, int fd);
+
+ssize_t
+io_reader_read(io_reader_t *reader, const uint8_t **data);
+
+void
+io_reader_close(io_reader_t *reader);
+
+#endif	/* __IO_H__ */
@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2017, Wind River Systems, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1) Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2) Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3) Neither the name of Wind River Systems nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Author:
+ *        Lans Zhang <jia.zhang@windriver.com>
+ */
+
+#include <libsign.h>
+#include <poll.h>
+
+#include "jobserver.h"
+
+static jobserver_t jobserver = {
+	.read_fd = -1,
+	.write_fd = -1,
+};
+static bool jobserver_available;
+static pthread_once_t jobserver_once = PTHREAD_ONCE_INIT;
+
+static bool
+valid_fd(int fd)
+{
+	return fd >= 0 && fcntl(fd, F_GETFD) >= 0;
+}
+
+/*
+ * The forms of --jobserver-auth are fifo:<path> since make 4.4, and
+ * <read_fd>,<write_fd> for the pipe inherited from make. The read end
+ * is always opened again, so it can be non-blocking without affecting
+ * make and the other clients sharing the same pipe.
+ */
+static int
+parse_auth(const char *auth)
+{
+	if (!strncmp(auth, "fifo:", 5)) {
+		const char *path = auth + 5;
+
+		jobserver.read_fd = open(path, O_RDONLY | O_NONBLOCK |
+					 O_CLOEXEC);
+		if (jobserver.read_fd < 0) {
+			warn("Failed to open the jobserver fifo %s\n", path);
+			return EXIT_FAILURE;
+		}
+
+		jobserver.write_fd = open(path, O_WRONLY | O_CLOEXEC);
+		if (jobserver.write_fd < 0) {
+			warn("Failed to open the jobserver fifo %s\n", path);
+			close(jobserver.read_fd);
+			return EXIT_FAILURE;
+		}
+
+		return EXIT_SUCCESS;
+	}
+
+	int read_fd, write_fd;
+	char end;
+
+	if (sscanf(auth, "%d,%d%c", &read_fd, &write_fd, &end) != 2) {
+		warn("Unrecognized jobserver %s\n", auth);
+		return EXIT_FAILURE;
+	}
+
+	/* The jobserver is disabled by make for this command */
+	if (read_fd < 0 || write_fd < 0)
+		return EXIT_FAILURE;
+
+	/* The recipe is not marked with '+' to pass the jobserver */
+	if (!valid_fd(read_fd) || !valid_fd(write_fd)) {
+		dbg("The jobserver pipe %s is not inherited\n", auth);
+		return EXIT_FAILURE;
+	}
+
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", read_fd);
+	jobserver.read_fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (jobserver.read_fd < 0) {
+		warn("Failed to open the jobserver pipe %s\n", auth);
+		return EXIT_FAILURE;
+	}
+
+	jobserver.write_fd = write_fd;
+
+	return EXIT_SUCCESS;
+}
+
+static void
+detect_jobserver(void)
+{
+	const char *makeflags = getenv("MAKEFLAGS");
+	if (!makeflags)
+		return;
+
+	char *flags = strdup(makeflags);
+	if (!flags)
+		return;
+
+	const char *auth = NULL;
+	char *save;
+
+	/* The last one takes effect */
+	for (char *word = strtok_r(flags, " ", &save); word;
+	     word = strtok_r(NULL, " ", &save)) {
+		/* The variable definitions follow */
+		if (!strcmp(word, "--"))
+			break;
+
+		if (!strncmp(word, "--jobserver-auth=", 17))
+			auth = word + 17;
+		else if (!strncmp(word, "--jobserver-fds=", 16))
+			auth = word + 16;
+	}
+
+	if (auth && !parse_auth(auth)) {
+		jobserver_available = true;
+		dbg("Using the jobserver %s\n", auth);
+	}
+
+	free(flags);
+}
+
+jobserver_t *
+jobserver_get(void)
+{
+	pthread_once(&jobserver_once, detect_jobserver);
+
+	return jobserver_available ? &jobserver : NULL;
+}
+
+int
+jobserver_acquire(jobserver_t *jobserver, int timeout, char *token)
+{
+	struct pollfd pfd = {
+		.fd = jobserver->read_fd,
+		.events = POLLIN,
+	};
+
+	if (poll(&pfd, 1, timeout) <= 0)
+		return EXIT_FAILURE;
+
+	/* Another client may take the token first */
+	while (read(jobserver->read_fd, token, 1) != 1) {
+		if (errno != EINTR)
+			return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+void
+jobserver_release(jobserver_t *jobserver, char token)
+{
+	while (write(jobserver->write_fd, &token, 1) != 1) {
+		if (errno != EINTR) {
+			err("Failed to return the token to the jobserver\n");
+			break;
+		}
+	}
+}
+
+bool
+libsign_jobserver_available(void)
+{
+	return !!jobserver_get();
+}
@@ -0,0 +1,630 @@
+/*
+ * Copyright (c) 2017, Wind River Systems, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1) Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2) Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3) Neither the name of Wind River Systems nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Author:
+ *        Lans Zhang <jia.zhang@windriver.com>
+ */
+
+#include "journal.h"
+
+#define JOURNAL_HEADER			"# libsign journal 1\n"
+#define JOURNAL_SYNC_MARKER		"#sync\n"
+
+/* The hex FNV-1a checksum of the rest of a record line and a space */
+#define JOURNAL_CHECKSUM_LEN		9
+
+#define JOURNAL_DIGEST_SIZE		32
+
+static uint32_t
+checksum(const char *data, size_t len)
+{
+	/* FNV-1a */
+	uint32_t hash = 2166136261U;
+
+	while (len--) {
+		hash ^= (uint8_t)*data++;
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+static int
+write_all(int fd, const void *buf, size_t size)
+{
+	while (size) {
+		ssize_t len = write(fd, buf, size);
+
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return EXIT_FAILURE;
+		}
+
+		buf = (const uint8_t *)buf + len;
+		size -= len;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+static unsigned int
+hash_path(const char *path)
+{
+	return checksum(path, strlen(path));
+}
+
+/* The separators of a record are escaped in the paths */
+static bool
+escaped_char(char c)
+{
+	return c == '%' || c == '\t' || c == '\n';
+}
+
+static size_t
+escaped_len(const char *path)
+{
+	size_t len = 0;
+
+	for (; *path; ++path)
+		len += escaped_char(*path) ? 3 : 1;
+
+	return len;
+}
+
+static char *
+escape(char *out, const char *path)
+{
+	for (; *path; ++path) {
+		if (escaped_char(*path))
+			out += sprintf(out, "%%%02x", (uint8_t)*path);
+		else
+			*out++ = *path;
+	}
+
+	return out;
+}
+
+/* Return the unescaped path in a new string, or NULL if malformed */
+static char *
+unescape(const char *in, size_t len)
+{
+	char *path = malloc(len + 1);
+	char *out = path;
+
+	if (!path)
+		return NULL;
+
+	for (size_t i = 0; i < len; ++i) {
+		unsigned int c;
+
+		if (in[i] != '%') {
+			*out++ = in[i];
+			continue;
+		}
+
+		if (i + 2 >= len || sscanf(in + i + 1, "%2x", &c) != 1 ||
+		    !c) {
+			free(path);
+			return NULL;
+		}
+
+		*out++ = c;
+		i += 2;
+	}
+
+	*out = '\0';
+
+	return path;
+}
+
+static void
+hex_digest(char *out, const uint8_t *digest)
+{
+	for (unsigned int i = 0; i < JOURNAL_DIGEST_SIZE; ++i)
+		sprintf(out + i * 2, "%02x", digest[i]);
+}
+
+static int
+digest_sig(const uint8_t *sig, size_t sig_len, char *hex)
+{
+	uint8_t *digest;
+
+	if (libsign_digest_calculate(LIBSIGN_DIGEST_ALG_SHA256,
+				     (uint8_t *)sig, sig_len, &digest))
+		return EXIT_FAILURE;
+
+	hex_digest(hex, digest);
+	free(digest);
+
+	return EXIT_SUCCESS;
+}
+
+int
+journal_identify(int fd, journal_id_t *id)
+{
+	struct stat st;
+
+	if (fstat(fd, &st))
+		return EXIT_FAILURE;
+
+	id->dev = st.st_dev;
+	id->ino = st.st_ino;
+	id->size = st.st_size;
+	id->mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 +
+		       st.st_mtim.tv_nsec;
+
+	return EXIT_SUCCESS;
+}
+
+static journal_record_t *
+find_record(journal_t *journal, const char *path)
+{
+	if (!journal->nr_bucket)
+		return NULL;
+
+	journal_record_t *record;
+	unsigned int bucket = hash_path(path) & (journal->nr_bucket - 1);
+
+	for (record = journal->buckets[bucket]; record; record = record->next) {
+		if (!strcmp(record->path, path))
+			return record;
+	}
+
+	return NULL;
+}
+
+static int
+grow_buckets(journal_t *journal)
+{
+	unsigned int nr_bucket = journal->nr_bucket ? journal->nr_bucket * 2 :
+						      1024;
+	journal_record_t **buckets = calloc(nr_bucket, sizeof(*buckets));
+
+	if (!buckets)
+		return EXIT_FAILURE;
+
+	for (unsigned int i = 0; i < journal->nr_bucket; ++i) {
+		journal_record_t *record = journal->buckets[i];
+
+		while (record) {
+			journal_record_t *next = record->next;
+			unsigned int bucket = hash_path(record->path) &
+					      (nr_bucket - 1);
+
+			record->next = buckets[bucket];
+			buckets[bucket] = record;
+			record = next;
+		}
+	}
+
+	free(journal->buckets);
+	journal->buckets = buckets;
+	journal->nr_bucket = nr_bucket;
+
+	return EXIT_SUCCESS;
+}
+
+static void
+free_record(journal_record_t *record)
+{
+	free(record->output_path);
+	free(record);
+}
+
+/* The later record of the same signed file replaces the earlier one */
+static int
+insert_record(journal_t *journal, journal_record_t *record)
+{
+	journal_record_t **link;
+
+	if (journal->nr_record >= journal->nr_bucket &&
+	    grow_buckets(journal))
+		return EXIT_FAILURE;
+
+	link = journal->buckets + (hash_path(record->path) &
+				   (journal->nr_bucket - 1));
+
+	for (; *link; link = &(*link)->next) {
+		if (!strcmp((*link)->path, record->path)) {
+			record->next = (*link)->next;
+			free_record(*link);
+			*link = record;
+			return EXIT_SUCCESS;
+		}
+	}
+
+	record->next = NULL;
+	*link = record;
+	++journal->nr_record;
+
+	return EXIT_SUCCESS;
+}
+
+/* Check the signature file written after the last sync marker */
+static bool
+validate_record(journal_record_t *record, const char *digest)
+{
+	uint8_t *sig;
+	size_t sig_len;
+	char hex[JOURNAL_DIGEST_SIZE * 2 + 1];
+
+	if (libsign_utils_load_file(record->output_path, &sig, &sig_len))
+		return false;
+
+	int rc = digest_sig(sig, sig_len, hex);
+
+	free(sig);
+
+	return !rc && !strcmp(hex, digest);
+}
+
+/*
+ * Parse a record line without the line feed. Return NULL if the line is
+ * corrupted, or the record in the tail is not valid.
+ */
+static journal_record_t *
+parse_record(const char *line, size_t len, bool tail)
+{
+	unsigned long long dev, ino;
+	long long size, mtime_ns;
+	unsigned int sum;
+	char digest[JOURNAL_DIGEST_SIZE * 2 + 1];
+	int consumed;
+
+	if (len <= JOURNAL_CHECKSUM_LEN ||
+	    sscanf(line, "%8x ", &sum) != 1 ||
+	    sum != checksum(line + JOURNAL_CHECKSUM_LEN,
+			    len - JOURNAL_CHECKSUM_LEN))
+		return NULL;
+
+	if (sscanf(line + JOURNAL_CHECKSUM_LEN, "%llu %llu %lld %lld %64s%n",
+		   &dev, &ino, &size, &mtime_ns, digest, &consumed) != 5)
+		return NULL;
+
+	const char *path = line + JOURNAL_CHECKSUM_LEN + consumed;
+	const char *end = line + len;
+
+	if (*path++ != '\t')
+		return NULL;
+
+	const char *output = memchr(path, '\t', end - path);
+	if (!output)
+		return NULL;
+
+	char *unescaped = unescape(path, output - path);
+	if (!unescaped)
+		return NULL;
+
+	journal_record_t *record = calloc(1, sizeof(*record) +
+					  strlen(unescaped) + 1);
+	if (record) {
+		strcpy(record->path, unescaped);
+		record->output_path = unescape(output + 1,
+					       end - output - 1);
+	}
+
+	free(unescaped);
+
+	if (!record || !record->output_path ||
+	    (tail && !validate_record(record, digest))) {
+		if (record)
+			free_record(record);
+		return NULL;
+	}
+
+	record->id.dev = dev;
+	record->id.ino = ino;
+	record->id.size = size;
+	record->id.mtime_ns = mtime_ns;
+
+	return record;
+}
+
+/*
+ * Load the records, and cut off the torn line left by a crash, if any,
+ * so that the records appended later start from a new line.
+ */
+static int
+load_records(journal_t *journal, const char *path)
+{
+	struct stat st;
+
+	if (fstat(journal->fd, &st))
+		return EXIT_FAILURE;
+
+	if (!st.st_size)
+		return write_all(journal->fd, JOURNAL_HEADER,
+				  strlen(JOURNAL_HEADER));
+
+	libsign_file_map_t map;
+
+	if (libsign_utils_map_fd(journal->fd, &map))
+		return EXIT_FAILURE;
+
+	const char *data = (const char *)map.data;
+	size_t size = map.size;
+	size_t tail = 0, offset, end;
+	unsigned int nr_corrupted = 0;
+	int rc = EXIT_FAILURE;
+
+	if (size < strlen(JOURNAL_HEADER) ||
+	    memcmp(data, JOURNAL_HEADER, strlen(JOURNAL_HEADER))) {
+		err("%s is not a journal of libsign\n", path);
+		goto out;
+	}
+
+	/* The records before the last sync marker are trusted */
+	for (offset = 0; offset < size; offset = end + 1) {
+		const char *lf = memchr(data + offset, '\n', size - offset);
+
+		if (!lf)
+			break;
+
+		end = lf - data;
+		if (!memcmp(data + offset, JOURNAL_SYNC_MARKER,
+			    strlen(JOURNAL_SYNC_MARKER)))
+			tail = end + 1;
+	}
+
+	for (offset = 0; offset < size; offset = end + 1) {
+		const char *lf = memchr(data + offset, '\n', size - offset);
+
+		if (!lf)
+			break;
+
+		end = lf - data;
+		if (data[offset] == '#')
+			continue;
+
+		/* Parsed as a string */
+		char *line = strndup(data + offset, end - offset);
+		if (!line)
+			goto out;
+
+		journal_record_t *record = parse_record(line, end - offset,
+							offset >= tail);
+		free(line);
+		if (!record) {
+			++nr_corrupted;
+			continue;
+		}
+
+		if (insert_record(journal, record)) {
+			free_record(record);
+			goto out;
+		}
+	}
+
+	if (offset != size && ftruncate(journal->fd, offset))
+		goto out;
+
+	if (nr_corrupted)
+		dbg("%u records of the journal %s are dropped\n",
+		    nr_corrupted, path);
+
+	rc = EXIT_SUCCESS;
+
+out:
+	libsign_utils_unmap_file(&map);
+
+	return rc;
+}
+
+static void
+free_records(journal_t *journal)
+{
+	for (unsigned int i = 0; i < journal->nr_bucket; ++i) {
+		journal_record_t *record = journal->buckets[i];
+
+		while (record) {
+			journal_record_t *next = record->next;
+
+			free_record(record);
+			record = next;
+		}
+	}
+
+	free(journal->buckets);
+}
+
+journal_t *
+journal_open(const char *path, libsign_writer_t *writer)
+{
+	journal_t *journal = calloc(1, sizeof(*journal));
+	if (!journal)
+		return NULL;
+
+	journal->writer = writer;
+	journal->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC,
+			   0644);
+	if (journal->fd < 0) {
+		err("Failed to open the journal %s\n", path);
+		free(journal);
+		return NULL;
+	}
+
+	if (load_records(journal, path)) {
+		err("Failed to load the journal %s\n", path);
+		free_records(journal);
+		close(journal->fd);
+		free(journal);
+		return NULL;
+	}
+
+	if (journal->nr_record)
+		dbg("%u signed files recorded in the journal %s\n",
+		    journal->nr_record, path);
+
+	pthread_mutex_init(&journal->lock, NULL);
+
+	return journal;
+}
+
+bool
+journal_done(journal_t *journal, const char *path, const char *output_path,
+	     const journal_id_t *id)
+{
+	journal_record_t *record = find_record(journal, path);
+
+	return record && !memcmp(&record->id, id, sizeof(*id)) &&
+	       !strcmp(record->output_path, output_path) &&
+	       libsign_utils_file_exists(output_path);
+}
+
+/*
+ * Commit the signature files saved so far, and then write the records
+ * of them. A record added to the pending records is always saved by the
+ * writer before, so it is never written before its signature file is
+ * committed. Called with the lock held.
+ */
+static int
+checkpoint(journal_t *journal)
+{
+	int rc = libsign_writer_commit(journal->writer);
+	if (rc) {
+		err("Failed to commit the signature files\n");
+		return rc;
+	}
+
+	if (!journal->nr_pending)
+		return EXIT_SUCCESS;
+
+	rc = write_all(journal->fd, journal->pending, journal->pending_len);
+	journal->pending_len = 0;
+	journal->nr_pending = 0;
+	if (rc) {
+		err("Failed to write the journal\n");
+		return rc;
+	}
+
+	if (journal->writer->durability == LIBSIGN_DURABILITY_NONE)
+		return EXIT_SUCCESS;
+
+	/*
+	 * Without the marker written, the records are validated on
+	 * restart.
+	 */
+	if (fdatasync(journal->fd) ||
+	    write_all(journal->fd, JOURNAL_SYNC_MARKER,
+		       strlen(JOURNAL_SYNC_MARKER))) {
+		err("Failed to sync the journal\n");
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+int
+journal_checkpoint(journal_t *journal)
+{
+	pthread_mutex_lock(&journal->lock);
+	int rc = checkpoint(journal);
+	pthread_mutex_unlock(&journal->lock);
+
+	return rc;
+}
+
+int
+journal_add(journal_t *journal, const char *path, const char *output_path,
+	    const journal_id_t *id, const uint8_t *sig, size_t sig_len)
+{
+	char digest[JOURNAL_DIGEST_SIZE * 2 + 1];
+
+	if (digest_sig(sig, sig_len, digest))
+		return EXIT_FAILURE;
+
+	/* 4 numbers, the separators and the line feed */
+	size_t len = JOURNAL_CHECKSUM_LEN + 4 * 21 + sizeof(digest) + 2 +
+		     escaped_len(path) + escaped_len(output_path);
+	int rc = EXIT_FAILURE;
+
+	pthread_mutex_lock(&journal->lock);
+
+	if (journal->pending_len + len > journal->pending_size) {
+		size_t size = journal->pending_size * 2;
+
+		if (size < journal->pending_len + len)
+			size = journal->pending_len + len + 4096;
+
+		char *pending = realloc(journal->pending, size);
+		if (!pending)
+			goto out;
+
+		journal->pending = pending;
+		journal->pending_size = size;
+	}
+
+	char *line = journal->pending + journal->pending_len;
+	char *p = line + JOURNAL_CHECKSUM_LEN;
+
+	p += sprintf(p, "%llu %llu %lld %lld %s\t",
+		     (unsigned long long)id->dev,
+		     (unsigned long long)id->ino, (long long)id->size,
+		     (long long)id->mtime_ns, digest);
+	p = escape(p, path);
+	*p++ = '\t';
+	p = escape(p, output_path);
+
+	/* Overwrite the NUL with the space after the checksum */
+	sprintf(line, "%08x", checksum(line + JOURNAL_CHECKSUM_LEN,
+				       p - line - JOURNAL_CHECKSUM_LEN));
+	line[JOURNAL_CHECKSUM_LEN - 1] = ' ';
+	*p++ = '\n';
+
+	journal->pending_len = p - journal->pending;
+
+	rc = EXIT_SUCCESS;
+	if (++journal->nr_pending == JOURNAL_CHECKPOINT_INTERVAL)
+		rc = checkpoint(journal);
+
+out:
+	pthread_mutex_unlock(&journal->lock);
+
+	return rc;
+}
+
+int
+journal_close(journal_t *journal)
+{
+	int rc = journal_checkpoint(journal);
+
+	if (close(journal->fd)) {
+		err("Failed to close the journal\n");
+		rc = EXIT_FAILURE;
+	}
+
+	pthread_mutex_destroy(&journal->lock);
+	free_records(journal);
+	free(journal->pending);
+	free(journal);
+
+	return rc;
+}
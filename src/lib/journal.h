@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2017, Wind River Systems, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1) Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2) Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3) Neither the name of Wind River Systems nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Author:
+ *        Lans Zhang <jia.zhang@windriver.com>
+ */
+
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#include <libsign.h>
+
+/*
+ * The journal records the signed files of a job in an append-only log,
+ * so that an interrupted job is resumed from where it stopped. Each
+ * record holds the identity of the signed file, the path of its
+ * signature file and the SHA-256 digest of the signature. The records
+ * are only appended once the signature files are committed by the
+ * writer, and a sync marker follows them once they are synced. On
+ * restart, the records after the last sync marker, i.e. the tail, are
+ * validated against the signature files, and the rest are trusted.
+ */
+
+/* The number of signed files committed and recorded at once */
+#define JOURNAL_CHECKPOINT_INTERVAL	256
+
+/* Identify the content of a signed file without reading it */
+typedef struct {
+	uint64_t dev;
+	uint64_t ino;
+	int64_t size;
+	int64_t mtime_ns;
+} journal_id_t;
+
+typedef struct journal_record {
+	struct journal_record *next;
+	journal_id_t id;
+	char *output_path;
+	char path[];
+} journal_record_t;
+
+typedef struct {
+	int fd;
+	libsign_writer_t *writer;
+	/* The records loaded on open, looked up by the signed file */
+	unsigned int nr_bucket;
+	unsigned int nr_record;
+	journal_record_t **buckets;
+	/* Serialize the records appended by the workers */
+	pthread_mutex_t lock;
+	/* The records not yet written, waiting for the next checkpoint */
+	char *pending;
+	size_t pending_len;
+	size_t pending_size;
+	unsigned int nr_pending;
+} journal_t;
+
+/*
+ * Open or create the journal. The signature files are saved by the
+ * writer, which is committed by the checkpoints of the journal.
+ */
+journal_t *
+journal_open(const char *path, libsign_writer_t *writer);
+
+/* Commit the writer and write the records left, and close the journal */
+int
+journal_close(journal_t *journal);
+
+int
+journal_identify(int fd, journal_id_t *id);
+
+/*
+ * Whether the signed file with the identity has been signed to the
+ * output path by a previous job. Safe to be called concurrently.
+ */
+bool
+journal_done(journal_t *journal, const char *path, const char *output_path,
+	     const journal_id_t *id);
+
+/*
+ * Record the signature saved by the writer for the signed file. Every
+ * JOURNAL_CHECKPOINT_INTERVAL records, the writer is committed and the
+ * records are written.
+ */
+int
+journal_add(journal_t *journal, const char *path, const char *output_path,
+	    const journal_id_t *id, const uint8_t *sig, size_t sig_len);
+
+int
+journal_checkpoint(journal_t *journal);
+
+#endif	/* __JOURNAL_H__ */
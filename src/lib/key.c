@@ -31,30 +31,148 @@
  *        Lans Zhang <jia.zhang@windriver.com>
  */
 
-#include <libsign.h>
+#include "keystore.h"
+#include "pkcs11.h"
 
-EVP_PKEY *
-libsign_key_load(const char *path)
+/*
+ * The key is PEM-encoded, or DER-encoded in PKCS#8 PrivateKeyInfo or
+ * the traditional format of its type, decoded in place.
+ */
+static void *
+parse_key(const uint8_t *data, size_t size, const char *path)
 {
-	BIO *bio = BIO_new_file(path, "r");
-	if (!bio) {
-		err("Failed to open key %s\n", path);
-		return NULL;
-	}
+	EVP_PKEY *key = NULL;
+	BIO *bio;
+
+	if (keystore_pem(data, size, &bio)) {
+		if (bio)
+			key = PEM_read_bio_PrivateKey(bio, NULL, NULL, NULL);
+		BIO_free(bio);
+	} else if (size <= LONG_MAX)
+		key = d2i_AutoPrivateKey(NULL, &data, (long)size);
 
-	EVP_PKEY *key = PEM_read_bio_PrivateKey(bio, NULL, NULL, NULL);
-	BIO_free_all(bio);
 	if (!key) {
-		err("Failed to parse PEM-encoded key %s\n",
-		    path);
+		err("Failed to parse the key %s\n", path);
 		ERR_print_errors_fp(stderr);
 	}
 
 	return key;
 }
 
+static int
+up_ref_key(void *key)
+{
+	return EVP_PKEY_up_ref(key);
+}
+
+static void
+free_key(void *key)
+{
+	EVP_PKEY_free(key);
+}
+
+static const keystore_type_t key_type = {
+	.parse = parse_key,
+	.up_ref = up_ref_key,
+	.free = free_key,
+};
+
+/*
+ * Return a reference to the key shared by the process, which must be
+ * released with libsign_key_unload(). The path may also be a PKCS#11
+ * URI of the key on a token.
+ */
+EVP_PKEY *
+libsign_key_load(const char *path)
+{
+	if (!strncmp(path, PKCS11_URI_SCHEME, strlen(PKCS11_URI_SCHEME))) {
+#ifdef LIBSIGN_PKCS11
+		return pkcs11_key_load(path);
+#else
+		err("The PKCS#11 support is not built in (PKCS11=1)\n");
+		return NULL;
+#endif
+	}
+
+	return keystore_get(&key_type, path);
+}
+
 void
 libsign_key_unload(EVP_PKEY *key)
 {
 	EVP_PKEY_free(key);
 }
+
+static const char *cipher_names[LIBSIGN_CIPHER_ALG_MAX] = {
+	[LIBSIGN_CIPHER_ALG_RSA] = "rsa",
+	[LIBSIGN_CIPHER_ALG_ECDSA_P256] = "ecdsa-p256",
+	[LIBSIGN_CIPHER_ALG_ECDSA_P384] = "ecdsa-p384",
+	[LIBSIGN_CIPHER_ALG_ED25519] = "ed25519",
+};
+
+const char *
+libsign_cipher_name(LIBSIGN_CIPHER_ALG cipher_alg)
+{
+	if (cipher_alg <= LIBSIGN_CIPHER_ALG_NONE ||
+	    cipher_alg >= LIBSIGN_CIPHER_ALG_MAX)
+		return NULL;
+
+	return cipher_names[cipher_alg];
+}
+
+LIBSIGN_CIPHER_ALG
+libsign_cipher_alg_from_name(const char *name)
+{
+	for (int i = LIBSIGN_CIPHER_ALG_NONE + 1; i < LIBSIGN_CIPHER_ALG_MAX;
+	     ++i) {
+		if (!strcasecmp(name, cipher_names[i]))
+			return i;
+	}
+
+	return LIBSIGN_CIPHER_ALG_NONE;
+}
+
+static int
+key_curve(EVP_PKEY *key)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	char name[64];
+
+	if (!EVP_PKEY_get_group_name(key, name, sizeof(name), NULL))
+		return NID_undef;
+
+	return OBJ_txt2nid(name);
+#else
+	const EC_KEY *ec = EVP_PKEY_get0_EC_KEY(key);
+
+	if (!ec)
+		return NID_undef;
+
+	return EC_GROUP_get_curve_name(EC_KEY_get0_group(ec));
+#endif
+}
+
+/*
+ * Return the cipher algorithm of the key, or LIBSIGN_CIPHER_ALG_NONE if
+ * the key type or the curve is not supported.
+ */
+LIBSIGN_CIPHER_ALG
+libsign_key_cipher_alg(EVP_PKEY *key)
+{
+	switch (EVP_PKEY_base_id(key)) {
+	case EVP_PKEY_RSA:
+		return LIBSIGN_CIPHER_ALG_RSA;
+	case EVP_PKEY_EC:
+		switch (key_curve(key)) {
+		case NID_X9_62_prime256v1:
+			return LIBSIGN_CIPHER_ALG_ECDSA_P256;
+		case NID_secp384r1:
+			return LIBSIGN_CIPHER_ALG_ECDSA_P384;
+		}
+		break;
+	case EVP_PKEY_ED25519:
+		return LIBSIGN_CIPHER_ALG_ED25519;
+	}
+
+	return LIBSIGN_CIPHER_ALG_NONE;
+}
@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2017, Wind River Systems, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1) Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2) Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3) Neither the name of Wind River Systems nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Author:
+ *        Lans Zhang <jia.zhang@windriver.com>
+ */
+
+#include "keystore.h"
+
+typedef struct keystore_entry {
+	struct keystore_entry *next;
+	const keystore_type_t *type;
+	/* The identity of the file the object is parsed from */
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	void *object;
+	char path[];
+} keystore_entry_t;
+
+/* A handful of keys and certificates are used by a process */
+static keystore_entry_t *keystore;
+static pthread_mutex_t keystore_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool
+same_file(const keystore_entry_t *entry, const struct stat *st)
+{
+	return entry->dev == st->st_dev && entry->ino == st->st_ino &&
+	       entry->size == st->st_size &&
+	       entry->mtime.tv_sec == st->st_mtim.tv_sec &&
+	       entry->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static keystore_entry_t *
+find_entry(const keystore_type_t *type, const char *path)
+{
+	keystore_entry_t *entry;
+
+	for (entry = keystore; entry; entry = entry->next) {
+		if (entry->type == type && !strcmp(entry->path, path))
+			return entry;
+	}
+
+	return NULL;
+}
+
+/*
+ * The identity is taken from the opened file, so the object cached is
+ * never newer than the identity recorded with it.
+ */
+void *
+keystore_get(const keystore_type_t *type, const char *path)
+{
+	struct stat st;
+	void *object = NULL;
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		err("Failed to open %s\n", path);
+		return NULL;
+	}
+
+	if (fstat(fd, &st)) {
+		err("Failed to stat %s\n", path);
+		close(fd);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&keystore_lock);
+
+	keystore_entry_t *entry = find_entry(type, path);
+
+	if (entry && same_file(entry, &st)) {
+		close(fd);
+		if (type->up_ref(entry->object))
+			object = entry->object;
+		goto out;
+	}
+
+	libsign_file_map_t map;
+	int rc = libsign_utils_map_fd(fd, &map);
+
+	close(fd);
+	if (rc)
+		goto out;
+
+	object = type->parse(map.data, map.size, path);
+	libsign_utils_unmap_file(&map);
+	if (!object)
+		goto out;
+
+	if (!entry) {
+		entry = calloc(1, sizeof(*entry) + strlen(path) + 1);
+		/* Still usable without being cached */
+		if (!entry)
+			goto out;
+
+		entry->type = type;
+		strcpy(entry->path, path);
+		entry->next = keystore;
+		keystore = entry;
+	} else {
+		dbg("%s is changed and parsed again\n", path);
+		if (entry->object)
+			type->free(entry->object);
+		entry->object = NULL;
+	}
+
+	if (!type->up_ref(object)) {
+		/* Parsed again next time */
+		entry->ino = 0;
+		goto out;
+	}
+
+	entry->object = object;
+	entry->dev = st.st_dev;
+	entry->ino = st.st_ino;
+	entry->size = st.st_size;
+	entry->mtime = st.st_mtim;
+
+out:
+	pthread_mutex_unlock(&keystore_lock);
+
+	return object;
+}
+
+/*
+ * A DER-encoded key or certificate starts with a SEQUENCE, while the
+ * text before the PEM boundary is skipped by the PEM reader.
+ */
+bool
+keystore_pem(const uint8_t *data, size_t size, BIO **bio)
+{
+	static const char boundary[] = "-----BEGIN ";
+
+	*bio = NULL;
+
+	if (size && data[0] == 0x30 &&
+	    !memmem(data, size, boundary, sizeof(boundary) - 1))
+		return false;
+
+	/* The length of the memory BIO is int */
+	if (size <= INT_MAX)
+		*bio = BIO_new_mem_buf(data, (int)size);
+
+	return true;
+}
+
+void
+keystore_flush(void)
+{
+	pthread_mutex_lock(&keystore_lock);
+
+	while (keystore) {
+		keystore_entry_t *entry = keystore;
+
+		keystore = entry->next;
+		if (entry->object)
+			entry->type->free(entry->object);
+		free(entry);
+	}
+
+	pthread_mutex_unlock(&keystore_lock);
+}
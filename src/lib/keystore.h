@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2017, Wind River Systems, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1) Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2) Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3) Neither the name of Wind River Systems nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Author:
+ *        Lans Zhang <jia.zhang@windriver.com>
+ */
+
+#ifndef __KEYSTORE_H__
+#define __KEYSTORE_H__
+
+#include <libsign.h>
+
+/*
+ * The keystore parses each key and certificate file once per process,
+ * and hands out the references to the parsed object. The file is parsed
+ * again once it is replaced or modified, i.e. its inode, size or mtime
+ * changes, while the references to the old object stay valid until
+ * they are released.
+ */
+
+typedef struct {
+	/* Parse the object from the content of the file, or return NULL */
+	void *(*parse)(const uint8_t *data, size_t size, const char *path);
+	/* Take another reference to the object */
+	int (*up_ref)(void *object);
+	/* Release a reference to the object */
+	void (*free)(void *object);
+} keystore_type_t;
+
+/* Return a new reference to the object parsed from the file */
+void *
+keystore_get(const keystore_type_t *type, const char *path);
+
+/*
+ * Whether the content is PEM-encoded rather than DER-encoded. Return a
+ * memory BIO of the PEM content if so, which may be NULL on failure.
+ */
+bool
+keystore_pem(const uint8_t *data, size_t size, BIO **bio);
+
+/* Release the references held by the keystore */
+void
+keystore_flush(void);
+
+#endif	/* __KEYSTORE_H__ */
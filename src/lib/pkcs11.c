@@ -0,0 +1,1012 @@
+/*
+ * Copyright (c) 2017, Wind River Systems, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1) Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2) Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3) Neither the name of Wind River Systems nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Author:
+ *        Lans Zhang <jia.zhang@windriver.com>
+ */
+
+/*
+ * The key operations on the token are plugged into OpenSSL with the
+ * RSA and EC key methods, so the rest of libsign handles the key like
+ * any other EVP_PKEY.
+ */
+#define OPENSSL_SUPPRESS_DEPRECATED
+
+#include "pkcs11.h"
+
+#include <p11-kit/pkcs11.h>
+#include <openssl/rsa.h>
+
+typedef struct {
+	char *token;
+	char *serial;
+	bool has_slot_id;
+	CK_SLOT_ID slot_id;
+	char *object;
+	uint8_t *id;
+	size_t id_len;
+	char *pin;
+	char *module_path;
+} pkcs11_uri_t;
+
+typedef struct pkcs11_module {
+	struct pkcs11_module *next;
+	void *handle;
+	CK_FUNCTION_LIST_PTR funcs;
+	/* The process C_Initialize() is called in */
+	pid_t pid;
+	char path[];
+} pkcs11_module_t;
+
+typedef struct pkcs11_key {
+	struct pkcs11_key *next;
+	pkcs11_module_t *module;
+	CK_SLOT_ID slot;
+	char *pin;
+	/* The attributes the key object is searched with */
+	char *label;
+	uint8_t *id;
+	size_t id_len;
+	CK_OBJECT_HANDLE object;
+	/* The process the sessions and the object handle belong to */
+	pid_t pid;
+	/* The idle sessions are taken by the signing threads */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int nr_session;
+	unsigned int nr_idle;
+	CK_SESSION_HANDLE idle[PKCS11_MAX_SESSION];
+	/* The reference held by the cache */
+	EVP_PKEY *pkey;
+	char uri[];
+} pkcs11_key_t;
+
+static pkcs11_module_t *modules;
+static pkcs11_key_t *keys;
+/* Serialize the loading, and the initialization of the modules */
+static pthread_mutex_t pkcs11_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static RSA_METHOD *rsa_method;
+static EC_KEY_METHOD *ec_method;
+static int rsa_ex_index = -1;
+static int ec_ex_index = -1;
+
+static int
+hex_value(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+
+	return -1;
+}
+
+/* Return the percent-decoded value terminated by NUL */
+static char *
+decode_value(const char *value, size_t len, size_t *out_len)
+{
+	char *out = malloc(len + 1);
+	size_t n = 0;
+
+	if (!out)
+		return NULL;
+
+	for (size_t i = 0; i < len; ++i) {
+		if (value[i] != '%') {
+			out[n++] = value[i];
+			continue;
+		}
+
+		int hi = i + 2 < len ? hex_value(value[i + 1]) : -1;
+		int lo = hi >= 0 ? hex_value(value[i + 2]) : -1;
+
+		if (lo < 0) {
+			free(out);
+			return NULL;
+		}
+
+		out[n++] = (char)(hi << 4 | lo);
+		i += 2;
+	}
+
+	out[n] = 0;
+	if (out_len)
+		*out_len = n;
+
+	return out;
+}
+
+static int
+parse_attribute(pkcs11_uri_t *uri, const char *attr, size_t len,
+		bool query)
+{
+	const char *equal = memchr(attr, '=', len);
+
+	if (!equal) {
+		err("Invalid attribute %.*s in PKCS#11 URI\n", (int)len,
+		    attr);
+		return EXIT_FAILURE;
+	}
+
+	size_t name_len = equal - attr;
+	size_t value_len;
+	char *value = decode_value(equal + 1, len - name_len - 1,
+				   &value_len);
+
+	if (!value) {
+		err("Invalid value of %.*s in PKCS#11 URI\n", (int)name_len,
+		    attr);
+		return EXIT_FAILURE;
+	}
+
+#define is_attribute(name)	\
+	(name_len == strlen(name) && !memcmp(attr, name, name_len))
+
+	char **string = NULL;
+
+	if (!query && is_attribute("token"))
+		string = &uri->token;
+	else if (!query && is_attribute("serial"))
+		string = &uri->serial;
+	else if (!query && is_attribute("object"))
+		string = &uri->object;
+	else if (query && is_attribute("pin-value"))
+		string = &uri->pin;
+	else if (query && is_attribute("module-path"))
+		string = &uri->module_path;
+	else if (!query && is_attribute("id")) {
+		free(uri->id);
+		uri->id = (uint8_t *)value;
+		uri->id_len = value_len;
+		return EXIT_SUCCESS;
+	} else if (!query && is_attribute("slot-id")) {
+		char *end;
+
+		uri->slot_id = strtoul(value, &end, 10);
+		uri->has_slot_id = !*end && *value;
+		free(value);
+		if (!uri->has_slot_id) {
+			err("Invalid slot-id in PKCS#11 URI\n");
+			return EXIT_FAILURE;
+		}
+
+		return EXIT_SUCCESS;
+	} else if (!query && is_attribute("type")) {
+		bool private = !strcmp(value, "private");
+
+		free(value);
+		if (!private) {
+			err("The PKCS#11 object is not a private key\n");
+			return EXIT_FAILURE;
+		}
+
+		return EXIT_SUCCESS;
+	} else if (query && is_attribute("pin-source")) {
+		const char *path = value;
+
+		if (!strncmp(path, "file:", strlen("file:")))
+			path += strlen("file:");
+
+		FILE *fp = fopen(path, "re");
+		char line[256];
+
+		if (!fp || !fgets(line, sizeof(line), fp)) {
+			err("Failed to read the PIN from %s\n", path);
+			if (fp)
+				fclose(fp);
+			free(value);
+			return EXIT_FAILURE;
+		}
+
+		fclose(fp);
+		free(value);
+
+		line[strcspn(line, "\r\n")] = 0;
+		value = strdup(line);
+		if (!value)
+			return EXIT_FAILURE;
+
+		string = &uri->pin;
+	} else
+		dbg("Ignore the attribute %.*s in PKCS#11 URI\n",
+		    (int)name_len, attr);
+
+#undef is_attribute
+
+	if (string) {
+		free(*string);
+		*string = value;
+	} else
+		free(value);
+
+	return EXIT_SUCCESS;
+}
+
+static void
+free_uri(pkcs11_uri_t *uri)
+{
+	free(uri->token);
+	free(uri->serial);
+	free(uri->object);
+	free(uri->id);
+	free(uri->pin);
+	free(uri->module_path);
+}
+
+static int
+parse_uri(const char *string, pkcs11_uri_t *uri)
+{
+	const char *attr = string + strlen(PKCS11_URI_SCHEME);
+	bool query = false;
+
+	memset(uri, 0, sizeof(*uri));
+
+	while (*attr) {
+		size_t len = strcspn(attr, query ? "&" : ";?");
+
+		if (len && parse_attribute(uri, attr, len, query)) {
+			free_uri(uri);
+			return EXIT_FAILURE;
+		}
+
+		attr += len;
+		if (*attr == '?')
+			query = true;
+		if (*attr)
+			++attr;
+	}
+
+	if (!uri->module_path) {
+		const char *path = getenv("LIBSIGN_PKCS11_MODULE");
+
+		uri->module_path = path ? strdup(path) : NULL;
+		if (!uri->module_path) {
+			err("The PKCS#11 module is not specified\n");
+			free_uri(uri);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (!uri->pin) {
+		const char *pin = getenv("LIBSIGN_PKCS11_PIN");
+
+		if (pin) {
+			uri->pin = strdup(pin);
+			if (!uri->pin) {
+				free_uri(uri);
+				return EXIT_FAILURE;
+			}
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/* Called with pkcs11_lock held */
+static int
+initialize_module(pkcs11_module_t *module)
+{
+	if (module->pid == getpid())
+		return EXIT_SUCCESS;
+
+	CK_C_INITIALIZE_ARGS args = {
+		.flags = CKF_OS_LOCKING_OK,
+	};
+	CK_RV rv = module->funcs->C_Initialize(&args);
+
+	if (rv != CKR_OK && rv != CKR_CRYPTOKI_ALREADY_INITIALIZED) {
+		err("Failed to initialize PKCS#11 module %s (0x%lx)\n",
+		    module->path, rv);
+		return EXIT_FAILURE;
+	}
+
+	module->pid = getpid();
+
+	return EXIT_SUCCESS;
+}
+
+/* Called with pkcs11_lock held */
+static pkcs11_module_t *
+load_module(const char *path)
+{
+	pkcs11_module_t *module;
+
+	for (module = modules; module; module = module->next) {
+		if (!strcmp(module->path, path))
+			return initialize_module(module) ? NULL : module;
+	}
+
+	module = calloc(1, sizeof(*module) + strlen(path) + 1);
+	if (!module)
+		return NULL;
+
+	strcpy(module->path, path);
+
+	module->handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (!module->handle) {
+		err("Failed to load PKCS#11 module %s: %s\n", path,
+		    dlerror());
+		free(module);
+		return NULL;
+	}
+
+	CK_C_GetFunctionList get_function_list =
+		(CK_C_GetFunctionList)dlsym(module->handle,
+					    "C_GetFunctionList");
+
+	if (!get_function_list ||
+	    get_function_list(&module->funcs) != CKR_OK ||
+	    initialize_module(module)) {
+		err("Failed to get the functions of PKCS#11 module %s\n",
+		    path);
+		dlclose(module->handle);
+		free(module);
+		return NULL;
+	}
+
+	module->next = modules;
+	modules = module;
+
+	return module;
+}
+
+/* The label and serial of the token are padded with spaces */
+static bool
+match_padded(const char *string, const CK_UTF8CHAR *padded, size_t size)
+{
+	size_t len = strlen(string);
+
+	if (len > size || memcmp(string, padded, len))
+		return false;
+
+	while (len < size) {
+		if (padded[len++] != ' ')
+			return false;
+	}
+
+	return true;
+}
+
+static int
+find_slot(CK_FUNCTION_LIST_PTR funcs, const pkcs11_uri_t *uri,
+	  CK_SLOT_ID *slot)
+{
+	CK_ULONG nr_slot;
+	CK_RV rv = funcs->C_GetSlotList(CK_TRUE, NULL, &nr_slot);
+
+	if (rv != CKR_OK || !nr_slot) {
+		err("No PKCS#11 token is present\n");
+		return EXIT_FAILURE;
+	}
+
+	CK_SLOT_ID slots[nr_slot];
+
+	rv = funcs->C_GetSlotList(CK_TRUE, slots, &nr_slot);
+	if (rv != CKR_OK) {
+		err("Failed to get the PKCS#11 slots (0x%lx)\n", rv);
+		return EXIT_FAILURE;
+	}
+
+	for (CK_ULONG i = 0; i < nr_slot; ++i) {
+		CK_TOKEN_INFO info;
+
+		if (uri->has_slot_id && slots[i] != uri->slot_id)
+			continue;
+
+		if (funcs->C_GetTokenInfo(slots[i], &info) != CKR_OK)
+			continue;
+
+		if (uri->token && !match_padded(uri->token, info.label,
+						sizeof(info.label)))
+			continue;
+
+		if (uri->serial &&
+		    !match_padded(uri->serial, info.serialNumber,
+				  sizeof(info.serialNumber)))
+			continue;
+
+		*slot = slots[i];
+
+		return EXIT_SUCCESS;
+	}
+
+	err("The PKCS#11 token is not found\n");
+
+	return EXIT_FAILURE;
+}
+
+static int
+open_session(pkcs11_key_t *key, CK_SESSION_HANDLE *session)
+{
+	CK_FUNCTION_LIST_PTR funcs = key->module->funcs;
+	CK_RV rv = funcs->C_OpenSession(key->slot, CKF_SERIAL_SESSION, NULL,
+					NULL, session);
+
+	if (rv != CKR_OK) {
+		err("Failed to open PKCS#11 session (0x%lx)\n", rv);
+		return EXIT_FAILURE;
+	}
+
+	/* The login is shared by all sessions of the token */
+	if (key->pin) {
+		rv = funcs->C_Login(*session, CKU_USER,
+				    (CK_UTF8CHAR_PTR)key->pin,
+				    strlen(key->pin));
+		if (rv != CKR_OK && rv != CKR_USER_ALREADY_LOGGED_IN) {
+			err("Failed to log in PKCS#11 token (0x%lx)\n", rv);
+			funcs->C_CloseSession(*session);
+			return EXIT_FAILURE;
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
+
+static int
+find_object(pkcs11_key_t *key, CK_SESSION_HANDLE session,
+	    CK_OBJECT_CLASS class, const uint8_t *id, size_t id_len,
+	    CK_OBJECT_HANDLE *object)
+{
+	CK_FUNCTION_LIST_PTR funcs = key->module->funcs;
+	CK_ATTRIBUTE template[3] = {
+		{ CKA_CLASS, &class, sizeof(class) },
+	};
+	CK_ULONG nr_attr = 1;
+
+	if (key->label) {
+		template[nr_attr].type = CKA_LABEL;
+		template[nr_attr].pValue = key->label;
+		template[nr_attr++].ulValueLen = strlen(key->label);
+	}
+
+	if (id) {
+		template[nr_attr].type = CKA_ID;
+		template[nr_attr].pValue = (void *)id;
+		template[nr_attr++].ulValueLen = id_len;
+	}
+
+	CK_OBJECT_HANDLE objects[2];
+	CK_ULONG nr_object = 0;
+	CK_RV rv = funcs->C_FindObjectsInit(session, template, nr_attr);
+
+	if (rv == CKR_OK) {
+		rv = funcs->C_FindObjects(session, objects, 2, &nr_object);
+		funcs->C_FindObjectsFinal(session);
+	}
+
+	if (rv != CKR_OK || nr_object != 1) {
+		err("%s PKCS#11 %s key is found\n", nr_object ? "More than one" :
+		    "No", class == CKO_PRIVATE_KEY ? "private" : "public");
+		return EXIT_FAILURE;
+	}
+
+	*object = objects[0];
+
+	return EXIT_SUCCESS;
+}
+
+static int
+get_attribute(pkcs11_key_t *key, CK_SESSION_HANDLE session,
+	      CK_OBJECT_HANDLE object, CK_ATTRIBUTE_TYPE type,
+	      uint8_t **value, CK_ULONG *len)
+{
+	CK_FUNCTION_LIST_PTR funcs = key->module->funcs;
+	CK_ATTRIBUTE attr = { type, NULL, 0 };
+
+	if (funcs->C_GetAttributeValue(session, object, &attr, 1) != CKR_OK ||
+	    attr.ulValueLen == CK_UNAVAILABLE_INFORMATION) {
+		err("Failed to get the attribute 0x%lx of PKCS#11 key\n",
+		    type);
+		return EXIT_FAILURE;
+	}
+
+	attr.pValue = malloc(attr.ulValueLen + 1);
+	if (!attr.pValue)
+		return EXIT_FAILURE;
+
+	if (funcs->C_GetAttributeValue(session, object, &attr, 1) !=
+	    CKR_OK) {
+		free(attr.pValue);
+		return EXIT_FAILURE;
+	}
+
+	*value = attr.pValue;
+	*len = attr.ulValueLen;
+
+	return EXIT_SUCCESS;
+}
+
+static void
+drop_session(pkcs11_key_t *key)
+{
+	pthread_mutex_lock(&key->lock);
+	--key->nr_session;
+	pthread_cond_signal(&key->cond);
+	pthread_mutex_unlock(&key->lock);
+}
+
+/*
+ * Take an idle session of the key, or open a new one if all are busy,
+ * up to PKCS11_MAX_SESSION.
+ */
+static int
+get_session(pkcs11_key_t *key, CK_SESSION_HANDLE *session)
+{
+	pthread_mutex_lock(&key->lock);
+
+	/* The sessions of the parent are not usable in a forked process */
+	if (key->pid != getpid()) {
+		pthread_mutex_lock(&pkcs11_lock);
+		int rc = initialize_module(key->module);
+		pthread_mutex_unlock(&pkcs11_lock);
+
+		if (rc) {
+			pthread_mutex_unlock(&key->lock);
+			return rc;
+		}
+
+		key->nr_session = key->nr_idle = 0;
+		key->object = CK_INVALID_HANDLE;
+		key->pid = getpid();
+	}
+
+	while (!key->nr_idle && key->nr_session >= PKCS11_MAX_SESSION)
+		pthread_cond_wait(&key->cond, &key->lock);
+
+	if (key->nr_idle) {
+		*session = key->idle[--key->nr_idle];
+		pthread_mutex_unlock(&key->lock);
+		return EXIT_SUCCESS;
+	}
+
+	++key->nr_session;
+	pthread_mutex_unlock(&key->lock);
+
+	if (open_session(key, session)) {
+		drop_session(key);
+		return EXIT_FAILURE;
+	}
+
+	int rc = EXIT_SUCCESS;
+
+	pthread_mutex_lock(&key->lock);
+	if (key->object == CK_INVALID_HANDLE)
+		rc = find_object(key, *session, CKO_PRIVATE_KEY, key->id,
+				 key->id_len, &key->object);
+	pthread_mutex_unlock(&key->lock);
+
+	if (rc) {
+		key->module->funcs->C_CloseSession(*session);
+		drop_session(key);
+	}
+
+	return rc;
+}
+
+/* Return the session to the pool unless it is no longer usable */
+static void
+put_session(pkcs11_key_t *key, CK_SESSION_HANDLE session, CK_RV rv)
+{
+	if (rv == CKR_SESSION_HANDLE_INVALID || rv == CKR_SESSION_CLOSED ||
+	    rv == CKR_USER_NOT_LOGGED_IN || rv == CKR_DEVICE_REMOVED ||
+	    rv == CKR_TOKEN_NOT_PRESENT) {
+		key->module->funcs->C_CloseSession(session);
+		drop_session(key);
+		return;
+	}
+
+	pthread_mutex_lock(&key->lock);
+	key->idle[key->nr_idle++] = session;
+	pthread_cond_signal(&key->cond);
+	pthread_mutex_unlock(&key->lock);
+}
+
+static int
+pkcs11_sign(pkcs11_key_t *key, CK_MECHANISM_TYPE type, const uint8_t *in,
+	    size_t in_len, uint8_t *out, CK_ULONG *out_len)
+{
+	CK_MECHANISM mechanism = { type, NULL, 0 };
+	CK_SESSION_HANDLE session;
+
+	if (get_session(key, &session))
+		return EXIT_FAILURE;
+
+	CK_FUNCTION_LIST_PTR funcs = key->module->funcs;
+	CK_RV rv = funcs->C_SignInit(session, &mechanism, key->object);
+
+	if (rv == CKR_OK)
+		rv = funcs->C_Sign(session, (CK_BYTE_PTR)in, in_len, out,
+				   out_len);
+
+	put_session(key, session, rv);
+
+	if (rv != CKR_OK) {
+		err("Failed to sign with PKCS#11 key (0x%lx)\n", rv);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/* The DigestInfo is padded by the token with CKM_RSA_PKCS */
+static int
+rsa_priv_enc(int flen, const unsigned char *from, unsigned char *to,
+	     RSA *rsa, int padding)
+{
+	pkcs11_key_t *key = RSA_get_ex_data(rsa, rsa_ex_index);
+	CK_ULONG len = RSA_size(rsa);
+
+	if (padding != RSA_PKCS1_PADDING) {
+		err("Unsupported RSA padding %d of PKCS#11 key\n", padding);
+		return -1;
+	}
+
+	if (pkcs11_sign(key, CKM_RSA_PKCS, from, flen, to, &len))
+		return -1;
+
+	return (int)len;
+}
+
+/* CKM_ECDSA returns r and s concatenated */
+static ECDSA_SIG *
+ec_sign_sig(const unsigned char *dgst, int dlen, const BIGNUM *kinv,
+	    const BIGNUM *r, EC_KEY *ec)
+{
+	pkcs11_key_t *key = EC_KEY_get_ex_data(ec, ec_ex_index);
+	int size = (EC_GROUP_order_bits(EC_KEY_get0_group(ec)) + 7) / 8;
+	uint8_t rs[2 * size];
+	CK_ULONG len = sizeof(rs);
+
+	if (pkcs11_sign(key, CKM_ECDSA, dgst, dlen, rs, &len))
+		return NULL;
+
+	if (len != sizeof(rs)) {
+		err("Invalid ECDSA signature of PKCS#11 key\n");
+		return NULL;
+	}
+
+	ECDSA_SIG *sig = ECDSA_SIG_new();
+	BIGNUM *sig_r = BN_bin2bn(rs, size, NULL);
+	BIGNUM *sig_s = BN_bin2bn(rs + size, size, NULL);
+
+	if (!sig || !sig_r || !sig_s || !ECDSA_SIG_set0(sig, sig_r, sig_s)) {
+		ECDSA_SIG_free(sig);
+		BN_free(sig_r);
+		BN_free(sig_s);
+		return NULL;
+	}
+
+	return sig;
+}
+
+/* Called with pkcs11_lock held */
+static int
+create_methods(void)
+{
+	if (rsa_method)
+		return EXIT_SUCCESS;
+
+	rsa_ex_index = RSA_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+	ec_ex_index = EC_KEY_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+	if (rsa_ex_index < 0 || ec_ex_index < 0)
+		return EXIT_FAILURE;
+
+	ec_method = EC_KEY_METHOD_new(EC_KEY_get_default_method());
+	if (!ec_method)
+		return EXIT_FAILURE;
+
+	int (*sign)(int type, const unsigned char *dgst, int dlen,
+		    unsigned char *sig, unsigned int *siglen,
+		    const BIGNUM *kinv, const BIGNUM *r, EC_KEY *eckey);
+	int (*sign_setup)(EC_KEY *eckey, BN_CTX *ctx_in, BIGNUM **kinvp,
+			  BIGNUM **rp);
+
+	/* ECDSA_sign() ends up in sign_sig() through the default sign() */
+	EC_KEY_METHOD_get_sign(ec_method, &sign, &sign_setup, NULL);
+	EC_KEY_METHOD_set_sign(ec_method, sign, sign_setup, ec_sign_sig);
+
+	rsa_method = RSA_meth_dup(RSA_get_default_method());
+	if (!rsa_method || !RSA_meth_set1_name(rsa_method, "libsign PKCS#11") ||
+	    !RSA_meth_set_priv_enc(rsa_method, rsa_priv_enc)) {
+		RSA_meth_free(rsa_method);
+		rsa_method = NULL;
+		EC_KEY_METHOD_free(ec_method);
+		ec_method = NULL;
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+static EVP_PKEY *
+rsa_key(pkcs11_key_t *key, CK_SESSION_HANDLE session)
+{
+	uint8_t *modulus = NULL, *exponent = NULL;
+	CK_ULONG modulus_len, exponent_len;
+	BIGNUM *n = NULL, *e = NULL;
+	RSA *rsa = NULL;
+	EVP_PKEY *pkey = NULL;
+
+	if (get_attribute(key, session, key->object, CKA_MODULUS, &modulus,
+			  &modulus_len) ||
+	    get_attribute(key, session, key->object, CKA_PUBLIC_EXPONENT,
+			  &exponent, &exponent_len))
+		goto out;
+
+	n = BN_bin2bn(modulus, modulus_len, NULL);
+	e = BN_bin2bn(exponent, exponent_len, NULL);
+	rsa = RSA_new();
+	pkey = EVP_PKEY_new();
+	if (!n || !e || !rsa || !pkey || !RSA_set_method(rsa, rsa_method) ||
+	    !RSA_set0_key(rsa, n, e, NULL))
+		goto err;
+
+	n = e = NULL;
+	if (!RSA_set_ex_data(rsa, rsa_ex_index, key) ||
+	    !EVP_PKEY_assign_RSA(pkey, rsa))
+		goto err;
+
+	rsa = NULL;
+	goto out;
+
+err:
+	EVP_PKEY_free(pkey);
+	pkey = NULL;
+
+out:
+	RSA_free(rsa);
+	BN_free(n);
+	BN_free(e);
+	free(modulus);
+	free(exponent);
+
+	return pkey;
+}
+
+/*
+ * The private key doesn't carry the EC point, so it is taken from the
+ * public key with the same id.
+ */
+static EVP_PKEY *
+ec_key(pkcs11_key_t *key, CK_SESSION_HANDLE session)
+{
+	uint8_t *params = NULL, *id = NULL, *point = NULL;
+	CK_ULONG params_len, id_len, point_len;
+	CK_OBJECT_HANDLE public_key;
+	EC_GROUP *group = NULL;
+	ASN1_OCTET_STRING *octet = NULL;
+	EC_KEY *ec = NULL;
+	EVP_PKEY *pkey = NULL;
+
+	if (get_attribute(key, session, key->object, CKA_EC_PARAMS, &params,
+			  &params_len) ||
+	    get_attribute(key, session, key->object, CKA_ID, &id, &id_len) ||
+	    find_object(key, session, CKO_PUBLIC_KEY, id, id_len,
+			&public_key) ||
+	    get_attribute(key, session, public_key, CKA_EC_POINT, &point,
+			  &point_len))
+		goto out;
+
+	const uint8_t *p = params;
+
+	group = d2i_ECPKParameters(NULL, &p, params_len);
+	if (!group)
+		goto out;
+
+	/* The point is DER-encoded in an OCTET STRING by the standard */
+	const uint8_t *oct = point;
+	size_t oct_len = point_len;
+
+	p = point;
+	octet = d2i_ASN1_OCTET_STRING(NULL, &p, point_len);
+	if (octet && p == point + point_len) {
+		oct = ASN1_STRING_get0_data(octet);
+		oct_len = ASN1_STRING_length(octet);
+	}
+
+	ec = EC_KEY_new();
+	pkey = EVP_PKEY_new();
+	if (!ec || !pkey || !EC_KEY_set_method(ec, ec_method) ||
+	    !EC_KEY_set_group(ec, group) ||
+	    !EC_KEY_oct2key(ec, oct, oct_len, NULL) ||
+	    !EC_KEY_set_ex_data(ec, ec_ex_index, key) ||
+	    !EVP_PKEY_assign_EC_KEY(pkey, ec)) {
+		EVP_PKEY_free(pkey);
+		pkey = NULL;
+		goto out;
+	}
+
+	ec = NULL;
+
+out:
+	EC_KEY_free(ec);
+	ASN1_OCTET_STRING_free(octet);
+	EC_GROUP_free(group);
+	free(params);
+	free(id);
+	free(point);
+
+	return pkey;
+}
+
+static void
+free_key(pkcs11_key_t *key)
+{
+	/* The sessions of the parent are left to it after fork */
+	if (key->pid == getpid()) {
+		for (unsigned int i = 0; i < key->nr_idle; ++i)
+			key->module->funcs->C_CloseSession(key->idle[i]);
+	}
+
+	EVP_PKEY_free(key->pkey);
+	pthread_cond_destroy(&key->cond);
+	pthread_mutex_destroy(&key->lock);
+	free(key->pin);
+	free(key->label);
+	free(key->id);
+	free(key);
+}
+
+/* Called with pkcs11_lock held */
+static pkcs11_key_t *
+create_key(const char *string, pkcs11_uri_t *uri)
+{
+	pkcs11_key_t *key = calloc(1, sizeof(*key) + strlen(string) + 1);
+	if (!key)
+		return NULL;
+
+	strcpy(key->uri, string);
+	pthread_mutex_init(&key->lock, NULL);
+	pthread_cond_init(&key->cond, NULL);
+	key->pid = getpid();
+	key->object = CK_INVALID_HANDLE;
+
+	/* Taken over from the URI */
+	key->pin = uri->pin;
+	key->label = uri->object;
+	key->id = uri->id;
+	key->id_len = uri->id_len;
+	uri->pin = uri->object = NULL;
+	uri->id = NULL;
+
+	key->module = load_module(uri->module_path);
+	if (!key->module || create_methods() ||
+	    find_slot(key->module->funcs, uri, &key->slot)) {
+		free_key(key);
+		return NULL;
+	}
+
+	CK_SESSION_HANDLE session;
+
+	if (get_session(key, &session)) {
+		free_key(key);
+		return NULL;
+	}
+
+	uint8_t *type;
+	CK_ULONG type_len;
+
+	if (!get_attribute(key, session, key->object, CKA_KEY_TYPE, &type,
+			   &type_len)) {
+		CK_KEY_TYPE key_type = CKK_VENDOR_DEFINED;
+
+		if (type_len == sizeof(key_type))
+			memcpy(&key_type, type, sizeof(key_type));
+		free(type);
+
+		if (key_type == CKK_RSA)
+			key->pkey = rsa_key(key, session);
+		else if (key_type == CKK_EC)
+			key->pkey = ec_key(key, session);
+		else
+			err("Unsupported type 0x%lx of PKCS#11 key\n",
+			    key_type);
+	}
+
+	put_session(key, session, CKR_OK);
+
+	if (!key->pkey) {
+		free_key(key);
+		return NULL;
+	}
+
+	return key;
+}
+
+EVP_PKEY *
+pkcs11_key_load(const char *string)
+{
+	pkcs11_key_t *key;
+	EVP_PKEY *pkey = NULL;
+
+	pthread_mutex_lock(&pkcs11_lock);
+
+	for (key = keys; key; key = key->next) {
+		if (!strcmp(key->uri, string))
+			break;
+	}
+
+	if (!key) {
+		pkcs11_uri_t uri;
+
+		if (parse_uri(string, &uri))
+			goto out;
+
+		key = create_key(string, &uri);
+		free_uri(&uri);
+		if (key) {
+			key->next = keys;
+			keys = key;
+		}
+	}
+
+	if (key && EVP_PKEY_up_ref(key->pkey))
+		pkey = key->pkey;
+
+out:
+	pthread_mutex_unlock(&pkcs11_lock);
+
+	return pkey;
+}
+
+void
+pkcs11_fini(void)
+{
+	pthread_mutex_lock(&pkcs11_lock);
+
+	while (keys) {
+		pkcs11_key_t *key = keys;
+
+		keys = key->next;
+		free_key(key);
+	}
+
+	while (modules) {
+		pkcs11_module_t *module = modules;
+
+		modules = module->next;
+		if (module->pid == getpid())
+			module->funcs->C_Finalize(NULL);
+		dlclose(module->handle);
+		free(module);
+	}
+
+	/* EC_KEY_METHOD_free() doesn't take NULL */
+	if (rsa_method) {
+		RSA_meth_free(rsa_method);
+		rsa_method = NULL;
+		EC_KEY_METHOD_free(ec_method);
+		ec_method = NULL;
+	}
+
+	pthread_mutex_unlock(&pkcs11_lock);
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2017, Wind River Systems, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1) Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2) Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3) Neither the name of Wind River Systems nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Author:
+ *        Lans Zhang <jia.zhang@windriver.com>
+ */
+
+#ifndef __PKCS11_H__
+#define __PKCS11_H__
+
+#include <libsign.h>
+
+/*
+ * The scheme of the RFC 7512 URI of a key on a PKCS#11 token. The rest is
+ * only built with LIBSIGN_PKCS11.
+ */
+#define PKCS11_URI_SCHEME		"pkcs11:"
+
+/* The sessions opened at most for a key, one per concurrent signing */
+#define PKCS11_MAX_SESSION		64
+
+/*
+ * Return a reference to the private key identified by the URI, with the
+ * signing operations done by the token. The key is found with the token,
+ * serial, slot-id, object and id attributes. The module is loaded from
+ * the module-path attribute, or LIBSIGN_PKCS11_MODULE if not given. The
+ * PIN is taken from the pin-value or pin-source attribute, or
+ * LIBSIGN_PKCS11_PIN.
+ *
+ * The sessions of a key are logged in once and shared by the threads,
+ * so that the concurrent signings are queued on the token in parallel.
+ * They are opened again in a forked process on the first signing.
+ */
+EVP_PKEY *
+pkcs11_key_load(const char *uri);
+
+/* Close the sessions and unload the modules */
+void
+pkcs11_fini(void);
+
+#endif	/* __PKCS11_H__ */
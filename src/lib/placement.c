@@ -0,0 +1,237 @@
+/*
+ * Copyright (c) 2017, Wind River Systems, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1) Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2) Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3) Neither the name of Wind River Systems nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Author:
+ *        Lans Zhang <jia.zhang@windriver.com>
+ */
+
+#include <libsign.h>
+
+#include "placement.h"
+
+#define PLACEMENT_SYSFS_NODE		"/sys/devices/system/node"
+
+static placement_t placement;
+static pthread_once_t placement_once = PTHREAD_ONCE_INIT;
+
+/* Parse a list such as "0-3,8,10-11" as found in the sysfs */
+static int
+parse_list(const char *path, cpu_set_t *set)
+{
+	char buf[4096];
+
+	CPU_ZERO(set);
+
+	FILE *fp = fopen(path, "re");
+	if (!fp)
+		return EXIT_FAILURE;
+
+	char *line = fgets(buf, sizeof(buf), fp);
+	fclose(fp);
+	if (!line)
+		return EXIT_FAILURE;
+
+	while (*line && *line != '\n') {
+		char *end;
+		unsigned long first = strtoul(line, &end, 10);
+		unsigned long last = first;
+
+		if (end == line)
+			return EXIT_FAILURE;
+
+		if (*end == '-') {
+			line = end + 1;
+			last = strtoul(line, &end, 10);
+			if (end == line)
+				return EXIT_FAILURE;
+		}
+
+		for (; first <= last && first < CPU_SETSIZE; ++first)
+			CPU_SET(first, set);
+
+		line = end;
+		if (*line == ',')
+			++line;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+static void
+add_node(unsigned int node_id, cpu_set_t *cpus, cpu_set_t *allowed)
+{
+	unsigned int nr_cpu = placement.nr_cpu;
+
+	for (unsigned int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		if (!CPU_ISSET(cpu, cpus) || !CPU_ISSET(cpu, allowed))
+			continue;
+
+		placement.cpus[placement.nr_cpu++] = cpu;
+		/* Each CPU is placed on one node only */
+		CPU_CLR(cpu, allowed);
+	}
+
+	if (placement.nr_cpu == nr_cpu)
+		return;
+
+	placement.node_id[placement.nr_node] = node_id;
+	placement.node_start[placement.nr_node++] = nr_cpu;
+}
+
+static void
+probe_topology(void)
+{
+	cpu_set_t allowed;
+	cpu_set_t nodes;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed)) {
+		long nr_cpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+		CPU_ZERO(&allowed);
+		for (long cpu = 0; cpu < nr_cpu && cpu < CPU_SETSIZE; ++cpu)
+			CPU_SET(cpu, &allowed);
+	}
+
+	/* The node list has the same format as the CPU list */
+	if (!parse_list(PLACEMENT_SYSFS_NODE "/online", &nodes)) {
+		for (unsigned int node = 0; node < PLACEMENT_MAX_NODE;
+		     ++node) {
+			char path[64];
+			cpu_set_t cpus;
+
+			if (!CPU_ISSET(node, &nodes))
+				continue;
+
+			snprintf(path, sizeof(path),
+				 PLACEMENT_SYSFS_NODE "/node%u/cpulist", node);
+			if (!parse_list(path, &cpus))
+				add_node(node, &cpus, &allowed);
+		}
+	}
+
+	/* Without NUMA, all CPUs are on the node 0 */
+	if (!placement.nr_node)
+		add_node(0, &allowed, &allowed);
+	else if (CPU_COUNT(&allowed)) {
+		/* Leave the CPUs of any unknown node on the last one */
+		for (unsigned int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+			if (CPU_ISSET(cpu, &allowed))
+				placement.cpus[placement.nr_cpu++] = cpu;
+		}
+	}
+
+	placement.node_start[placement.nr_node] = placement.nr_cpu;
+
+	dbg("Placing the workers on %u CPUs of %u nodes\n",
+	    placement.nr_cpu, placement.nr_node);
+}
+
+const placement_t *
+placement_get(void)
+{
+	pthread_once(&placement_once, probe_topology);
+
+	return &placement;
+}
+
+unsigned int
+placement_node(const placement_t *placement, LIBSIGN_PLACEMENT policy,
+	       unsigned int worker)
+{
+	if (!placement->nr_cpu)
+		return 0;
+
+	unsigned int node = 0;
+
+	switch (policy) {
+	case LIBSIGN_PLACEMENT_COMPACT:
+		worker %= placement->nr_cpu;
+		while (worker >= placement->node_start[node + 1])
+			++node;
+
+		return node;
+	case LIBSIGN_PLACEMENT_SCATTER:
+	case LIBSIGN_PLACEMENT_NUMA:
+		return worker % placement->nr_node;
+	default:
+		return 0;
+	}
+}
+
+int
+placement_bind(const placement_t *placement, LIBSIGN_PLACEMENT policy,
+	       unsigned int worker)
+{
+	if (policy == LIBSIGN_PLACEMENT_NONE || !placement->nr_cpu)
+		return EXIT_SUCCESS;
+
+	unsigned int node = placement_node(placement, policy, worker);
+	unsigned int first = placement->node_start[node];
+	unsigned int nr = placement->node_start[node + 1] - first;
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+
+	switch (policy) {
+	case LIBSIGN_PLACEMENT_COMPACT:
+		CPU_SET(placement->cpus[worker % placement->nr_cpu], &set);
+		break;
+	case LIBSIGN_PLACEMENT_SCATTER:
+		/* The workers sharing a node take its CPUs in turn */
+		CPU_SET(placement->cpus[first + worker / placement->nr_node % nr],
+			&set);
+		break;
+	default:
+		/* Free to run on any CPU of the node */
+		for (unsigned int i = first; i < first + nr; ++i)
+			CPU_SET(placement->cpus[i], &set);
+		break;
+	}
+
+	int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (rc) {
+		warn("Failed to place the worker %u (%s)\n", worker,
+		     strerror(rc));
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+unsigned int
+placement_current_node(void)
+{
+	unsigned int cpu;
+	unsigned int node;
+
+	if (getcpu(&cpu, &node) || node >= PLACEMENT_MAX_NODE)
+		return 0;
+
+	return node;
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2017, Wind River Systems, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1) Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2) Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3) Neither the name of Wind River Systems nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Author:
+ *        Lans Zhang <jia.zhang@windriver.com>
+ */
+
+#ifndef __PLACEMENT_H__
+#define __PLACEMENT_H__
+
+#include <libsign.h>
+#include <sched.h>
+
+/*
+ * The placement of the concurrent workers on the CPUs and NUMA nodes.
+ * The worker N of a job is placed by the policy of the job, so the
+ * workers sharing a node also share the files assigned to the node,
+ * and the buffers they allocate after being placed are first touched
+ * on that node.
+ */
+
+#define PLACEMENT_MAX_NODE		64
+
+typedef struct {
+	/* The nodes with any CPU allowed to this process */
+	unsigned int nr_node;
+	/* The system node number of each node */
+	unsigned int node_id[PLACEMENT_MAX_NODE];
+	/* The index of the first CPU of each node in the cpus */
+	unsigned int node_start[PLACEMENT_MAX_NODE + 1];
+	/* The CPUs allowed to this process, grouped by node */
+	unsigned int nr_cpu;
+	unsigned short cpus[CPU_SETSIZE];
+} placement_t;
+
+/* The topology probed at the first call */
+const placement_t *
+placement_get(void);
+
+/* The index of the node the worker is placed on */
+unsigned int
+placement_node(const placement_t *placement, LIBSIGN_PLACEMENT policy,
+	       unsigned int worker);
+
+/* Place the calling thread as the worker */
+int
+placement_bind(const placement_t *placement, LIBSIGN_PLACEMENT policy,
+	       unsigned int worker);
+
+/* The system node number of the CPU running the calling thread */
+unsigned int
+placement_current_node(void);
+
+#endif	/* __PLACEMENT_H__ */
@@ -0,0 +1,312 @@
+/*
+ * Copyright (c) 2017, Wind River Systems, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1) Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2) Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3) Neither the name of Wind River Systems nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Author:
+ *        Lans Zhang <jia.zhang@windriver.com>
+ */
+
+#include <libsign.h>
+#include "prefetch.h"
+
+static void
+end_prefetch(prefetcher_t *prefetcher, bool failed)
+{
+	pthread_mutex_lock(&prefetcher->lock);
+	prefetcher->ended = true;
+	if (failed)
+		prefetcher->failed = true;
+	pthread_cond_broadcast(&prefetcher->cond);
+	pthread_mutex_unlock(&prefetcher->lock);
+}
+
+/*
+ * Open the next file of the source into the window. Only the issuer
+ * changes the issued index, so it is read without the lock here.
+ */
+static void
+issue_prefetch(prefetcher_t *prefetcher)
+{
+	const char *path = NULL;
+	const char *output = NULL;
+
+	if (prefetcher->source(prefetcher->source_data, &path, &output)) {
+		err("Failed to get the next file\n");
+		end_prefetch(prefetcher, true);
+		return;
+	}
+
+	if (!path) {
+		end_prefetch(prefetcher, false);
+		return;
+	}
+
+	prefetch_entry_t *entry;
+	unsigned int index = prefetcher->issued;
+
+	entry = prefetcher->entries + index % prefetcher->window;
+	entry->index = index;
+	entry->fd = -1;
+	entry->size = 0;
+	entry->path = strdup(path);
+	entry->output = output ? strdup(output) : NULL;
+	if (!entry->path || (output && !entry->output)) {
+		free(entry->path);
+		free(entry->output);
+		end_prefetch(prefetcher, true);
+		return;
+	}
+
+	/* Leave the error report of open() to the signer */
+	entry->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (entry->fd >= 0) {
+		struct stat st;
+
+		if (!fstat(entry->fd, &st) && S_ISREG(st.st_mode))
+			entry->size = st.st_size;
+	}
+
+	/*
+	 * Only initiate the readahead for the small files. The large ones
+	 * are read sequentially anyway and the readahead of them may evict
+	 * the pages of the following files. Nothing is brought into the
+	 * page cache if the caller wants to bypass it.
+	 */
+	if (entry->size && entry->size <= PREFETCH_MAX_SIZE &&
+	    libsign_io_policy() != LIBSIGN_IO_POLICY_DIRECT)
+		readahead(entry->fd, 0, entry->size);
+
+	pthread_mutex_lock(&prefetcher->lock);
+	++prefetcher->issued;
+	pthread_cond_broadcast(&prefetcher->cond);
+	pthread_mutex_unlock(&prefetcher->lock);
+}
+
+/* Keep the window filled until the source ends or the thread is stopped */
+static void *
+prefetch_thread(void *data)
+{
+	prefetcher_t *prefetcher = data;
+
+	pthread_mutex_lock(&prefetcher->lock);
+
+	while (!prefetcher->stopping && !prefetcher->ended) {
+		if (prefetcher->issued ==
+		    prefetcher->next + prefetcher->window) {
+			pthread_cond_wait(&prefetcher->cond, &prefetcher->lock);
+			continue;
+		}
+
+		pthread_mutex_unlock(&prefetcher->lock);
+		issue_prefetch(prefetcher);
+		pthread_mutex_lock(&prefetcher->lock);
+	}
+
+	pthread_mutex_unlock(&prefetcher->lock);
+
+	return NULL;
+}
+
+/*
+ * Start the prefetch thread with the lock held. The files signed by the
+ * worker processes are never taken from the prefetcher, so nothing is
+ * opened ahead for them. Fall back to open the files in the calling
+ * thread if the thread fails to be created.
+ */
+static void
+start_prefetch(prefetcher_t *prefetcher)
+{
+	if (prefetcher->started)
+		return;
+
+	prefetcher->started = true;
+
+	if (prefetcher->window == 1)
+		return;
+
+	if (pthread_create(&prefetcher->thread, NULL, prefetch_thread,
+			   prefetcher)) {
+		warn("Failed to create the prefetch thread\n");
+		return;
+	}
+
+	prefetcher->threaded = true;
+}
+
+static void
+stop_prefetch(prefetcher_t *prefetcher)
+{
+	pthread_mutex_lock(&prefetcher->lock);
+	prefetcher->stopping = true;
+	pthread_cond_broadcast(&prefetcher->cond);
+	pthread_mutex_unlock(&prefetcher->lock);
+
+	if (prefetcher->threaded) {
+		pthread_join(prefetcher->thread, NULL);
+		prefetcher->threaded = false;
+	}
+}
+
+/*
+ * Wait with the lock held until the next file is opened or the source
+ * ends. Without the thread, open the files of the window here.
+ */
+static void
+wait_prefetch(prefetcher_t *prefetcher, bool fill)
+{
+	start_prefetch(prefetcher);
+
+	if (!prefetcher->threaded) {
+		unsigned int end = prefetcher->next +
+				   (fill ? prefetcher->window : 1);
+
+		pthread_mutex_unlock(&prefetcher->lock);
+		while (!prefetcher->ended && prefetcher->issued < end)
+			issue_prefetch(prefetcher);
+		pthread_mutex_lock(&prefetcher->lock);
+	}
+
+	while (prefetcher->next == prefetcher->issued && !prefetcher->ended)
+		pthread_cond_wait(&prefetcher->cond, &prefetcher->lock);
+}
+
+int
+prefetcher_init(prefetcher_t *prefetcher, prefetch_source_t source,
+		void *source_data, unsigned int window)
+{
+	if (!prefetcher || !source)
+		return EXIT_FAILURE;
+
+	memset(prefetcher, 0, sizeof(*prefetcher));
+
+	if (!window)
+		window = 1;
+
+	prefetcher->entries = malloc(window * sizeof(prefetch_entry_t));
+	if (!prefetcher->entries)
+		return EXIT_FAILURE;
+
+	prefetcher->source = source;
+	prefetcher->source_data = source_data;
+	prefetcher->window = window;
+	pthread_mutex_init(&prefetcher->lock, NULL);
+	pthread_cond_init(&prefetcher->cond, NULL);
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Only the files in the window are taken from the source, so a source
+ * of any length is prefetched in constant memory.
+ */
+bool
+prefetcher_done(prefetcher_t *prefetcher)
+{
+	pthread_mutex_lock(&prefetcher->lock);
+	wait_prefetch(prefetcher, false);
+	bool done = prefetcher->next == prefetcher->issued;
+	pthread_mutex_unlock(&prefetcher->lock);
+
+	return done;
+}
+
+/*
+ * Return the next file with its opened file descriptor, and prefetch
+ * the files following it. The caller owns the file descriptor and the
+ * paths of the entry. The size is 0 if the file is not a regular file.
+ * Return EXIT_FAILURE if no file is left.
+ */
+int
+prefetcher_next(prefetcher_t *prefetcher, prefetch_entry_t *entry)
+{
+	pthread_mutex_lock(&prefetcher->lock);
+
+	wait_prefetch(prefetcher, true);
+
+	if (prefetcher->next == prefetcher->issued) {
+		pthread_mutex_unlock(&prefetcher->lock);
+		return EXIT_FAILURE;
+	}
+
+	*entry = prefetcher->entries[prefetcher->next++ % prefetcher->window];
+
+	/* Make room in the window for the thread */
+	pthread_cond_broadcast(&prefetcher->cond);
+	pthread_mutex_unlock(&prefetcher->lock);
+
+	if (entry->fd < 0)
+		err("Failed to open %s\n", entry->path);
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Return the next file already opened without taking more files from
+ * the source, so that the files left in the window are handed back when
+ * signing stops early. Return EXIT_FAILURE if none is left.
+ */
+int
+prefetcher_drain(prefetcher_t *prefetcher, prefetch_entry_t *entry)
+{
+	if (!prefetcher->entries)
+		return EXIT_FAILURE;
+
+	stop_prefetch(prefetcher);
+
+	if (prefetcher->next == prefetcher->issued)
+		return EXIT_FAILURE;
+
+	*entry = prefetcher->entries[prefetcher->next++ % prefetcher->window];
+
+	return EXIT_SUCCESS;
+}
+
+void
+prefetcher_fini(prefetcher_t *prefetcher)
+{
+	if (!prefetcher->entries)
+		return;
+
+	stop_prefetch(prefetcher);
+
+	while (prefetcher->next < prefetcher->issued) {
+		unsigned int index = prefetcher->next++;
+		prefetch_entry_t *entry;
+
+		entry = prefetcher->entries + index % prefetcher->window;
+		if (entry->fd >= 0)
+			close(entry->fd);
+		free(entry->path);
+		free(entry->output);
+	}
+
+	pthread_cond_destroy(&prefetcher->cond);
+	pthread_mutex_destroy(&prefetcher->lock);
+	free(prefetcher->entries);
+	prefetcher->entries = NULL;
+}
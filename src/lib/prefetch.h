@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2017, Wind River Systems, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1) Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2) Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3) Neither the name of Wind River Systems nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Author:
+ *        Lans Zhang <jia.zhang@windriver.com>
+ */
+
+#ifndef __PREFETCH_H__
+#define __PREFETCH_H__
+
+#include <libsign.h>
+
+/*
+ * The prefetcher opens the files in a window ahead of the signer and
+ * kicks off the asynchronous readahead for them, so the I/O latency of
+ * the following files overlaps the signing of the current one. The
+ * files are opened by a thread of the prefetcher, so the signer doesn't
+ * block in open() and fstat() for the metadata not cached yet. With a
+ * window of 1 nothing is opened ahead, and the file is opened in the
+ * calling thread.
+ */
+
+#define PREFETCH_WINDOW			32
+#define PREFETCH_MAX_SIZE		(16 * 1024 * 1024)
+
+/*
+ * Return the next file in path, and optionally the path of its output
+ * in output, or set path to NULL at the end of files. The strings are
+ * copied by the prefetcher before the next call.
+ */
+typedef int (*prefetch_source_t)(void *data, const char **path,
+				 const char **output);
+
+typedef struct {
+	/* The position of the file in the source */
+	unsigned int index;
+	/* -1 if the file failed to be opened */
+	int fd;
+	off_t size;
+	char *path;
+	/* NULL if not given by the source */
+	char *output;
+} prefetch_entry_t;
+
+typedef struct {
+	prefetch_source_t source;
+	void *source_data;
+	/* Set once the source has no more file, or fails */
+	bool ended;
+	bool failed;
+	unsigned int window;
+	/* The index of file to be returned to the signer */
+	unsigned int next;
+	/* The index of file to be opened */
+	unsigned int issued;
+	prefetch_entry_t *entries;
+	/* Protect the indexes and flags above from the prefetch thread */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	/* The thread is only created once the first file is taken */
+	bool started;
+	bool threaded;
+	bool stopping;
+} prefetcher_t;
+
+int
+prefetcher_init(prefetcher_t *prefetcher, prefetch_source_t source,
+		void *source_data, unsigned int window);
+
+/* Whether all files of the source are returned */
+bool
+prefetcher_done(prefetcher_t *prefetcher);
+
+int
+prefetcher_next(prefetcher_t *prefetcher, prefetch_entry_t *entry);
+
+int
+prefetcher_drain(prefetcher_t *prefetcher, prefetch_entry_t *entry);
+
+void
+prefetcher_fini(prefetcher_t *prefetcher);
+
+#endif	/* __PREFETCH_H__ */
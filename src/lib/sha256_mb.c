@@ -0,0 +1,324 @@
+/*
+ * Copyright (c) 2017, Wind River Systems, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1) Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2) Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3) Neither the name of Wind River Systems nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Author:
+ *        Lans Zhang <jia.zhang@windriver.com>
+ */
+
+#include <libsign.h>
+#include "sha256_mb.h"
+
+/*
+ * Multi-buffer SHA-256
+ *
+ * Each lane of a SIMD register holds the state of an independent
+ * message, so 8 (AVX2) or 16 (AVX-512) messages are hashed by a single
+ * pass of the compression function. The implementation is written with
+ * the GCC vector extensions and instantiated for both vector widths.
+ */
+
+typedef struct {
+	const uint8_t *data;
+	size_t nr_full_block;
+	size_t nr_block;
+	/* The padded last one or two blocks */
+	uint8_t tail[SHA256_MB_BLOCK_SIZE * 2];
+} lane_t;
+
+static void
+init_lane(lane_t *lane, const uint8_t *data, size_t size)
+{
+	size_t rem = size % SHA256_MB_BLOCK_SIZE;
+	size_t nr_tail_block = rem + 9 > SHA256_MB_BLOCK_SIZE ? 2 : 1;
+	size_t tail_size = nr_tail_block * SHA256_MB_BLOCK_SIZE;
+	uint64_t bits = (uint64_t)size * 8;
+
+	lane->data = data;
+	lane->nr_full_block = size / SHA256_MB_BLOCK_SIZE;
+	lane->nr_block = lane->nr_full_block + nr_tail_block;
+
+	memset(lane->tail, 0, tail_size);
+	if (rem)
+		memcpy(lane->tail, data + size - rem, rem);
+	lane->tail[rem] = 0x80;
+	for (int i = 0; i < 8; ++i)
+		lane->tail[tail_size - 1 - i] = bits >> (i * 8);
+}
+
+typedef void (*sha256_mb_fn)(lane_t *lane, unsigned int nr,
+			     uint8_t (*digest)[SHA256_MB_DIGEST_SIZE]);
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+
+static const uint8_t zero_block[SHA256_MB_BLOCK_SIZE];
+
+static const uint32_t K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const uint32_t H0[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static inline const uint8_t *
+lane_block(const lane_t *lane, size_t block)
+{
+	if (block < lane->nr_full_block)
+		return lane->data + block * SHA256_MB_BLOCK_SIZE;
+
+	if (block < lane->nr_block)
+		return lane->tail + (block - lane->nr_full_block) *
+				    SHA256_MB_BLOCK_SIZE;
+
+	return zero_block;
+}
+
+static inline uint32_t
+load_be32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+
+	return __builtin_bswap32(v);
+}
+
+#define ROTR(x, n)		(((x) >> (n)) | ((x) << (32 - (n))))
+#define S0(x)			(ROTR(x, 2) ^ ROTR(x, 13) ^ ROTR(x, 22))
+#define S1(x)			(ROTR(x, 6) ^ ROTR(x, 11) ^ ROTR(x, 25))
+#define s0(x)			(ROTR(x, 7) ^ ROTR(x, 18) ^ ((x) >> 3))
+#define s1(x)			(ROTR(x, 17) ^ ROTR(x, 19) ^ ((x) >> 10))
+#define CH(x, y, z)		(((x) & (y)) ^ (~(x) & (z)))
+#define MAJ(x, y, z)		(((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+
+/*
+ * Instantiate the hash function for the given number of lanes. The
+ * lanes beyond the end of their messages keep their state with the
+ * active mask.
+ */
+#define DEFINE_SHA256_MB(lanes, attr)					\
+typedef uint32_t v##lanes##u32						\
+	__attribute__((vector_size((lanes) * sizeof(uint32_t))));	\
+									\
+static attr void							\
+sha256_mb_x##lanes(lane_t *lane, unsigned int nr,			\
+		   uint8_t (*digest)[SHA256_MB_DIGEST_SIZE])		\
+{									\
+	v##lanes##u32 state[8], w[64], active, one;			\
+	uint32_t tmp[lanes];						\
+	size_t nr_block = 0;						\
+	unsigned int l;							\
+	int i;								\
+									\
+	for (i = 0; i < 8; ++i) {					\
+		for (l = 0; l < (lanes); ++l)				\
+			tmp[l] = H0[i];					\
+		memcpy(state + i, tmp, sizeof(tmp));			\
+	}								\
+									\
+	for (l = 0; l < nr; ++l) {					\
+		if (lane[l].nr_block > nr_block)			\
+			nr_block = lane[l].nr_block;			\
+	}								\
+									\
+	for (size_t b = 0; b < nr_block; ++b) {				\
+		const uint8_t *block[lanes];				\
+									\
+		for (l = 0; l < (lanes); ++l) {				\
+			block[l] = l < nr ? lane_block(lane + l, b) :	\
+					    zero_block;			\
+			tmp[l] = l < nr && b < lane[l].nr_block ?	\
+				 0xffffffff : 0;			\
+		}							\
+		memcpy(&active, tmp, sizeof(tmp));			\
+									\
+		for (i = 0; i < 16; ++i) {				\
+			for (l = 0; l < (lanes); ++l)			\
+				tmp[l] = load_be32(block[l] + i * 4);	\
+			memcpy(w + i, tmp, sizeof(tmp));		\
+		}							\
+									\
+		for (i = 16; i < 64; ++i)				\
+			w[i] = s1(w[i - 2]) + w[i - 7] +		\
+			       s0(w[i - 15]) + w[i - 16];		\
+									\
+		v##lanes##u32 a = state[0], b_ = state[1];		\
+		v##lanes##u32 c = state[2], d = state[3];		\
+		v##lanes##u32 e = state[4], f = state[5];		\
+		v##lanes##u32 g = state[6], h = state[7];		\
+									\
+		for (i = 0; i < 64; ++i) {				\
+			one = w[i] + K[i];				\
+			v##lanes##u32 t1 = h + S1(e) + CH(e, f, g) + one; \
+			v##lanes##u32 t2 = S0(a) + MAJ(a, b_, c);	\
+									\
+			h = g;						\
+			g = f;						\
+			f = e;						\
+			e = d + t1;					\
+			d = c;						\
+			c = b_;						\
+			b_ = a;						\
+			a = t1 + t2;					\
+		}							\
+									\
+		state[0] += a & active;					\
+		state[1] += b_ & active;				\
+		state[2] += c & active;					\
+		state[3] += d & active;					\
+		state[4] += e & active;					\
+		state[5] += f & active;					\
+		state[6] += g & active;					\
+		state[7] += h & active;					\
+	}								\
+									\
+	for (i = 0; i < 8; ++i) {					\
+		memcpy(tmp, state + i, sizeof(tmp));			\
+		for (l = 0; l < nr; ++l) {				\
+			digest[l][i * 4] = tmp[l] >> 24;		\
+			digest[l][i * 4 + 1] = tmp[l] >> 16;		\
+			digest[l][i * 4 + 2] = tmp[l] >> 8;		\
+			digest[l][i * 4 + 3] = tmp[l];			\
+		}							\
+	}								\
+}
+
+DEFINE_SHA256_MB(8, __attribute__((target("avx2"))))
+DEFINE_SHA256_MB(16, __attribute__((target("avx512f"))))
+
+static bool
+cpu_has_sha_ni(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return false;
+
+	return !!(ebx & bit_SHA);
+}
+
+/*
+ * A single SHA-NI stream of OpenSSL outruns the 8 AVX2 lanes, but not
+ * the 16 AVX-512 lanes.
+ */
+static sha256_mb_fn
+select_impl(unsigned int *lanes)
+{
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx512f")) {
+		*lanes = 16;
+		return sha256_mb_x16;
+	}
+
+	if (__builtin_cpu_supports("avx2") && !cpu_has_sha_ni()) {
+		*lanes = 8;
+		return sha256_mb_x8;
+	}
+
+	*lanes = 0;
+	return NULL;
+}
+#else
+static sha256_mb_fn
+select_impl(unsigned int *lanes)
+{
+	*lanes = 0;
+	return NULL;
+}
+#endif
+
+static sha256_mb_fn impl;
+static unsigned int impl_lanes;
+static bool impl_selected;
+
+static void
+init_impl(void)
+{
+	if (!__atomic_load_n(&impl_selected, __ATOMIC_ACQUIRE)) {
+		impl = select_impl(&impl_lanes);
+		__atomic_store_n(&impl_selected, true, __ATOMIC_RELEASE);
+	}
+}
+
+/*
+ * Return the number of lanes, or 0 if the multi-buffer hashing isn't
+ * faster than hashing the messages one by one on this CPU.
+ */
+unsigned int
+sha256_mb_lanes(void)
+{
+	init_impl();
+
+	return impl_lanes;
+}
+
+void
+sha256_mb(const uint8_t *const *data, const size_t *size, unsigned int nr,
+	  uint8_t (*digest)[SHA256_MB_DIGEST_SIZE])
+{
+	init_impl();
+
+	unsigned int lanes = impl_lanes;
+	sha256_mb_fn fn = impl;
+	lane_t lane[SHA256_MB_MAX_LANES];
+
+	assert(fn);
+
+	while (nr) {
+		unsigned int n = nr > lanes ? lanes : nr;
+
+		for (unsigned int l = 0; l < n; ++l)
+			init_lane(lane + l, data[l], size[l]);
+
+		fn(lane, n, digest);
+
+		data += n;
+		size += n;
+		digest += n;
+		nr -= n;
+	}
+}
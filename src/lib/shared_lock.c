@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2017, Wind River Systems, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1) Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2) Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3) Neither the name of Wind River Systems nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Author:
+ *        Lans Zhang <jia.zhang@windriver.com>
+ */
+
+#include "shared_lock.h"
+
+int
+shared_lock_init(pthread_mutex_t *lock, pthread_cond_t *cond)
+{
+	pthread_mutexattr_t mutex_attr;
+	pthread_condattr_t cond_attr;
+	int rc = EXIT_FAILURE;
+
+	if (pthread_mutexattr_init(&mutex_attr))
+		return rc;
+
+	if (pthread_condattr_init(&cond_attr))
+		goto err_on_cond_attr;
+
+	if (pthread_mutexattr_setpshared(&mutex_attr,
+					 PTHREAD_PROCESS_SHARED) ||
+	    pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST) ||
+	    pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED))
+		goto err_on_attr;
+
+	if (pthread_mutex_init(lock, &mutex_attr))
+		goto err_on_attr;
+
+	if (pthread_cond_init(cond, &cond_attr)) {
+		pthread_mutex_destroy(lock);
+		goto err_on_attr;
+	}
+
+	rc = EXIT_SUCCESS;
+
+err_on_attr:
+	pthread_condattr_destroy(&cond_attr);
+
+err_on_cond_attr:
+	pthread_mutexattr_destroy(&mutex_attr);
+
+	return rc;
+}
+
+void
+shared_lock(pthread_mutex_t *lock)
+{
+	if (pthread_mutex_lock(lock) == EOWNERDEAD)
+		pthread_mutex_consistent(lock);
+}
+
+void
+shared_cond_wait(pthread_cond_t *cond, pthread_mutex_t *lock)
+{
+	if (pthread_cond_wait(cond, lock) == EOWNERDEAD)
+		pthread_mutex_consistent(lock);
+}
@@ -33,55 +33,72 @@
 
 #include <signlet.h>
 #include <signaturelet.h>
-#include "bcll.h"
 
 #ifndef SIGNATURELET_DIR
 #  define SIGNATURELET_DIR	"/usr/lib/libsign/signaturelet"
 #endif
 
-#define MAX_NR_SIGNATURELETS	16
+/* Must be a power of 2 */
+#define SIGNATURELET_HASH_SIZE	64
 
-typedef struct {
+typedef struct __signaturelet	signaturelet_t;
+
+typedef struct __signaturelet {
 	libsign_signaturelet_t *sig;
-	bcll_t link;
+	signaturelet_t *next;
+	uint32_t hash;
 	void *handle;
 } signaturelet_t;
 
-static BCLL_DECLARE(signaturelet_list);
-static unsigned int nr_handles;
-static void *handles[MAX_NR_SIGNATURELETS];
+/*
+ * The registry is read-mostly. The lookup from the worker threads walks
+ * the hash chain without any lock, and the writers serialize on
+ * signaturelet_lock and publish the new entry with a release store
+ * after it is fully initialized. An unregistered entry is unlinked but
+ * never freed, so a reader racing with the removal still sees a valid
+ * entry and chain.
+ */
+static signaturelet_t *signaturelet_hash[SIGNATURELET_HASH_SIZE];
+static pthread_mutex_t signaturelet_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Serialize the on-demand loading of the same signaturelet */
+static pthread_mutex_t signaturelet_load_lock = PTHREAD_MUTEX_INITIALIZER;
 
-static void
-add_siglet_handle(void *handle)
+static uint32_t
+hash_id(const char *id)
 {
-	if (nr_handles >= MAX_NR_SIGNATURELETS) {
-		err("Unable to add the new handle for signaturelet\n");
-		return;
+	/* FNV-1a */
+	uint32_t hash = 2166136261U;
+
+	while (*id) {
+		hash ^= (uint8_t)*id++;
+		hash *= 16777619U;
 	}
 
-	handles[nr_handles++] = handle;
+	return hash;
 }
 
 static signaturelet_t *
 find_signaturelet(const char *id)
 {
+	uint32_t hash = hash_id(id);
 	signaturelet_t *siglet;
 
-	bcll_for_each_link(siglet, &signaturelet_list, link) {
-		if (!strcmp(siglet->sig->id, id))
+	siglet = __atomic_load_n(&signaturelet_hash[hash &
+			(SIGNATURELET_HASH_SIZE - 1)], __ATOMIC_ACQUIRE);
+	while (siglet) {
+		if (siglet->hash == hash && !strcmp(siglet->sig->id, id))
 			return siglet;
+
+		siglet = __atomic_load_n(&siglet->next, __ATOMIC_ACQUIRE);
 	}
 
 	return NULL;
 }
 
-int
-signaturelet_load(const char *id)
+static int
+load_signaturelet(const char *id)
 {
-	signaturelet_t *siglet = find_signaturelet(id);
-	if (siglet)
-		return EXIT_SUCCESS;
-
 	char path[PATH_MAX];
 	int path_len = snprintf(path, sizeof(path) - 1, SIGNATURELET_DIR
 				"/%s.siglet", id);
@@ -128,13 +145,43 @@ signaturelet_load(const char *id)
 			return EXIT_FAILURE;
 	}
 
-	add_siglet_handle(handle);
+	/* The constructor of siglet registers itself during dlopen() */
+	signaturelet_t *siglet = find_signaturelet(id);
+	if (!siglet) {
+		err("signaturelet %s is loaded but not registered\n", id);
+		dlclose(handle);
+		return EXIT_FAILURE;
+	}
+
+	/* The siglet stays loaded until the process exits */
+	pthread_mutex_lock(&signaturelet_lock);
+	if (!siglet->handle)
+		siglet->handle = handle;
+	pthread_mutex_unlock(&signaturelet_lock);
 
 	dbg("signaturelet %s loaded\n", id);
 
 	return EXIT_SUCCESS;
 }
 
+int
+signaturelet_load(const char *id)
+{
+	if (find_signaturelet(id))
+		return EXIT_SUCCESS;
+
+	pthread_mutex_lock(&signaturelet_load_lock);
+
+	int rc = EXIT_SUCCESS;
+
+	if (!find_signaturelet(id))
+		rc = load_signaturelet(id);
+
+	pthread_mutex_unlock(&signaturelet_load_lock);
+
+	return rc;
+}
+
 int
 signaturelet_suffix_pattern(const char *id, unsigned long flags,
 			    const char **suffix_pattern)
@@ -267,23 +314,32 @@ signaturelet_register(libsign_signaturelet_t *sig)
 	if (rc)
 		return rc;	
 
-	dbg("Post-loading signaturelet %s ...\n", sig->id);
-
-	void *handle = dlopen(NULL, RTLD_LAZY);
-	if (!handle)
-		return EXIT_FAILURE;
-
 	signaturelet_t *siglet = malloc(sizeof(*sig) + sizeof(*siglet));
-	if (!siglet) {
-		dlclose(handle);
+	if (!siglet)
 		return EXIT_FAILURE;
-	}
 
 	siglet->sig = (libsign_signaturelet_t *)(siglet + 1);
 	*(siglet->sig) = *sig;
-	bcll_add_tail(&signaturelet_list, &siglet->link);
+	siglet->hash = hash_id(sig->id);
+	siglet->handle = NULL;
 	libsign_digest_init(sig->digest_alg);
-	siglet->handle = handle;
+
+	signaturelet_t **head = &signaturelet_hash[siglet->hash &
+			(SIGNATURELET_HASH_SIZE - 1)];
+
+	pthread_mutex_lock(&signaturelet_lock);
+
+	if (find_signaturelet(sig->id)) {
+		pthread_mutex_unlock(&signaturelet_lock);
+		err("signaturelet %s is already registered\n", sig->id);
+		free(siglet);
+		return EXIT_FAILURE;
+	}
+
+	siglet->next = *head;
+	__atomic_store_n(head, siglet, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&signaturelet_lock);
 
 	info("signaturelet %s registered\n", sig->id);
 
@@ -295,24 +351,42 @@ signaturelet_unregister(const char *id)
 {
 	dbg("Unregistering signaturelet %s ...\n", id);
 
-	signaturelet_t *siglet = find_signaturelet(id);
+	signaturelet_t **prev = &signaturelet_hash[hash_id(id) &
+			(SIGNATURELET_HASH_SIZE - 1)];
+	signaturelet_t *siglet;
+
+	pthread_mutex_lock(&signaturelet_lock);
+
+	for (siglet = *prev; siglet; prev = &siglet->next,
+	     siglet = siglet->next) {
+		if (!strcmp(siglet->sig->id, id))
+			break;
+	}
+
 	if (!siglet) {
+		pthread_mutex_unlock(&signaturelet_lock);
 		err("Unregistering a not existing signaturelet %s\n",
 		    id);
 		return EXIT_FAILURE;
 	}
 
-	bcll_del(&siglet->link);
-	dlclose(siglet->handle);
+	/*
+	 * Keep siglet->next intact for the readers walking through this
+	 * entry. The entry and the handle are intentionally leaked because
+	 * the unregistration happens in the destructor of siglet.
+	 */
+	__atomic_store_n(prev, siglet->next, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&signaturelet_lock);
 
 	return EXIT_SUCCESS;
 }
 
 int
-signaturelet_sign(const char *id, uint8_t *data, unsigned int data_size,
-		  const char *key, const char **cert_list,
+signaturelet_sign(const char *id, uint8_t *data, size_t data_size,
+		  EVP_PKEY *key, X509 **cert_list,
 		  unsigned int nr_cert, uint8_t **out_sig,
-		  unsigned int *out_sig_size, unsigned long flags)
+		  size_t *out_sig_size, unsigned long flags)
 {
 	if (!id || !out_sig || !out_sig_size || !key || !cert_list)
 		return EXIT_FAILURE;
@@ -320,9 +394,6 @@ signaturelet_sign(const char *id, uint8_t *data, unsigned int data_size,
 	if (data_size && !data)
 		return EXIT_FAILURE;
 
-	if (nr_cert && !cert_list)
-		return EXIT_FAILURE;
-
 	signaturelet_t *siglet = find_signaturelet(id);
 	if (!siglet) {
 		err("Failed to search the signaturelet %s\n",
@@ -333,3 +404,71 @@ signaturelet_sign(const char *id, uint8_t *data, unsigned int data_size,
 	return siglet->sig->sign(siglet->sig, data, data_size, key, cert_list,
 				 nr_cert, out_sig, out_sig_size, flags);
 }
+
+bool
+signaturelet_cipher_supported(const char *id, LIBSIGN_CIPHER_ALG cipher_alg)
+{
+	if (!id || cipher_alg == LIBSIGN_CIPHER_ALG_NONE)
+		return false;
+
+	signaturelet_t *siglet = find_signaturelet(id);
+	if (!siglet)
+		return false;
+
+	if (siglet->sig->cipher_alg == cipher_alg)
+		return true;
+
+	const LIBSIGN_CIPHER_ALG *alg = siglet->sig->extra_cipher_algs;
+
+	for (; alg && *alg != LIBSIGN_CIPHER_ALG_NONE; ++alg) {
+		if (*alg == cipher_alg)
+			return true;
+	}
+
+	return false;
+}
+
+bool
+signaturelet_digest_only(const char *id, unsigned long flags,
+			 LIBSIGN_DIGEST_ALG *digest_alg)
+{
+	if (!id)
+		return false;
+
+	if (flags & (SIGNLET_FLAGS_CONTENT_ATTACHED |
+		     SIGNLET_FLAGS_DETACHED_SIGNATURE))
+		return false;
+
+	signaturelet_t *siglet = find_signaturelet(id);
+	if (!siglet || !siglet->sig->sign_digest)
+		return false;
+
+	if (digest_alg)
+		*digest_alg = siglet->sig->digest_alg;
+
+	return true;
+}
+
+int
+signaturelet_sign_digest(const char *id, uint8_t *digest,
+			 unsigned int digest_size, EVP_PKEY *key,
+			 X509 **cert_list, unsigned int nr_cert,
+			 uint8_t **out_sig, size_t *out_sig_size,
+			 unsigned long flags)
+{
+	if (!id || !digest || !digest_size || !out_sig || !out_sig_size ||
+	    !key || !cert_list)
+		return EXIT_FAILURE;
+
+	if (!signaturelet_digest_only(id, flags, NULL)) {
+		err("signaturelet %s doesn't support to sign the digest\n",
+		    id);
+		return EXIT_FAILURE;
+	}
+
+	signaturelet_t *siglet = find_signaturelet(id);
+
+	return siglet->sig->sign_digest(siglet->sig, digest, digest_size, key,
+					cert_list, nr_cert, out_sig,
+					out_sig_size, flags);
+}
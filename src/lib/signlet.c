@@ -33,18 +33,208 @@
 
 #include <signlet.h>
 #include <signaturelet.h>
+#include "prefetch.h"
+#include "bcll.h"
+#include "spsc_queue.h"
+#include "jobserver.h"
+#include "budget.h"
+#include "shared_lock.h"
+#include "placement.h"
+#include "journal.h"
+
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <signal.h>
+#include <poll.h>
+
+/* The files up to this size are hashed in a batch */
+#define SIGNLET_BATCH_MAX_SIZE			(64 * 1024)
+
+/* The number of files queued between two stages of the pipeline */
+#define SIGNLET_PIPELINE_DEPTH			8
+/* The files up to this size are read into memory by the reader stage */
+#define SIGNLET_PIPELINE_LOAD_MAX_SIZE		(1024 * 1024)
+
+/* The number of file ranges queued for the worker processes */
+#define SIGNLET_PREFORK_RING_SIZE		16
+/* The maximum number of files handed out to a worker process at once */
+#define SIGNLET_PREFORK_RANGE_MAX		16
+/* How often the parent checks the cancellation while waiting, in ms */
+#define SIGNLET_PREFORK_POLL_INTERVAL		100
+
+/* How often a worker waiting for a jobserver token checks the job, in ms */
+#define SIGNLET_JOBSERVER_POLL_INTERVAL		100
 
 typedef struct {
 	const char *siglet;
 	const char **signed_file_list;
 	unsigned int nr_signed_file;
 	const char **output_file_list;
+	/* The files are streamed from the callback if set */
+	signlet_next_file_t next_file;
+	void *next_file_data;
 	const char *key;
-	const char *cert_list[SIGNLET_MAX_NR_CERT];
+	/*
+	 * The references from the keystore, parsed before the worker
+	 * processes are forked so that they are shared copy-on-write.
+	 */
+	EVP_PKEY *pkey;
+	X509 *cert_list[SIGNLET_MAX_NR_CERT];
 	unsigned int nr_cert;
 	unsigned long flags;
+	LIBSIGN_DURABILITY durability;
+	unsigned int jobs;
+	unsigned int processes;
+	LIBSIGN_PLACEMENT placement;
+	uint64_t memory_limit;
+	const char *journal;
+	/* The file data in memory of the running job is charged to it */
+	budget_t *budget;
+	/* The cipher algorithm of the signing key */
+	LIBSIGN_CIPHER_ALG cipher_alg;
+	bool digest_only;
+	LIBSIGN_DIGEST_ALG digest_alg;
+	unsigned int digest_size;
+	/* The signing digest in digest-only mode followed by the extra ones */
+	LIBSIGN_DIGEST_ALG digest_algs[LIBSIGN_DIGEST_ALG_MAX];
+	unsigned int nr_extra_digest;
 } signlet_context;
 
+typedef struct {
+	uint8_t *sig;
+	size_t sig_len;
+	uint8_t *extra_digests[LIBSIGN_DIGEST_ALG_MAX - 1];
+} signlet_sig_t;
+
+/* A file dispatched to the workers */
+typedef struct {
+	/* The position of the file in the request */
+	unsigned int index;
+	char *path;
+	char *output_path;
+	/* Recorded to the journal once signed */
+	journal_id_t id;
+} signlet_file_t;
+
+typedef struct {
+	budget_t *budget;
+	unsigned int nr;
+	signlet_file_t files[LIBSIGN_DIGEST_BATCH_MAX];
+	libsign_file_map_t map[LIBSIGN_DIGEST_BATCH_MAX];
+	/* The bytes charged for the files in the batch */
+	uint64_t charged;
+} signlet_batch_t;
+
+typedef enum {
+	SIGNLET_JOB_QUEUED,
+	SIGNLET_JOB_RUNNING,
+	SIGNLET_JOB_DONE,
+} SIGNLET_JOB_STATE;
+
+typedef struct {
+	/* Linked in the job list until the job is finished */
+	bcll_t link;
+	/* Linked in the run queue, and then in the completion queue */
+	bcll_t queue;
+	bool queued;
+	char id[32];
+	signlet_context context;
+	SIGNLET_JOB_STATE state;
+	bool cancelled;
+	int rc;
+	SIGNLET_FILE_STATUS *status;
+	signlet_progress_t progress;
+	void *progress_data;
+	/* The peak bytes of file data in memory */
+	uint64_t memory_peak;
+} signlet_job_t;
+
+/* A share of the files assigned to the workers placed on a node */
+typedef struct {
+	/* Serialize the dispatch of files from the prefetcher */
+	pthread_mutex_t lock;
+	prefetcher_t prefetcher;
+	/* The index of the first file of the lane */
+	unsigned int first;
+	/* The share of the signed file list, unless the files are streamed */
+	const char **signed_file_list;
+	const char **output_file_list;
+	unsigned int nr_file;
+	unsigned int next;
+} signlet_lane_t;
+
+/* The state shared by the workers signing the files of a request */
+typedef struct {
+	signlet_job_t *job;
+	signlet_context *context;
+	/* Appended to the signed file without the output path, or NULL */
+	const char *output_suffix;
+	libsign_writer_t *writer;
+	/* NULL if the job is not journaled */
+	journal_t *journal;
+	const placement_t *placement;
+	/* One lane per node if the workers are placed, otherwise one */
+	unsigned int nr_lane;
+	signlet_lane_t *lanes;
+	/* NULL if not running under the jobserver */
+	jobserver_t *jobserver;
+	/* Set once any file fails so that no more files are dispatched */
+	bool failed;
+} signlet_pool_t;
+
+/*
+ * Held for writing while the worker processes are forked, so that no
+ * other thread of libsign is inside OpenSSL or the dynamic loader,
+ * holding a lock never released in the workers.
+ */
+static pthread_rwlock_t fork_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static void
+free_list(const char **list, unsigned int nr)
+{
+	if (!list)
+		return;
+
+	for (unsigned int i = 0; i < nr; ++i)
+		free((void *)list[i]);
+
+	free(list);
+}
+
+static const char **
+dup_list(const char **list, unsigned int nr)
+{
+	const char **dup = calloc(nr + 1, sizeof(char *));
+	if (!dup)
+		return NULL;
+
+	for (unsigned int i = 0; i < nr; ++i) {
+		dup[i] = strdup(list[i]);
+		if (!dup[i]) {
+			free_list(dup, i);
+			return NULL;
+		}
+	}
+
+	return dup;
+}
+
+static void
+release_request(signlet_context *context)
+{
+	free((void *)context->siglet);
+	free((void *)context->key);
+	free((void *)context->journal);
+	free_list(context->signed_file_list, context->nr_signed_file);
+	free_list(context->output_file_list, context->nr_signed_file);
+
+	libsign_key_unload(context->pkey);
+	for (unsigned int i = 0; i < context->nr_cert; ++i)
+		libsign_x509_unload(context->cert_list[i]);
+
+	memset(context, 0, sizeof(*context));
+}
+
 static int
 parse_request(signlet_request_t *request, signlet_context *context)
 {
@@ -64,7 +254,12 @@ parse_request(signlet_request_t *request, signlet_context *context)
 		return EXIT_FAILURE;
 	}
 
-	if (!request->signed_file_list) {
+	if (request->next_file) {
+		if (request->signed_file_list || request->output_file_list) {
+			err("The signed files are both listed and streamed\n");
+			return EXIT_FAILURE;
+		}
+	} else if (!request->signed_file_list) {
 		err("The signed file list is not specified\n");
 		return EXIT_FAILURE;
 	} else if (!request->signed_file_list[0]) {
@@ -77,28 +272,52 @@ parse_request(signlet_request_t *request, signlet_context *context)
 		return EXIT_FAILURE;
 	}
 
-	EVP_PKEY *key = libsign_key_load(request->key);
-	if (!key) {
-		err("Faild to load the signing key\n");
+	size_t key_len = strlen(request->key);
+
+	/* The query of a PKCS#11 URI, e.g. the PIN, is kept out of the log */
+	if (!strncmp(request->key, "pkcs11:", strlen("pkcs11:")))
+		key_len = strcspn(request->key, "?");
+
+	context->key = strndup(request->key, key_len);
+	if (!context->key)
 		return EXIT_FAILURE;
-	} else
-		libsign_key_unload(key);
+
+	context->pkey = libsign_key_load(request->key);
+	if (!context->pkey) {
+		err("Faild to load the signing key\n");
+		goto err;
+	}
+
+	context->cipher_alg = libsign_key_cipher_alg(context->pkey);
+	if (context->cipher_alg == LIBSIGN_CIPHER_ALG_NONE) {
+		err("The type of the signing key %s is not supported\n",
+		    context->key);
+		goto err;
+	}
+
+	if (request->cipher_alg != LIBSIGN_CIPHER_ALG_NONE &&
+	    request->cipher_alg != context->cipher_alg) {
+		err("The signing key %s is %s rather than %s\n", context->key,
+		    libsign_cipher_name(context->cipher_alg),
+		    libsign_cipher_name(request->cipher_alg) ?: "unknown");
+		goto err;
+	}
 
 	const char *file;
 	const char **list = request->signed_file_list;
 
-	for (file = *list; file; file = *(++list)) {
+	/* The streamed files are only checked once they are opened */
+	for (file = list ? *list : NULL; file; file = *(++list)) {
 		/* XXX: allow to ignore nonexistent signed file */
 		if (!libsign_utils_file_exists(file)) {
 			err("The signed file %s doesn't exist\n",
 			    file);
-			return EXIT_FAILURE;
+			goto err;
 		}
 
-		if (++context->nr_signed_file >= SIGNLET_MAX_NR_REQUEST) {
-			warn("The numer of igned files truncated to %d\n",
-			     SIGNLET_MAX_NR_REQUEST);
-			break;	
+		if (++context->nr_signed_file == UINT_MAX) {
+			err("Too many signed files specified\n");
+			goto err;
 		}
 	}
 
@@ -109,8 +328,8 @@ parse_request(signlet_request_t *request, signlet_context *context)
 		for (file = *list; i < context->nr_signed_file; file = *(++list)) {
 			if (!file) {
 				err("The output file for %s is not specified\n",
-				    context->signed_file_list[i]);
-				return EXIT_FAILURE;
+				    request->signed_file_list[i]);
+				goto err;
 			}
 
 			++i;
@@ -122,219 +341,2359 @@ parse_request(signlet_request_t *request, signlet_context *context)
 		file = *list;
 
 		do {
+			if (context->nr_cert == SIGNLET_MAX_NR_CERT) {
+				err("Too many certificates specified\n");
+				goto err;
+			}
+
+			unsigned int nr_cert;
+
 			/* XXX: allow to ignore nonexistent certificate */
-			X509 *cert = libsign_x509_load(file);
-			if (cert)
-				libsign_x509_unload(cert);
-			else {
+			if (libsign_x509_load_bundle(file, context->cert_list +
+						     context->nr_cert,
+						     SIGNLET_MAX_NR_CERT -
+						     context->nr_cert,
+						     &nr_cert)) {
 				err("Failed to load the certificate %s\n",
 				    file);
-				return EXIT_FAILURE;
+				goto err;
 			}
 
-			context->cert_list[context->nr_cert++] = file;
+			context->nr_cert += nr_cert;
 			file = *(++list);
 		} while (file);
 	} else
 		dbg("The certificate list is not specified\n");
 
-	context->signed_file_list = request->signed_file_list;
-	context->output_file_list = request->output_file_list;
-	context->siglet = request->siglet;
-	context->key = request->key;
+	const LIBSIGN_DIGEST_ALG *alg = request->extra_digest_algs;
+
+	for (; alg && *alg != LIBSIGN_DIGEST_ALG_NONE; ++alg) {
+		if (!libsign_digest_name(*alg)) {
+			err("Unsupported extra digest algorithm %#x\n", *alg);
+			goto err;
+		}
+
+		for (unsigned int i = 1; i <= context->nr_extra_digest; ++i) {
+			if (context->digest_algs[i] == *alg) {
+				err("Duplicated extra digest algorithm %s\n",
+				    libsign_digest_name(*alg));
+				goto err;
+			}
+		}
+
+		context->digest_algs[++context->nr_extra_digest] = *alg;
+	}
+
 	context->flags = request->flags;
+	context->durability = request->durability;
+	context->jobs = request->jobs;
+	context->processes = request->processes;
+	context->next_file = request->next_file;
+	context->next_file_data = request->next_file_data;
+
+	/*
+	 * The worker processes look up the files they are handed out in
+	 * the inherited list, so the streamed files are signed by the
+	 * threads instead.
+	 */
+	if (context->next_file && context->processes > 1) {
+		context->jobs = context->processes;
+		context->processes = 0;
+	}
+
+	context->placement = request->placement;
+	if (context->placement < LIBSIGN_PLACEMENT_NONE ||
+	    context->placement > LIBSIGN_PLACEMENT_NUMA) {
+		err("Invalid placement policy %d\n", context->placement);
+		goto err;
+	}
+	context->memory_limit = request->memory_limit;
+
+	/*
+	 * The request is served in the background, so keep a copy of
+	 * everything it refers to.
+	 */
+	context->siglet = strdup(request->siglet);
+	if (request->journal)
+		context->journal = strdup(request->journal);
+	if (request->signed_file_list)
+		context->signed_file_list =
+			dup_list(request->signed_file_list,
+				 context->nr_signed_file);
+	if (request->output_file_list)
+		context->output_file_list =
+			dup_list(request->output_file_list,
+				 context->nr_signed_file);
+
+	bool dup_failed = !context->siglet || !context->key ||
+			  (request->journal && !context->journal) ||
+			  (request->signed_file_list &&
+			   !context->signed_file_list) ||
+			  (request->output_file_list &&
+			   !context->output_file_list);
+
+	if (dup_failed)
+		goto err;
 
 	return EXIT_SUCCESS;
+
+err:
+	release_request(context);
+
+	return EXIT_FAILURE;
 }
 
 static void
-release_request(signlet_context *context)
+release_sig(signlet_context *context, signlet_sig_t *sig)
 {
+	free(sig->sig);
+
+	for (unsigned int i = 0; i < context->nr_extra_digest; ++i)
+		free(sig->extra_digests[i]);
+
+	memset(sig, 0, sizeof(*sig));
 }
 
+/*
+ * Calculate the digests of the content already in memory, chunk by chunk
+ * so that each chunk is hashed by all digests while still in cache.
+ */
 static int
-sign_file(signlet_context *context, const char *path,
-	  uint8_t **out_sig, unsigned int *out_sig_size)
+calculate_digests(const LIBSIGN_DIGEST_ALG *digest_algs,
+		  unsigned int nr_digest_alg, const uint8_t *data,
+		  size_t data_size, uint8_t **digests)
 {
-	uint8_t *data;
-	unsigned data_size;
+	libsign_digest_multi_ctx_t ctx;
 	int rc;
 
-	rc = libsign_utils_load_file(path, &data, &data_size);
+	rc = libsign_digest_multi_init(&ctx, digest_algs, nr_digest_alg);
 	if (rc)
 		return rc;
 
-	rc = signaturelet_sign(context->siglet, data, data_size,
-			       context->key, context->cert_list,
-			       context->nr_cert, out_sig, out_sig_size,
-			       context->flags);
-	free(data);
+	while (data_size) {
+		size_t len = data_size;
 
-	if (rc)
-		err("%s: failed to sign the file %s\n",
-		    context->siglet, path);
-	else
-		dbg("%s: succeeded to sign the file %s\n",
-		    context->siglet, path);
+		if (len > LIBSIGN_DIGEST_CHUNK_SIZE)
+			len = LIBSIGN_DIGEST_CHUNK_SIZE;
 
-	return rc;
+		rc = libsign_digest_multi_update(&ctx, data, len);
+		if (rc) {
+			libsign_digest_multi_release(&ctx);
+			return rc;
+		}
+
+		data += len;
+		data_size -= len;
+	}
+
+	return libsign_digest_multi_final(&ctx, digests);
 }
 
-static const char **
-build_output_file_list(signlet_context *context)
+static int
+sign_file(signlet_context *context, int fd, signlet_sig_t *sig)
 {
-	const char *pattern;
 	int rc;
 
-	rc = signaturelet_suffix_pattern(context->siglet, context->flags,
-					 &pattern);
-	if (rc)
-		return NULL;
+	if (context->digest_only) {
+		uint8_t *digests[LIBSIGN_DIGEST_ALG_MAX];
 
-	const char **output_path_list = malloc((context->nr_signed_file + 1) *
-					       sizeof(char *));
-	if (!output_path_list)
-		return NULL;
+		/* Read the file once for the signing and extra digests */
+		if (context->nr_extra_digest) {
+			rc = libsign_digest_multi_fd(context->digest_algs,
+						     context->nr_extra_digest + 1,
+						     fd, digests);
+			if (!rc)
+				memcpy(sig->extra_digests, digests + 1,
+				       context->nr_extra_digest *
+				       sizeof(*digests));
+		} else
+			rc = libsign_digest_fd(context->digest_alg, fd,
+					       digests);
+		if (rc)
+			return rc;
 
-	char op = *pattern++;
-	const char *suffix = pattern;
-	int suffix_size = strlen(suffix);
-	unsigned int i;
+		rc = signaturelet_sign_digest(context->siglet, digests[0],
+					      context->digest_size,
+					      context->pkey,
+					      context->cert_list,
+					      context->nr_cert, &sig->sig,
+					      &sig->sig_len, context->flags);
+		free(digests[0]);
 
-	for (i = 0; i < context->nr_signed_file; ++i) {
-		const char *path = context->signed_file_list[i];
-		char *output_path = NULL;
-		int output_path_size = 0;
+		return rc;
+	}
+
+	/* The whole content is passed to the siglet */
+	struct stat st;
+
+	if (fstat(fd, &st))
+		return EXIT_FAILURE;
+
+	uint64_t charged = budget_acquire(context->budget, st.st_size);
+	libsign_file_map_t map;
+
+	rc = libsign_utils_map_fd(fd, &map);
+	if (rc) {
+		budget_release(context->budget, charged);
+		return rc;
+	}
+
+	if (context->nr_extra_digest)
+		rc = calculate_digests(context->digest_algs + 1,
+				       context->nr_extra_digest, map.data,
+				       map.size, sig->extra_digests);
+
+	if (!rc)
+		rc = signaturelet_sign(context->siglet, map.data, map.size,
+				       context->pkey, context->cert_list,
+				       context->nr_cert, &sig->sig,
+				       &sig->sig_len, context->flags);
+	libsign_utils_unmap_file(&map);
+	budget_release(context->budget, charged);
+
+	return rc;
+}
+
+/*
+ * Save the extra digests of a signed file to <signed_file>.<alg>, with
+ * the same content as printed by sha*sum(1) for the file.
+ */
+static int
+save_extra_digests(signlet_context *context, libsign_writer_t *writer,
+		   const char *path, signlet_sig_t *sig)
+{
+	const char *base = strrchr(path, '/');
+
+	base = base ? base + 1 : path;
+
+	for (unsigned int i = 0; i < context->nr_extra_digest; ++i) {
+		LIBSIGN_DIGEST_ALG alg = context->digest_algs[i + 1];
+		const char *name = libsign_digest_name(alg);
+		unsigned int digest_size;
+
+		libsign_digest_size(alg, &digest_size);
 
-		if (context->output_file_list)
-			output_path = strdup(context->output_file_list[i]);
-		else if (op == '+') {
-			output_path_size = strlen(path) + suffix_size;
-			output_path = malloc(output_path_size + 1);
+		char *line;
+		int line_size;
+
+		line_size = asprintf(&line, "%*s  %s\n", digest_size * 2, "",
+				     base);
+		if (line_size < 0)
+			return EXIT_FAILURE;
+
+		for (unsigned int j = 0; j < digest_size; ++j) {
+			static const char hex[] = "0123456789abcdef";
+
+			line[j * 2] = hex[sig->extra_digests[i][j] >> 4];
+			line[j * 2 + 1] = hex[sig->extra_digests[i][j] & 0xf];
 		}
 
-		if (!output_path)
-			break;
+		char *digest_path;
 
-		if (output_path_size) {
-			sprintf(output_path, "%s%s", path, pattern);
-			output_path[output_path_size] = '\0';
+		if (asprintf(&digest_path, "%s.%s", path, name) < 0) {
+			free(line);
+			return EXIT_FAILURE;
 		}
 
-		output_path_list[i] = output_path;
+		int rc = libsign_writer_save(writer, digest_path,
+					     (uint8_t *)line, line_size);
+		if (rc)
+			err("Failed to save the digest file %s\n",
+			    digest_path);
+
+		free(digest_path);
+		free(line);
+
+		if (rc)
+			return rc;
 	}
 
-	if (i != context->nr_signed_file) {
-		while ((int)--i >= 0)
-			free((void *)output_path_list[i]);
-		free(output_path_list);
-		return NULL;
+	return EXIT_SUCCESS;
+}
+
+static void
+release_file(signlet_file_t *file)
+{
+	free(file->path);
+	free(file->output_path);
+	file->path = file->output_path = NULL;
+}
+
+/*
+ * Take over the paths of the prefetched file. Without the output path
+ * given, it is derived from the signed file.
+ */
+static int
+dispatch_file(signlet_pool_t *pool, prefetch_entry_t *entry,
+	      unsigned int first, signlet_file_t *file)
+{
+	file->index = first + entry->index;
+	file->path = entry->path;
+	file->output_path = entry->output;
+
+	if (file->output_path)
+		return EXIT_SUCCESS;
+
+	if (!pool->output_suffix) {
+		err("The output file for %s is not specified\n", file->path);
+		return EXIT_FAILURE;
 	}
 
-	output_path_list[i] = NULL; 
+	file->output_path = malloc(strlen(file->path) +
+				   strlen(pool->output_suffix) + 1);
+	if (!file->output_path)
+		return EXIT_FAILURE;
+
+	sprintf(file->output_path, "%s%s", file->path, pool->output_suffix);
 
-	return output_path_list;
+	return EXIT_SUCCESS;
 }
 
-static void
-free_output_file_list(const char **output_path_list)
+/* The file of the list handed out to a worker process */
+static int
+list_file(signlet_pool_t *pool, unsigned int index, signlet_file_t *file)
 {
-	const char **list = output_path_list;
+	signlet_context *context = pool->context;
+	prefetch_entry_t entry = {
+		.index = index,
+		.path = strdup(context->signed_file_list[index]),
+		.output = NULL,
+	};
 
-	for (const char *path = *list; path; path = *(++list))
-		free((void *)path);
+	if (context->output_file_list)
+		entry.output = strdup(context->output_file_list[index]);
 
-	free(output_path_list);
+	if (!entry.path ||
+	    (context->output_file_list && !entry.output)) {
+		free(entry.path);
+		free(entry.output);
+		memset(file, 0, sizeof(*file));
+		file->index = index;
+		return EXIT_FAILURE;
+	}
+
+	return dispatch_file(pool, &entry, 0, file);
 }
 
-int
-signlet_request(signlet_request_t *request)
+/*
+ * Save the signature and the extra digests of a signed file, and record
+ * the result of signing it.
+ */
+static int
+finish_file(signlet_pool_t *pool, signlet_file_t *file, signlet_sig_t *sig,
+	    int rc)
 {
-	signlet_context context;
-	int rc;
+	signlet_context *context = pool->context;
+	const char *path = file->path;
+
+	if (!rc) {
+		rc = libsign_writer_save(pool->writer, file->output_path,
+					 sig->sig, sig->sig_len);
+		if (rc)
+			err("Failed to save the signature file %s\n",
+			    file->output_path);
+	}
+
+	if (!rc)
+		rc = save_extra_digests(context, pool->writer, path, sig);
+
+	if (!rc && pool->journal)
+		rc = journal_add(pool->journal, path, file->output_path,
+				 &file->id, sig->sig, sig->sig_len);
+
+	release_sig(context, sig);
+
+	signlet_job_t *job = pool->job;
+	SIGNLET_FILE_STATUS status = rc ? SIGNLET_FILE_FAILED :
+					  SIGNLET_FILE_SIGNED;
+
+	/* The failures of the streamed files are reported right away */
+	if (job->status)
+		__atomic_store_n(job->status + file->index, status,
+				 __ATOMIC_RELEASE);
+	else if (rc)
+		err("Failed to sign %s with the key %s\n", path,
+		    context->key);
 
-	rc = parse_request(request, &context);
 	if (rc)
-		return rc;
+		__atomic_store_n(&pool->failed, true, __ATOMIC_RELAXED);
+	else
+		dbg("%s: succeeded to sign the file %s\n", context->siglet,
+		    path);
 
-	rc = signaturelet_load(request->siglet);
-	if (rc) {
-		release_request(&context);
-		return rc;
-	}
+	if (job->progress)
+		job->progress(job->id, file->index, path, status,
+			      job->progress_data);
 
-	struct __out_sig {
-		uint8_t *sig;
-		unsigned int sig_len;
-	} sigs[context.nr_signed_file], *sig = sigs;
+	release_file(file);
 
-	const char **list = context.signed_file_list;
-	const char *file;
-	unsigned int i = 0;
+	return rc;
+}
 
-	rc = EXIT_FAILURE;
+/*
+ * Identify the dispatched file for the journal, and return true if it
+ * has been signed by a previous job.
+ */
+static bool
+journaled_file(signlet_pool_t *pool, signlet_file_t *file, int fd)
+{
+	return pool->journal && !journal_identify(fd, &file->id) &&
+	       journal_done(pool->journal, file->path, file->output_path,
+			    &file->id);
+}
 
-	for (file = *list; i < context.nr_signed_file; file = *(++list)) {
-		rc = sign_file(&context, file, &sig->sig, &sig->sig_len);
-		if (rc) {
-			err("Failed to sign %s with the key %s\n",
-			    file, request->key);
-			goto err_on_sign_file; 
-		}
+static void
+skip_file(signlet_pool_t *pool, signlet_file_t *file)
+{
+	signlet_job_t *job = pool->job;
 
-		++sig;
-		++i;
+	if (job->status)
+		__atomic_store_n(job->status + file->index,
+				 SIGNLET_FILE_SKIPPED, __ATOMIC_RELEASE);
+
+	dbg("%s: the file %s is already signed\n", pool->context->siglet,
+	    file->path);
+
+	if (job->progress)
+		job->progress(job->id, file->index, file->path,
+			      SIGNLET_FILE_SKIPPED, job->progress_data);
+
+	release_file(file);
+}
+
+/*
+ * Report a dispatched file as cancelled because the job stops before it
+ * is signed.
+ */
+static void
+cancel_file(signlet_pool_t *pool, signlet_file_t *file)
+{
+	signlet_job_t *job = pool->job;
+
+	if (job->status)
+		__atomic_store_n(job->status + file->index,
+				 SIGNLET_FILE_CANCELLED, __ATOMIC_RELEASE);
+
+	if (job->progress)
+		job->progress(job->id, file->index, file->path,
+			      SIGNLET_FILE_CANCELLED, job->progress_data);
+
+	release_file(file);
+}
+
+static void
+release_batch(signlet_pool_t *pool, signlet_batch_t *batch)
+{
+	for (unsigned int i = 0; i < batch->nr; ++i) {
+		libsign_utils_unmap_file(batch->map + i);
+		/* Left if the batch is dropped or a file fails */
+		if (batch->files[i].path)
+			cancel_file(pool, batch->files + i);
 	}
 
-	const char **output_file_list;
-	output_file_list = build_output_file_list(&context);
-	if (!output_file_list)
-		goto err_on_build_output_file_list;
-
-	list = output_file_list;
-	sig = sigs;
-	i = 0;
-	for (file = *list; i < context.nr_signed_file; file = *(++list)) {
-		rc = libsign_utils_save_file(file, sig->sig, sig->sig_len);
-		if (rc) {
-			err("Failed to save the signature file %s\n",
-			    file);
-			goto err_on_save_file;
-		}
+	batch->nr = 0;
+
+	budget_release(batch->budget, batch->charged);
+	batch->charged = 0;
+}
+
+/*
+ * Hash a batch of small files at once, and then sign their digests.
+ */
+static int
+sign_batch(signlet_pool_t *pool, signlet_batch_t *batch)
+{
+	signlet_context *context = pool->context;
+	uint8_t *data[LIBSIGN_DIGEST_BATCH_MAX];
+	size_t data_size[LIBSIGN_DIGEST_BATCH_MAX];
+	uint8_t *digests[LIBSIGN_DIGEST_BATCH_MAX];
+	signlet_sig_t sig;
+	unsigned int i;
+	int rc;
 
-		++sig;
-		++i;
+	for (i = 0; i < batch->nr; ++i) {
+		data[i] = batch->map[i].data;
+		data_size[i] = batch->map[i].size;
 	}
 
-	rc = EXIT_SUCCESS;
+	memset(&sig, 0, sizeof(sig));
+
+	rc = libsign_digest_batch(context->digest_alg, data, data_size,
+				  batch->nr, digests);
+	if (rc) {
+		err("%s: failed to hash a batch of %d files\n",
+		    context->siglet, batch->nr);
+		for (i = 0; i < batch->nr; ++i)
+			finish_file(pool, batch->files + i, &sig, rc);
+		release_batch(pool, batch);
+		return rc;
+	}
 
-err_on_save_file:
-	free_output_file_list(output_file_list);
+	for (i = 0; i < batch->nr; ++i) {
+		rc = signaturelet_sign_digest(context->siglet, digests[i],
+					      context->digest_size,
+					      context->pkey,
+					      context->cert_list,
+					      context->nr_cert, &sig.sig,
+					      &sig.sig_len, context->flags);
+		rc = finish_file(pool, batch->files + i, &sig, rc);
+		if (rc)
+			break;
+	}
 
-err_on_build_output_file_list:
-err_on_sign_file:
-	while ((int)--context.nr_signed_file >= 0)
-		free(sigs[context.nr_signed_file].sig);
+	for (i = 0; i < batch->nr; ++i)
+		free(digests[i]);
 
-	release_request(&context);
+	/* The files after the failed one are cancelled */
+	release_batch(pool, batch);
 
 	return rc;
 }
 
-int
-signlet_wait(const char *id)
+static bool
+stop_dispatch(signlet_pool_t *pool)
 {
-	return 0;
+	return __atomic_load_n(&pool->failed, __ATOMIC_RELAXED) ||
+	       __atomic_load_n(&pool->job->cancelled, __ATOMIC_RELAXED);
 }
 
-int
-signlet_cancel(const char *id)
+/*
+ * Take the next file from the prefetcher of the lane. Return false if
+ * all files of the lane are dispatched.
+ */
+static bool
+take_file(signlet_lane_t *lane, prefetch_entry_t *entry)
 {
-	return 0;
+	pthread_mutex_lock(&lane->lock);
+	bool left = !prefetcher_next(&lane->prefetcher, entry);
+	pthread_mutex_unlock(&lane->lock);
+
+	return left;
 }
 
-int
-signlet_finish(const char *id)
+/*
+ * Sign the next file from the lanes starting at the given one, or add
+ * it to the batch if it is small. Return EXIT_FAILURE if no file is left
+ * or the file fails.
+ */
+static int
+sign_next_file(signlet_pool_t *pool, unsigned int lane,
+	       signlet_batch_t *batch)
 {
-	return 0;
+	signlet_context *context = pool->context;
+	prefetch_entry_t entry;
+	signlet_lane_t *from = NULL;
+	signlet_file_t file;
+	unsigned int i;
+
+	for (i = 0; i < pool->nr_lane; ++i) {
+		from = pool->lanes + (lane + i) % pool->nr_lane;
+		if (take_file(from, &entry))
+			break;
+	}
+
+	if (i == pool->nr_lane)
+		return EXIT_FAILURE;
+
+	int fd = entry.fd;
+	off_t size = entry.size;
+	int rc = dispatch_file(pool, &entry, from->first, &file);
+	signlet_sig_t sig;
+
+	memset(&sig, 0, sizeof(sig));
+
+	if (rc || fd < 0) {
+		if (fd >= 0)
+			close(fd);
+		return finish_file(pool, &file, &sig, EXIT_FAILURE);
+	}
+
+	if (journaled_file(pool, &file, fd)) {
+		close(fd);
+		skip_file(pool, &file);
+		return EXIT_SUCCESS;
+	}
+
+	uint64_t charged;
+
+	/* Stream the file instead if the budget is used up */
+	if (context->digest_only && !context->nr_extra_digest &&
+	    size > 0 && size <= SIGNLET_BATCH_MAX_SIZE &&
+	    budget_try_acquire(context->budget, size, &charged)) {
+		batch->charged += charged;
+
+		rc = libsign_utils_map_fd(fd, batch->map + batch->nr);
+		close(fd);
+		if (rc)
+			return finish_file(pool, &file, &sig, rc);
+
+		batch->files[batch->nr++] = file;
+		if (batch->nr == LIBSIGN_DIGEST_BATCH_MAX)
+			rc = sign_batch(pool, batch);
+
+		return rc;
+	}
+
+	rc = sign_file(context, fd, &sig);
+	close(fd);
+
+	return finish_file(pool, &file, &sig, rc);
+}
+
+static bool
+files_left(signlet_pool_t *pool)
+{
+	bool left = false;
+
+	for (unsigned int i = 0; i < pool->nr_lane && !left; ++i) {
+		signlet_lane_t *lane = pool->lanes + i;
+
+		pthread_mutex_lock(&lane->lock);
+		left = !prefetcher_done(&lane->prefetcher);
+		pthread_mutex_unlock(&lane->lock);
+	}
+
+	return left;
+}
+
+/*
+ * Wait for a token of the jobserver until it is acquired, or no file is
+ * left to be signed.
+ */
+static bool
+acquire_token(signlet_pool_t *pool, char *token)
+{
+	while (!stop_dispatch(pool) && files_left(pool)) {
+		if (!jobserver_acquire(pool->jobserver,
+				       SIGNLET_JOBSERVER_POLL_INTERVAL, token))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Take the files from the prefetchers in order and sign them until all
+ * files are dispatched, any file fails or the job is cancelled. Any
+ * number of workers may run on the same pool, each starting from the
+ * lane of its node. Under the jobserver, an extra worker holds a token
+ * while signing each file, so it only runs when the build has a free
+ * job slot.
+ */
+static void
+sign_files(signlet_pool_t *pool, unsigned int worker, bool extra)
+{
+	jobserver_t *jobserver = extra ? pool->jobserver : NULL;
+	unsigned int lane = placement_node(pool->placement,
+					   pool->context->placement,
+					   worker) % pool->nr_lane;
+	signlet_batch_t batch = {
+		.budget = pool->context->budget,
+		.nr = 0,
+		.charged = 0,
+	};
+
+	while (!stop_dispatch(pool)) {
+		char token;
+
+		if (jobserver && !acquire_token(pool, &token))
+			break;
+
+		int rc = sign_next_file(pool, lane, &batch);
+
+		if (jobserver)
+			jobserver_release(jobserver, token);
+
+		if (rc)
+			break;
+	}
+
+	if (batch.nr && !stop_dispatch(pool))
+		sign_batch(pool, &batch);
+
+	release_batch(pool, &batch);
+}
+
+typedef struct {
+	pthread_t thread;
+	signlet_pool_t *pool;
+	/* The position of the worker in the placement */
+	unsigned int index;
+} signlet_worker_t;
+
+static void *
+sign_worker(void *data)
+{
+	sign_files(data, 0, false);
+
+	return NULL;
+}
+
+/* Any worker besides the one running in the job slot of the process */
+static void *
+extra_sign_worker(void *data)
+{
+	signlet_worker_t *worker = data;
+	signlet_pool_t *pool = worker->pool;
+
+	/* Placed before allocating its buffers so that they are local */
+	placement_bind(pool->placement, pool->context->placement,
+		       worker->index);
+	sign_files(pool, worker->index, true);
+
+	return NULL;
+}
+
+/*
+ * Run the workers on the pool. The calling thread is one of them.
+ */
+static void
+run_workers(signlet_pool_t *pool)
+{
+	signlet_context *context = pool->context;
+	unsigned int nr_thread = context->jobs;
+
+	if (!context->next_file && nr_thread > context->nr_signed_file)
+		nr_thread = context->nr_signed_file;
+
+	signlet_worker_t *workers = NULL;
+	unsigned int nr_created = 0;
+
+	if (nr_thread > 1) {
+		workers = malloc((nr_thread - 1) * sizeof(*workers));
+		if (!workers)
+			warn("Failed to allocate the workers, signing the "
+			     "files in sequence\n");
+	}
+
+	while (workers && nr_created < nr_thread - 1) {
+		signlet_worker_t *worker = workers + nr_created;
+
+		worker->pool = pool;
+		worker->index = nr_created + 1;
+		if (pthread_create(&worker->thread, NULL, extra_sign_worker,
+				   worker)) {
+			warn("Only %d workers created\n", nr_created + 1);
+			break;
+		}
+
+		++nr_created;
+	}
+
+	/* The calling thread is placed as the worker 0 until it is done */
+	LIBSIGN_PLACEMENT policy = context->placement;
+	cpu_set_t affinity;
+	bool placed = policy != LIBSIGN_PLACEMENT_NONE &&
+		      !pthread_getaffinity_np(pthread_self(), sizeof(affinity),
+					      &affinity) &&
+		      !placement_bind(pool->placement, policy, 0);
+
+	sign_worker(pool);
+
+	if (placed)
+		pthread_setaffinity_np(pthread_self(), sizeof(affinity),
+				       &affinity);
+
+	while (nr_created)
+		pthread_join(workers[--nr_created].thread, NULL);
+
+	free(workers);
+}
+
+/*
+ * Without the concurrent workers, the files go through a pipeline of
+ * the reader, digest, sign and writer stages, each in its own thread
+ * and connected by the bounded queues. The reads of the following
+ * files overlap the signing of the current one, and the number of
+ * files in flight is bounded by the queue depth.
+ */
+typedef struct {
+	signlet_file_t file;
+	/* The file descriptor if the content is not loaded, or -1 */
+	int fd;
+	off_t size;
+	libsign_file_map_t map;
+	/* The bytes charged for the content in memory */
+	uint64_t charged;
+	/* The signing digest in digest-only mode */
+	uint8_t *digest;
+	signlet_sig_t sig;
+	int rc;
+} signlet_item_t;
+
+typedef struct {
+	signlet_pool_t *pool;
+	/* reader -> digest */
+	spsc_queue_t read_queue;
+	/* digest -> sign */
+	spsc_queue_t digest_queue;
+	/* sign -> writer */
+	spsc_queue_t sign_queue;
+} signlet_pipeline_t;
+
+/* Release everything but the signature */
+static void
+unload_item(signlet_context *context, signlet_item_t *item)
+{
+	libsign_utils_unmap_file(&item->map);
+	budget_release(context->budget, item->charged);
+	item->charged = 0;
+}
+
+static void
+release_item_content(signlet_context *context, signlet_item_t *item)
+{
+	if (item->fd >= 0) {
+		close(item->fd);
+		item->fd = -1;
+	}
+
+	unload_item(context, item);
+	free(item->digest);
+	item->digest = NULL;
+}
+
+/*
+ * The content is charged to the budget in the order of files, while it
+ * is held in memory by the following stages. Only the digest of the
+ * content is needed in digest-only mode, so the file is streamed there
+ * if the budget is used up.
+ */
+static int
+read_item(signlet_context *context, signlet_item_t *item, int fd)
+{
+	bool load = item->size > 0 &&
+		    item->size <= SIGNLET_PIPELINE_LOAD_MAX_SIZE;
+
+	if (context->digest_only) {
+		if (!load || !budget_try_acquire(context->budget, item->size,
+						 &item->charged)) {
+			item->fd = fd;
+			return EXIT_SUCCESS;
+		}
+	} else
+		item->charged = budget_acquire(context->budget, item->size);
+
+	if (!load) {
+		item->fd = fd;
+		return EXIT_SUCCESS;
+	}
+
+	int rc = libsign_utils_read_fd(fd, &item->map);
+	close(fd);
+
+	return rc;
+}
+
+static void *
+read_stage(void *data)
+{
+	signlet_pipeline_t *pipeline = data;
+	signlet_pool_t *pool = pipeline->pool;
+	/* The pipeline always has a single lane */
+	signlet_lane_t *lane = pool->lanes;
+
+	while (!stop_dispatch(pool)) {
+		signlet_item_t *item = calloc(1, sizeof(*item));
+		if (!item) {
+			err("Failed to allocate the pipeline item\n");
+			__atomic_store_n(&pool->failed, true,
+					 __ATOMIC_RELAXED);
+			break;
+		}
+
+		prefetch_entry_t entry;
+
+		if (!take_file(lane, &entry)) {
+			free(item);
+			break;
+		}
+
+		item->fd = -1;
+		item->size = entry.size;
+		item->rc = dispatch_file(pool, &entry, lane->first,
+					 &item->file);
+		if (entry.fd < 0)
+			item->rc = EXIT_FAILURE;
+		else if (item->rc)
+			close(entry.fd);
+		else if (journaled_file(pool, &item->file, entry.fd)) {
+			close(entry.fd);
+			skip_file(pool, &item->file);
+			free(item);
+			continue;
+		} else
+			item->rc = read_item(pool->context, item, entry.fd);
+
+		spsc_queue_push(&pipeline->read_queue, item);
+	}
+
+	/* Tell the following stage the end of files */
+	spsc_queue_push(&pipeline->read_queue, NULL);
+
+	return NULL;
+}
+
+static void
+digest_item(signlet_context *context, signlet_item_t *item)
+{
+	if (item->rc)
+		return;
+
+	if (!context->digest_only) {
+		if (!context->nr_extra_digest)
+			return;
+
+		if (!item->map.data) {
+			item->rc = libsign_utils_map_fd(item->fd, &item->map);
+			if (item->rc)
+				return;
+		}
+
+		item->rc = calculate_digests(context->digest_algs + 1,
+					     context->nr_extra_digest,
+					     item->map.data, item->map.size,
+					     item->sig.extra_digests);
+		return;
+	}
+
+	uint8_t *digests[LIBSIGN_DIGEST_ALG_MAX];
+	unsigned int nr_digest = context->nr_extra_digest + 1;
+
+	if (item->map.data)
+		item->rc = calculate_digests(context->digest_algs, nr_digest,
+					     item->map.data, item->map.size,
+					     digests);
+	else if (context->nr_extra_digest)
+		item->rc = libsign_digest_multi_fd(context->digest_algs,
+						   nr_digest, item->fd,
+						   digests);
+	else
+		item->rc = libsign_digest_fd(context->digest_alg, item->fd,
+					     digests);
+	if (item->rc)
+		return;
+
+	item->digest = digests[0];
+	memcpy(item->sig.extra_digests, digests + 1,
+	       context->nr_extra_digest * sizeof(*digests));
+
+	/* Only the digests are needed by the following stages */
+	unload_item(context, item);
+}
+
+static bool
+batchable_item(signlet_context *context, signlet_item_t *item)
+{
+	return !item->rc && context->digest_only &&
+	       !context->nr_extra_digest && item->map.data &&
+	       item->map.size <= SIGNLET_BATCH_MAX_SIZE;
+}
+
+static void
+digest_items(signlet_context *context, signlet_item_t **items,
+	     unsigned int nr)
+{
+	if (nr == 1) {
+		digest_item(context, items[0]);
+		return;
+	}
+
+	uint8_t *data[LIBSIGN_DIGEST_BATCH_MAX];
+	size_t data_size[LIBSIGN_DIGEST_BATCH_MAX];
+	uint8_t *digests[LIBSIGN_DIGEST_BATCH_MAX];
+	unsigned int i;
+
+	for (i = 0; i < nr; ++i) {
+		data[i] = items[i]->map.data;
+		data_size[i] = items[i]->map.size;
+	}
+
+	int rc = libsign_digest_batch(context->digest_alg, data, data_size,
+				      nr, digests);
+	if (rc)
+		err("%s: failed to hash a batch of %d files\n",
+		    context->siglet, nr);
+
+	for (i = 0; i < nr; ++i) {
+		items[i]->rc = rc;
+		if (!rc)
+			items[i]->digest = digests[i];
+		unload_item(context, items[i]);
+	}
+}
+
+/*
+ * Hash the small files available in the queue in a batch.
+ */
+static void *
+digest_stage(void *data)
+{
+	signlet_pipeline_t *pipeline = data;
+	signlet_context *context = pipeline->pool->context;
+	signlet_item_t *items[LIBSIGN_DIGEST_BATCH_MAX];
+	signlet_item_t *item = spsc_queue_pop(&pipeline->read_queue);
+
+	while (item) {
+		signlet_item_t *next = NULL;
+		bool popped = false;
+		unsigned int nr = 0;
+
+		items[nr++] = item;
+
+		while (batchable_item(context, item) &&
+		       nr < LIBSIGN_DIGEST_BATCH_MAX) {
+			void *p;
+
+			if (!spsc_queue_try_pop(&pipeline->read_queue, &p))
+				break;
+
+			next = p;
+			popped = true;
+			if (!next || !batchable_item(context, next))
+				break;
+
+			items[nr++] = next;
+			popped = false;
+		}
+
+		digest_items(context, items, nr);
+
+		for (unsigned int i = 0; i < nr; ++i)
+			spsc_queue_push(&pipeline->digest_queue, items[i]);
+
+		/* The item breaking the batch, or the end of files */
+		if (popped)
+			item = next;
+		else
+			item = spsc_queue_pop(&pipeline->read_queue);
+	}
+
+	spsc_queue_push(&pipeline->digest_queue, NULL);
+
+	return NULL;
+}
+
+static void *
+sign_stage(void *data)
+{
+	signlet_pipeline_t *pipeline = data;
+	signlet_context *context = pipeline->pool->context;
+	signlet_item_t *item;
+
+	while ((item = spsc_queue_pop(&pipeline->digest_queue))) {
+		signlet_sig_t *sig = &item->sig;
+
+		if (item->rc)
+			;
+		else if (context->digest_only)
+			item->rc = signaturelet_sign_digest(context->siglet,
+							    item->digest,
+							    context->digest_size,
+							    context->pkey,
+							    context->cert_list,
+							    context->nr_cert,
+							    &sig->sig,
+							    &sig->sig_len,
+							    context->flags);
+		else {
+			if (!item->map.data)
+				item->rc = libsign_utils_map_fd(item->fd,
+								&item->map);
+			if (!item->rc)
+				item->rc = signaturelet_sign(context->siglet,
+							     item->map.data,
+							     item->map.size,
+							     context->pkey,
+							     context->cert_list,
+							     context->nr_cert,
+							     &sig->sig,
+							     &sig->sig_len,
+							     context->flags);
+		}
+
+		release_item_content(context, item);
+		spsc_queue_push(&pipeline->sign_queue, item);
+	}
+
+	spsc_queue_push(&pipeline->sign_queue, NULL);
+
+	return NULL;
+}
+
+/*
+ * The writer stage runs in the calling thread. The signatures arriving
+ * after any failure or the cancellation are dropped, and their files are
+ * reported as cancelled.
+ */
+static void
+write_stage(signlet_pipeline_t *pipeline)
+{
+	signlet_pool_t *pool = pipeline->pool;
+	signlet_item_t *item;
+
+	while ((item = spsc_queue_pop(&pipeline->sign_queue))) {
+		if (stop_dispatch(pool)) {
+			release_sig(pool->context, &item->sig);
+			cancel_file(pool, &item->file);
+		} else
+			finish_file(pool, &item->file, &item->sig, item->rc);
+
+		free(item);
+	}
+}
+
+static void
+run_pipeline(signlet_pool_t *pool)
+{
+	signlet_pipeline_t pipeline = { .pool = pool };
+	struct {
+		void *(*fn)(void *);
+		/* The queue consumed by the stage */
+		spsc_queue_t *queue;
+	} stages[] = {
+		{ sign_stage, &pipeline.digest_queue },
+		{ digest_stage, &pipeline.read_queue },
+		{ read_stage, NULL },
+	};
+	pthread_t threads[sizeof(stages) / sizeof(*stages)];
+	unsigned int nr_created = 0;
+
+	if (spsc_queue_init(&pipeline.read_queue, SIGNLET_PIPELINE_DEPTH))
+		goto err_on_read_queue;
+
+	if (spsc_queue_init(&pipeline.digest_queue, SIGNLET_PIPELINE_DEPTH))
+		goto err_on_digest_queue;
+
+	if (spsc_queue_init(&pipeline.sign_queue, SIGNLET_PIPELINE_DEPTH))
+		goto err_on_sign_queue;
+
+	/* Start from the last stage so that no item is left in a queue */
+	for (; nr_created < sizeof(stages) / sizeof(*stages); ++nr_created) {
+		if (pthread_create(threads + nr_created, NULL,
+				   stages[nr_created].fn, &pipeline))
+			break;
+	}
+
+	if (nr_created != sizeof(stages) / sizeof(*stages) && nr_created)
+		/* Shut down the stages started */
+		spsc_queue_push(stages[nr_created - 1].queue, NULL);
+
+	if (nr_created)
+		write_stage(&pipeline);
+
+	while (nr_created)
+		pthread_join(threads[--nr_created], NULL);
+
+	spsc_queue_fini(&pipeline.sign_queue);
+
+err_on_sign_queue:
+	spsc_queue_fini(&pipeline.digest_queue);
+
+err_on_digest_queue:
+	spsc_queue_fini(&pipeline.read_queue);
+
+err_on_read_queue:
+	/* Sign the rest of files in sequence if the pipeline is broken */
+	if (files_left(pool) && !stop_dispatch(pool)) {
+		warn("Failed to set up the pipeline, signing the files in "
+		     "sequence\n");
+		sign_worker(pool);
+	}
+}
+
+/*
+ * In the prefork mode, the parent hands out the ranges of files to the
+ * worker processes through a ring in the shared memory, and each worker
+ * sends back the results of its files through its own pipe. The parent
+ * saves the signatures, so the writer and the job state stay in one
+ * process.
+ */
+typedef struct {
+	unsigned int first;
+	unsigned int nr;
+} signlet_range_t;
+
+typedef struct {
+	/* Robust and process-shared, in case a worker dies holding it */
+	pthread_mutex_t lock;
+	/* Signalled when a range is queued or no more range will be */
+	pthread_cond_t cond;
+	unsigned int head;
+	unsigned int tail;
+	bool done;
+	/* Set to skip the rest of files in the ranges popped or queued */
+	bool stopped;
+	signlet_range_t ranges[SIGNLET_PREFORK_RING_SIZE];
+} signlet_ring_t;
+
+typedef struct {
+	unsigned int index;
+	int rc;
+	/* Set if the file is signed according to the journal */
+	bool skipped;
+	journal_id_t id;
+	/* Followed by the signature and the extra digests if succeeded */
+	size_t sig_len;
+} signlet_result_t;
+
+static int
+write_full(int fd, const void *buf, size_t size)
+{
+	while (size) {
+		ssize_t len = write(fd, buf, size);
+
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return EXIT_FAILURE;
+		}
+
+		buf = (const uint8_t *)buf + len;
+		size -= len;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Return the number of bytes read, less than the requested size only if
+ * the end of file is reached, or -1 on error.
+ */
+static ssize_t
+read_full(int fd, void *buf, size_t size)
+{
+	size_t total = 0;
+
+	while (total < size) {
+		ssize_t len = read(fd, (uint8_t *)buf + total, size - total);
+
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		if (!len)
+			break;
+
+		total += len;
+	}
+
+	return total;
+}
+
+static int
+ring_init(signlet_ring_t *ring)
+{
+	memset(ring, 0, sizeof(*ring));
+
+	return shared_lock_init(&ring->lock, &ring->cond);
+}
+
+static void
+ring_fini(signlet_ring_t *ring)
+{
+	pthread_cond_destroy(&ring->cond);
+	pthread_mutex_destroy(&ring->lock);
+}
+
+/*
+ * Called by the parent. If a range is NULL, no more range is handed out.
+ */
+static bool
+ring_push(signlet_ring_t *ring, const signlet_range_t *range)
+{
+	bool pushed = false;
+
+	shared_lock(&ring->lock);
+
+	if (!range) {
+		ring->done = true;
+		pushed = true;
+	} else if (ring->tail - ring->head < SIGNLET_PREFORK_RING_SIZE) {
+		ring->ranges[ring->tail++ % SIGNLET_PREFORK_RING_SIZE] = *range;
+		pushed = true;
+	}
+
+	pthread_mutex_unlock(&ring->lock);
+
+	if (pushed)
+		pthread_cond_broadcast(&ring->cond);
+
+	return pushed;
+}
+
+/*
+ * Called by the worker processes. Wait for the next range and return
+ * false if no more range will be handed out.
+ */
+static bool
+ring_pop(signlet_ring_t *ring, signlet_range_t *range)
+{
+	bool popped = false;
+
+	shared_lock(&ring->lock);
+
+	while (ring->head == ring->tail && !ring->done) {
+		shared_cond_wait(&ring->cond, &ring->lock);
+	}
+
+	if (ring->head != ring->tail) {
+		*range = ring->ranges[ring->head++ %
+				      SIGNLET_PREFORK_RING_SIZE];
+		popped = true;
+	}
+
+	pthread_mutex_unlock(&ring->lock);
+
+	return popped;
+}
+
+static int
+send_result(signlet_context *context, int fd, signlet_file_t *file,
+	    bool skipped, signlet_sig_t *sig, int rc)
+{
+	signlet_result_t result = {
+		.index = file->index,
+		.rc = rc,
+		.skipped = skipped,
+		.id = file->id,
+		.sig_len = rc || skipped ? 0 : sig->sig_len,
+	};
+
+	if (write_full(fd, &result, sizeof(result)))
+		return EXIT_FAILURE;
+
+	if (rc || skipped)
+		return EXIT_SUCCESS;
+
+	if (write_full(fd, sig->sig, sig->sig_len))
+		return EXIT_FAILURE;
+
+	for (unsigned int i = 0; i < context->nr_extra_digest; ++i) {
+		unsigned int digest_size;
+
+		libsign_digest_size(context->digest_algs[i + 1],
+				    &digest_size);
+
+		if (write_full(fd, sig->extra_digests[i], digest_size))
+			return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Return EXIT_FAILURE once the worker closes the pipe, either after its
+ * last result or because it died.
+ */
+static int
+receive_result(signlet_pool_t *pool, int fd)
+{
+	signlet_context *context = pool->context;
+	signlet_result_t result;
+	signlet_sig_t sig;
+
+	if (read_full(fd, &result, sizeof(result)) != sizeof(result))
+		return EXIT_FAILURE;
+
+	if (result.index >= context->nr_signed_file)
+		return EXIT_FAILURE;
+
+	signlet_file_t file;
+	int rc = list_file(pool, result.index, &file);
+
+	memset(&sig, 0, sizeof(sig));
+	file.id = result.id;
+
+	if (result.skipped && !rc) {
+		skip_file(pool, &file);
+		return EXIT_SUCCESS;
+	}
+
+	if (result.rc || result.skipped) {
+		finish_file(pool, &file, &sig,
+			    result.rc ? result.rc : EXIT_FAILURE);
+		return EXIT_SUCCESS;
+	}
+
+	sig.sig = malloc(result.sig_len);
+	if (!sig.sig)
+		goto err;
+
+	sig.sig_len = result.sig_len;
+	if (read_full(fd, sig.sig, sig.sig_len) != (ssize_t)sig.sig_len)
+		goto err;
+
+	for (unsigned int i = 0; i < context->nr_extra_digest; ++i) {
+		unsigned int digest_size;
+
+		libsign_digest_size(context->digest_algs[i + 1],
+				    &digest_size);
+
+		sig.extra_digests[i] = malloc(digest_size);
+		if (!sig.extra_digests[i])
+			goto err;
+
+		if (read_full(fd, sig.extra_digests[i], digest_size) !=
+		    digest_size)
+			goto err;
+	}
+
+	finish_file(pool, &file, &sig, rc);
+
+	return EXIT_SUCCESS;
+
+err:
+	/* The rest of the pipe is out of sync */
+	err("Failed to receive the signature of %s from the worker\n",
+	    context->signed_file_list[result.index]);
+	finish_file(pool, &file, &sig, EXIT_FAILURE);
+
+	return EXIT_FAILURE;
+}
+
+static bool
+ring_finished(signlet_ring_t *ring)
+{
+	shared_lock(&ring->lock);
+	bool finished = ring->head == ring->tail && ring->done;
+	pthread_mutex_unlock(&ring->lock);
+
+	return finished;
+}
+
+static int
+sign_range(signlet_pool_t *pool, signlet_ring_t *ring, int fd,
+	   const signlet_range_t *range)
+{
+	signlet_context *context = pool->context;
+
+	for (unsigned int i = range->first; i < range->first + range->nr;
+	     ++i) {
+		if (__atomic_load_n(&ring->stopped, __ATOMIC_RELAXED))
+			break;
+
+		const char *path = context->signed_file_list[i];
+		signlet_file_t file = { .index = i };
+		signlet_sig_t sig;
+		bool skipped = false;
+		int rc = EXIT_FAILURE;
+
+		memset(&sig, 0, sizeof(sig));
+
+		int file_fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (file_fd >= 0) {
+			/* The journal is only written by the parent */
+			if (pool->journal && !list_file(pool, i, &file)) {
+				skipped = journaled_file(pool, &file, file_fd);
+				release_file(&file);
+			}
+
+			rc = skipped ? EXIT_SUCCESS :
+				       sign_file(context, file_fd, &sig);
+			close(file_fd);
+		} else
+			err("Failed to open %s\n", path);
+
+		rc = send_result(context, fd, &file, skipped, &sig, rc);
+		release_sig(context, &sig);
+		if (rc)
+			return rc;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Wait for the worker process, and fail the job if it terminated
+ * abnormally. The budget it held is returned then.
+ */
+static void
+reap_worker(signlet_pool_t *pool, pid_t pid, unsigned int worker)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) >= 0 && WIFEXITED(status) &&
+	    !WEXITSTATUS(status))
+		return;
+
+	err("The worker process %d terminated abnormally\n", pid);
+	__atomic_store_n(&pool->failed, true, __ATOMIC_RELAXED);
+
+	budget_reclaim_worker(pool->context->budget, worker);
+}
+
+/*
+ * Under the jobserver, an extra worker holds a token while signing each
+ * range.
+ */
+static void __attribute__((noreturn))
+prefork_worker(signlet_pool_t *pool, signlet_ring_t *ring, int fd,
+	       unsigned int worker)
+{
+	jobserver_t *jobserver = worker ? pool->jobserver : NULL;
+	int rc = EXIT_SUCCESS;
+
+	/* Don't outlive the parent blocked in the ring */
+	prctl(PR_SET_PDEATHSIG, SIGKILL);
+	if (getppid() == 1)
+		_exit(EXIT_FAILURE);
+
+	placement_bind(pool->placement, pool->context->placement, worker);
+	budget_bind_worker(pool->context->budget, worker);
+
+	/* Keep the lines of the workers from being interleaved */
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	while (!rc) {
+		signlet_range_t range;
+		char token;
+		bool acquired = false;
+
+		while (jobserver && !acquired && !ring_finished(ring))
+			acquired = !jobserver_acquire(jobserver,
+					SIGNLET_JOBSERVER_POLL_INTERVAL, &token);
+
+		if (jobserver && !acquired)
+			break;
+
+		bool popped = ring_pop(ring, &range);
+		if (popped)
+			rc = sign_range(pool, ring, fd, &range);
+
+		if (acquired)
+			jobserver_release(jobserver, token);
+
+		if (!popped)
+			break;
+	}
+
+	close(fd);
+	fflush(NULL);
+
+	_exit(rc);
+}
+
+/*
+ * Fork the worker processes once the request is parsed and the siglet
+ * is loaded, so that they inherit everything copy-on-write. Unlike the
+ * threads, the workers don't contend for the locks inside OpenSSL.
+ */
+static void
+run_processes(signlet_pool_t *pool)
+{
+	signlet_context *context = pool->context;
+	unsigned int nr_proc = context->processes;
+
+	if (nr_proc > context->nr_signed_file)
+		nr_proc = context->nr_signed_file;
+
+	/* A few ranges per worker to balance the load */
+	unsigned int range_size = context->nr_signed_file / (nr_proc * 4);
+
+	if (!range_size)
+		range_size = 1;
+	else if (range_size > SIGNLET_PREFORK_RANGE_MAX)
+		range_size = SIGNLET_PREFORK_RANGE_MAX;
+
+	struct pollfd *fds = NULL;
+	pid_t *pids = NULL;
+	unsigned int nr_created = 0;
+
+	signlet_ring_t *ring = mmap(NULL, sizeof(*ring),
+				    PROT_READ | PROT_WRITE,
+				    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (ring == MAP_FAILED)
+		goto err_on_map;
+
+	if (ring_init(ring))
+		goto err_on_ring;
+
+	fds = malloc(nr_proc * sizeof(*fds));
+	pids = malloc(nr_proc * sizeof(*pids));
+	if (!fds || !pids)
+		goto err_on_alloc;
+
+	pthread_rwlock_wrlock(&fork_lock);
+
+	/* Flush the buffered output not to be duplicated by the workers */
+	fflush(NULL);
+
+	for (; nr_created < nr_proc; ++nr_created) {
+		int pipe_fd[2];
+
+		if (pipe2(pipe_fd, O_CLOEXEC))
+			break;
+
+		pid_t pid = fork();
+		if (pid < 0) {
+			close(pipe_fd[0]);
+			close(pipe_fd[1]);
+			break;
+		}
+
+		if (!pid) {
+			for (unsigned int i = 0; i < nr_created; ++i)
+				close(fds[i].fd);
+			close(pipe_fd[0]);
+
+			prefork_worker(pool, ring, pipe_fd[1], nr_created);
+		}
+
+		close(pipe_fd[1]);
+
+		fds[nr_created].fd = pipe_fd[0];
+		fds[nr_created].events = POLLIN;
+		pids[nr_created] = pid;
+	}
+
+	pthread_rwlock_unlock(&fork_lock);
+
+	if (nr_created && nr_created != nr_proc)
+		warn("Only %d worker processes created\n", nr_created);
+
+	unsigned int nr_open = nr_created;
+	unsigned int next = 0;
+	bool dispatched = false;
+	bool stopped = false;
+
+	while (nr_open) {
+		if (!stopped && stop_dispatch(pool)) {
+			__atomic_store_n(&ring->stopped, true,
+					 __ATOMIC_RELAXED);
+			stopped = true;
+		}
+
+		while (!stopped && !dispatched) {
+			signlet_range_t range = {
+				.first = next,
+				.nr = range_size,
+			};
+
+			if (range.nr > context->nr_signed_file - next)
+				range.nr = context->nr_signed_file - next;
+
+			if (!ring_push(ring, &range))
+				break;
+
+			next += range.nr;
+			dispatched = next == context->nr_signed_file;
+		}
+
+		if ((stopped || dispatched) && !ring->done)
+			ring_push(ring, NULL);
+
+		if (poll(fds, nr_created, SIGNLET_PREFORK_POLL_INTERVAL) < 0 &&
+		    errno != EINTR)
+			break;
+
+		for (unsigned int i = 0; i < nr_created; ++i) {
+			if (fds[i].fd < 0 || !fds[i].revents)
+				continue;
+
+			if (receive_result(pool, fds[i].fd)) {
+				close(fds[i].fd);
+				fds[i].fd = -1;
+				--nr_open;
+
+				/*
+				 * Reap the worker right away, so that the
+				 * budget held by a dead one is returned to
+				 * the others waiting for it.
+				 */
+				reap_worker(pool, pids[i], i);
+				pids[i] = -1;
+			}
+		}
+	}
+
+	if (!ring->done)
+		ring_push(ring, NULL);
+
+	for (unsigned int i = 0; i < nr_created; ++i) {
+		if (fds[i].fd >= 0)
+			close(fds[i].fd);
+
+		if (pids[i] >= 0)
+			reap_worker(pool, pids[i], i);
+	}
+
+err_on_alloc:
+	free(pids);
+	free(fds);
+	ring_fini(ring);
+
+err_on_ring:
+	munmap(ring, sizeof(*ring));
+
+err_on_map:
+	/* Sign the files in sequence if no worker process is available */
+	if (!nr_created && !stop_dispatch(pool)) {
+		warn("Failed to set up the worker processes, signing the "
+		     "files in sequence\n");
+		sign_worker(pool);
+	}
+}
+
+static int
+list_source(void *data, const char **path, const char **output)
+{
+	signlet_lane_t *lane = data;
+
+	if (lane->next == lane->nr_file) {
+		*path = NULL;
+		return EXIT_SUCCESS;
+	}
+
+	*path = lane->signed_file_list[lane->next];
+	if (lane->output_file_list)
+		*output = lane->output_file_list[lane->next];
+	++lane->next;
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * The worker threads placed on a node take the files of its lane first,
+ * so the files are read into the page cache and the buffers of that
+ * node. The files are split among the nodes in proportion to the number
+ * of workers on them.
+ */
+static int
+init_lanes(signlet_pool_t *pool)
+{
+	signlet_context *context = pool->context;
+	unsigned int nr_worker[PLACEMENT_MAX_NODE] = { 0 };
+	unsigned int nr_thread = 1;
+
+	pool->nr_lane = 1;
+	nr_worker[0] = 1;
+
+	/* The streamed files always go through a single lane */
+	if (context->placement != LIBSIGN_PLACEMENT_NONE &&
+	    context->processes <= 1 && context->jobs > 1 &&
+	    context->nr_signed_file > 1) {
+		nr_thread = context->jobs;
+		if (nr_thread > context->nr_signed_file)
+			nr_thread = context->nr_signed_file;
+
+		nr_worker[0] = 0;
+
+		/* The nodes taken by the workers always start from 0 */
+		for (unsigned int i = 0; i < nr_thread; ++i) {
+			unsigned int node = placement_node(pool->placement,
+							   context->placement,
+							   i);
+
+			++nr_worker[node];
+			if (node >= pool->nr_lane)
+				pool->nr_lane = node + 1;
+		}
+	}
+
+	pool->lanes = calloc(pool->nr_lane, sizeof(*pool->lanes));
+	if (!pool->lanes)
+		return EXIT_FAILURE;
+
+	unsigned int first = 0;
+	unsigned int nr_placed = 0;
+	unsigned int i;
+
+	for (i = 0; i < pool->nr_lane; ++i) {
+		signlet_lane_t *lane = pool->lanes + i;
+
+		nr_placed += nr_worker[i];
+
+		unsigned int end = (uint64_t)context->nr_signed_file *
+				   nr_placed / nr_thread;
+		int rc;
+
+		if (context->next_file)
+			rc = prefetcher_init(&lane->prefetcher,
+					     context->next_file,
+					     context->next_file_data,
+					     PREFETCH_WINDOW);
+		else {
+			lane->signed_file_list = context->signed_file_list +
+						 first;
+			if (context->output_file_list)
+				lane->output_file_list =
+					context->output_file_list + first;
+			lane->nr_file = end - first;
+			/* A single file has nothing to be opened ahead */
+			rc = prefetcher_init(&lane->prefetcher, list_source,
+					     lane, lane->nr_file > 1 ?
+					     PREFETCH_WINDOW : 1);
+		}
+
+		if (rc)
+			break;
+
+		pthread_mutex_init(&lane->lock, NULL);
+		lane->first = first;
+		first = end;
+	}
+
+	if (i != pool->nr_lane) {
+		while (i--) {
+			pthread_mutex_destroy(&pool->lanes[i].lock);
+			prefetcher_fini(&pool->lanes[i].prefetcher);
+		}
+
+		free(pool->lanes);
+		return EXIT_FAILURE;
+	}
+
+	if (pool->nr_lane > 1)
+		dbg("%s: the files are split among %u nodes\n",
+		    context->siglet, pool->nr_lane);
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Report the files prefetched but not dispatched as cancelled once the
+ * job stops early, as the streamed files are only reported through the
+ * progress callback.
+ */
+static void
+cancel_lanes(signlet_pool_t *pool)
+{
+	for (unsigned int i = 0; i < pool->nr_lane; ++i) {
+		signlet_lane_t *lane = pool->lanes + i;
+		prefetch_entry_t entry;
+
+		while (!prefetcher_drain(&lane->prefetcher, &entry)) {
+			signlet_file_t file = {
+				.index = lane->first + entry.index,
+				.path = entry.path,
+				.output_path = entry.output,
+			};
+
+			if (entry.fd >= 0)
+				close(entry.fd);
+
+			cancel_file(pool, &file);
+		}
+	}
+}
+
+/* Return EXIT_FAILURE if the files failed to be streamed */
+static int
+fini_lanes(signlet_pool_t *pool)
+{
+	int rc = EXIT_SUCCESS;
+
+	for (unsigned int i = 0; i < pool->nr_lane; ++i) {
+		/* The failure is settled once the prefetch thread is gone */
+		pthread_mutex_destroy(&pool->lanes[i].lock);
+		prefetcher_fini(&pool->lanes[i].prefetcher);
+
+		if (pool->lanes[i].prefetcher.failed)
+			rc = EXIT_FAILURE;
+	}
+
+	free(pool->lanes);
+
+	return rc;
+}
+
+/*
+ * Sign all files of the job. This is run by the executor.
+ */
+static int
+run_job(signlet_job_t *job)
+{
+	signlet_context *context = &job->context;
+	signlet_pool_t pool = {
+		.job = job,
+		.context = context,
+		.failed = false,
+	};
+	const char *pattern;
+	int rc;
+
+	rc = signaturelet_suffix_pattern(context->siglet, context->flags,
+					 &pattern);
+	if (rc)
+		return rc;
+
+	/* The output paths are derived from the signed files on the fly */
+	if (*pattern == '+')
+		pool.output_suffix = pattern + 1;
+	else if (!context->output_file_list && !context->next_file) {
+		err("%s: the output files are not specified\n",
+		    context->siglet);
+		return EXIT_FAILURE;
+	}
+
+	pool.writer = malloc(sizeof(*pool.writer));
+	if (!pool.writer)
+		return EXIT_FAILURE;
+
+	/*
+	 * The signature files of a list request are renamed into place only
+	 * once all files are signed. The journaled job commits them at each
+	 * checkpoint instead, and the streamed job can't hold all of them.
+	 */
+	rc = libsign_writer_init(pool.writer, context->durability,
+				 context->journal || context->next_file ?
+				 0 : LIBSIGN_WRITER_FLAGS_DEFERRED);
+	if (rc)
+		goto err_on_init_writer;
+
+	if (context->journal) {
+		pool.journal = journal_open(context->journal, pool.writer);
+		if (!pool.journal) {
+			rc = EXIT_FAILURE;
+			goto err_on_init_writer;
+		}
+	}
+
+	unsigned int nr_proc = 0;
+
+	if (context->processes > 1)
+		nr_proc = context->processes < context->nr_signed_file ?
+			  context->processes : context->nr_signed_file;
+
+	context->budget = budget_create(context->memory_limit, nr_proc);
+	if (!context->budget) {
+		rc = EXIT_FAILURE;
+		goto err_on_create_budget;
+	}
+
+	pool.placement = placement_get();
+
+	rc = init_lanes(&pool);
+	if (rc)
+		goto err_on_init_lanes;
+
+	pool.jobserver = jobserver_get();
+
+	if (context->processes > 1)
+		run_processes(&pool);
+	/* A single file has nothing to overlap in the pipeline */
+	else if (context->jobs > 1 ||
+		 (!context->next_file && context->nr_signed_file <= 1))
+		run_workers(&pool);
+	else
+		run_pipeline(&pool);
+
+	cancel_lanes(&pool);
+
+	if (fini_lanes(&pool))
+		pool.failed = true;
+
+	/* Report the failures in the order of signed files */
+	for (unsigned int i = 0; job->status && i < context->nr_signed_file;
+	     ++i) {
+		if (job->status[i] == SIGNLET_FILE_FAILED)
+			err("Failed to sign %s with the key %s\n",
+			    context->signed_file_list[i], context->key);
+		else if (job->status[i] == SIGNLET_FILE_PENDING)
+			__atomic_store_n(job->status + i,
+					 SIGNLET_FILE_CANCELLED,
+					 __ATOMIC_RELEASE);
+	}
+
+	rc = pool.failed ||
+	     __atomic_load_n(&job->cancelled, __ATOMIC_RELAXED) ?
+	     EXIT_FAILURE : EXIT_SUCCESS;
+
+	/*
+	 * The failed list request leaves no signature file, while the
+	 * streamed job keeps those of the files reported signed. The
+	 * journaled job keeps the files done to be resumed later.
+	 */
+	if (!pool.journal) {
+		if (rc && !context->next_file)
+			libsign_writer_abort(pool.writer);
+		else if (libsign_writer_commit(pool.writer)) {
+			err("Failed to commit the signature files\n");
+			rc = EXIT_FAILURE;
+		}
+	}
+
+err_on_init_lanes:
+	job->memory_peak = budget_peak(context->budget);
+	budget_destroy(context->budget);
+	context->budget = NULL;
+
+err_on_create_budget:
+	/* Commit the signature files done and write the records left */
+	if (pool.journal && journal_close(pool.journal))
+		rc = EXIT_FAILURE;
+
+err_on_init_writer:
+	free(pool.writer);
+
+	return rc;
+}
+
+/*
+ * The executor runs the submitted jobs one by one in the background.
+ * The jobs done are appended to the completion queue.
+ */
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+static BCLL_DECLARE(job_list);
+static BCLL_DECLARE(run_queue);
+static BCLL_DECLARE(completion_queue);
+static unsigned long job_counter;
+static bool executor_running;
+
+static void
+complete_job(signlet_job_t *job, int rc)
+{
+	job->rc = rc;
+	job->state = SIGNLET_JOB_DONE;
+	bcll_add_tail(&completion_queue, &job->queue);
+	job->queued = true;
+	pthread_cond_broadcast(&job_cond);
+}
+
+static void *
+executor(void *data)
+{
+	pthread_mutex_lock(&job_lock);
+
+	while (1) {
+		while (bcll_empty(&run_queue))
+			pthread_cond_wait(&job_cond, &job_lock);
+
+		signlet_job_t *job = container_of(run_queue.next,
+						  signlet_job_t, queue);
+
+		bcll_del(&job->queue);
+		job->queued = false;
+		job->state = SIGNLET_JOB_RUNNING;
+
+		pthread_mutex_unlock(&job_lock);
+
+		int rc = run_job(job);
+
+		pthread_mutex_lock(&job_lock);
+
+		complete_job(job, rc);
+	}
+
+	return NULL;
+}
+
+static signlet_job_t *
+find_job(const char *id)
+{
+	signlet_job_t *job;
+
+	if (!id)
+		return NULL;
+
+	bcll_for_each_link(job, &job_list, link) {
+		if (!strcmp(job->id, id))
+			return job;
+	}
+
+	return NULL;
+}
+
+static void
+free_job(signlet_job_t *job)
+{
+	release_request(&job->context);
+	free(job->status);
+	free(job);
+}
+
+static int
+prepare_job(signlet_request_t *request, signlet_job_t *job)
+{
+	signlet_context *context = &job->context;
+	int rc;
+
+	rc = signaturelet_load(request->siglet);
+	if (rc)
+		return rc;
+
+	if (!signaturelet_cipher_supported(context->siglet,
+					   context->cipher_alg)) {
+		err("signaturelet %s doesn't support the %s key\n",
+		    context->siglet, libsign_cipher_name(context->cipher_alg));
+		return EXIT_FAILURE;
+	}
+
+	context->digest_only = signaturelet_digest_only(context->siglet,
+							context->flags,
+							&context->digest_alg);
+	context->digest_algs[0] = context->digest_alg;
+	if (context->digest_only)
+		return libsign_digest_size(context->digest_alg,
+					   &context->digest_size);
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Submit the request to be served in the background. The returned job
+ * id is valid until signlet_finish() is called with it.
+ */
+int
+signlet_request(signlet_request_t *request, const char **id)
+{
+	if (!id)
+		return EXIT_FAILURE;
+
+	signlet_job_t *job = calloc(1, sizeof(*job));
+	if (!job)
+		return EXIT_FAILURE;
+
+	signlet_context *context = &job->context;
+	int rc;
+
+	pthread_rwlock_rdlock(&fork_lock);
+
+	rc = parse_request(request, context);
+	if (rc) {
+		pthread_rwlock_unlock(&fork_lock);
+		free(job);
+		return rc;
+	}
+
+	rc = prepare_job(request, job);
+
+	pthread_rwlock_unlock(&fork_lock);
+
+	if (rc)
+		goto err;
+
+	rc = EXIT_FAILURE;
+
+	/*
+	 * All files are SIGNLET_FILE_PENDING initially. The status of the
+	 * streamed files is only reported to the progress callback.
+	 */
+	if (!context->next_file) {
+		job->status = calloc(context->nr_signed_file,
+				     sizeof(*job->status));
+		if (!job->status)
+			goto err;
+	}
+
+	job->progress = request->progress;
+	job->progress_data = request->progress_data;
+	job->state = SIGNLET_JOB_QUEUED;
+
+	pthread_mutex_lock(&job_lock);
+
+	if (!executor_running) {
+		pthread_t thread;
+
+		if (pthread_create(&thread, NULL, executor, NULL)) {
+			pthread_mutex_unlock(&job_lock);
+			err("Failed to create the executor\n");
+			goto err;
+		}
+
+		pthread_detach(thread);
+		executor_running = true;
+	}
+
+	snprintf(job->id, sizeof(job->id), "signlet-%lu", ++job_counter);
+	bcll_add_tail(&job_list, &job->link);
+	bcll_add_tail(&run_queue, &job->queue);
+	job->queued = true;
+	pthread_cond_broadcast(&job_cond);
+
+	pthread_mutex_unlock(&job_lock);
+
+	*id = job->id;
+
+	return EXIT_SUCCESS;
+
+err:
+	free_job(job);
+
+	return rc;
+}
+
+/*
+ * Wait for the job to be done, and return its result.
+ */
+int
+signlet_wait(const char *id)
+{
+	pthread_mutex_lock(&job_lock);
+
+	signlet_job_t *job = find_job(id);
+	if (!job) {
+		pthread_mutex_unlock(&job_lock);
+		err("Waiting for a not existing job %s\n", id);
+		return EXIT_FAILURE;
+	}
+
+	while (job->state != SIGNLET_JOB_DONE)
+		pthread_cond_wait(&job_cond, &job_lock);
+
+	int rc = job->rc;
+
+	pthread_mutex_unlock(&job_lock);
+
+	return rc;
+}
+
+/*
+ * Take the next job from the completion queue, waiting for one if any
+ * job is still outstanding. Return its result.
+ */
+int
+signlet_wait_any(const char **id)
+{
+	if (!id)
+		return EXIT_FAILURE;
+
+	pthread_mutex_lock(&job_lock);
+
+	while (bcll_empty(&completion_queue)) {
+		signlet_job_t *job;
+		bool outstanding = false;
+
+		bcll_for_each_link(job, &job_list, link) {
+			if (job->state != SIGNLET_JOB_DONE) {
+				outstanding = true;
+				break;
+			}
+		}
+
+		if (!outstanding) {
+			pthread_mutex_unlock(&job_lock);
+			return EXIT_FAILURE;
+		}
+
+		pthread_cond_wait(&job_cond, &job_lock);
+	}
+
+	signlet_job_t *job = container_of(completion_queue.next,
+					  signlet_job_t, queue);
+
+	bcll_del(&job->queue);
+	job->queued = false;
+	*id = job->id;
+
+	int rc = job->rc;
+
+	pthread_mutex_unlock(&job_lock);
+
+	return rc;
+}
+
+/*
+ * Cancel the job. A queued job is done immediately, and a running one
+ * stops signing before the next file. None of the signature files of a
+ * cancelled list request is committed. Those of the files reported
+ * signed are kept if the job is streamed or journaled.
+ */
+int
+signlet_cancel(const char *id)
+{
+	pthread_mutex_lock(&job_lock);
+
+	signlet_job_t *job = find_job(id);
+	if (!job) {
+		pthread_mutex_unlock(&job_lock);
+		err("Cancelling a not existing job %s\n", id);
+		return EXIT_FAILURE;
+	}
+
+	__atomic_store_n(&job->cancelled, true, __ATOMIC_RELAXED);
+
+	if (job->state == SIGNLET_JOB_QUEUED) {
+		bcll_del(&job->queue);
+		job->queued = false;
+
+		for (unsigned int i = 0; job->status &&
+		     i < job->context.nr_signed_file; ++i)
+			job->status[i] = SIGNLET_FILE_CANCELLED;
+
+		complete_job(job, EXIT_FAILURE);
+	}
+
+	pthread_mutex_unlock(&job_lock);
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Wait for the job to be done and release it. The job id is invalid
+ * after this call.
+ */
+int
+signlet_finish(const char *id)
+{
+	pthread_mutex_lock(&job_lock);
+
+	signlet_job_t *job = find_job(id);
+	if (!job) {
+		pthread_mutex_unlock(&job_lock);
+		err("Finishing a not existing job %s\n", id);
+		return EXIT_FAILURE;
+	}
+
+	while (job->state != SIGNLET_JOB_DONE)
+		pthread_cond_wait(&job_cond, &job_lock);
+
+	bcll_del(&job->link);
+	if (job->queued)
+		bcll_del(&job->queue);
+
+	pthread_mutex_unlock(&job_lock);
+
+	free_job(job);
+
+	return EXIT_SUCCESS;
+}
+
+int
+signlet_file_status(const char *id, unsigned int index,
+		    SIGNLET_FILE_STATUS *status)
+{
+	if (!status)
+		return EXIT_FAILURE;
+
+	pthread_mutex_lock(&job_lock);
+
+	signlet_job_t *job = find_job(id);
+	if (!job || !job->status || index >= job->context.nr_signed_file) {
+		pthread_mutex_unlock(&job_lock);
+		return EXIT_FAILURE;
+	}
+
+	*status = __atomic_load_n(job->status + index, __ATOMIC_ACQUIRE);
+
+	pthread_mutex_unlock(&job_lock);
+
+	return EXIT_SUCCESS;
+}
+
+int
+signlet_memory_peak(const char *id, uint64_t *peak)
+{
+	if (!peak)
+		return EXIT_FAILURE;
+
+	pthread_mutex_lock(&job_lock);
+
+	signlet_job_t *job = find_job(id);
+	if (!job || job->state != SIGNLET_JOB_DONE) {
+		pthread_mutex_unlock(&job_lock);
+		return EXIT_FAILURE;
+	}
+
+	*peak = job->memory_peak;
+
+	pthread_mutex_unlock(&job_lock);
+
+	return EXIT_SUCCESS;
 }
@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2017, Wind River Systems, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1) Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2) Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3) Neither the name of Wind River Systems nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Author:
+ *        Lans Zhang <jia.zhang@windriver.com>
+ */
+
+#include <libsign.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "spsc_queue.h"
+
+static void
+futex_wait(uint32_t *addr, uint32_t val)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void
+futex_wake(uint32_t *addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+int
+spsc_queue_init(spsc_queue_t *queue, uint32_t depth)
+{
+	if (!queue || !depth || (depth & (depth - 1)))
+		return EXIT_FAILURE;
+
+	memset(queue, 0, sizeof(*queue));
+
+	queue->slots = calloc(depth, sizeof(void *));
+	if (!queue->slots)
+		return EXIT_FAILURE;
+
+	queue->depth = depth;
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Wake up the other side if it is (going to be) sleeping. The sequential
+ * consistency of the index update and the flag check pairs with the
+ * flag set and the index recheck on the sleeping side, so either the
+ * sleeper sees the new index or the waker sees the flag.
+ */
+static void
+wake_up(uint32_t *waiting, uint32_t *index)
+{
+	if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST)) {
+		__atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+		futex_wake(index);
+	}
+}
+
+static void
+sleep_on(uint32_t *waiting, uint32_t *index, uint32_t val)
+{
+	__atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(index, __ATOMIC_SEQ_CST) == val)
+		futex_wait(index, val);
+
+	__atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+}
+
+void
+spsc_queue_push(spsc_queue_t *queue, void *item)
+{
+	uint32_t tail = queue->tail;
+
+	while (1) {
+		uint32_t head = __atomic_load_n(&queue->head,
+						__ATOMIC_ACQUIRE);
+
+		if (tail - head < queue->depth)
+			break;
+
+		sleep_on(&queue->producer_waiting, &queue->head, head);
+	}
+
+	queue->slots[tail & (queue->depth - 1)] = item;
+	__atomic_store_n(&queue->tail, tail + 1, __ATOMIC_SEQ_CST);
+
+	wake_up(&queue->consumer_waiting, &queue->tail);
+}
+
+bool
+spsc_queue_try_pop(spsc_queue_t *queue, void **item)
+{
+	uint32_t head = queue->head;
+
+	if (__atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) == head)
+		return false;
+
+	*item = queue->slots[head & (queue->depth - 1)];
+	__atomic_store_n(&queue->head, head + 1, __ATOMIC_SEQ_CST);
+
+	wake_up(&queue->producer_waiting, &queue->head);
+
+	return true;
+}
+
+void *
+spsc_queue_pop(spsc_queue_t *queue)
+{
+	void *item;
+
+	while (!spsc_queue_try_pop(queue, &item))
+		sleep_on(&queue->consumer_waiting, &queue->tail, queue->head);
+
+	return item;
+}
+
+void
+spsc_queue_fini(spsc_queue_t *queue)
+{
+	if (!queue)
+		return;
+
+	free(queue->slots);
+	queue->slots = NULL;
+}
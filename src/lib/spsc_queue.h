@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2017, Wind River Systems, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1) Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2) Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3) Neither the name of Wind River Systems nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Author:
+ *        Lans Zhang <jia.zhang@windriver.com>
+ */
+
+#ifndef __SPSC_QUEUE_H__
+#define __SPSC_QUEUE_H__
+
+#include <libsign.h>
+
+/*
+ * The bounded queue between a single producer and a single consumer.
+ * Pushing and popping never take a lock. The side finding the queue
+ * full or empty sleeps on a futex until the other side makes progress.
+ */
+
+typedef struct {
+	void **slots;
+	/* The number of slots, a power of 2 */
+	uint32_t depth;
+	/* The next slot to be popped, only written by the consumer */
+	uint32_t head;
+	/* The next slot to be pushed, only written by the producer */
+	uint32_t tail;
+	/* Set by the side going to sleep on head or tail */
+	uint32_t producer_waiting;
+	uint32_t consumer_waiting;
+} spsc_queue_t;
+
+int
+spsc_queue_init(spsc_queue_t *queue, uint32_t depth);
+
+void
+spsc_queue_push(spsc_queue_t *queue, void *item);
+
+void *
+spsc_queue_pop(spsc_queue_t *queue);
+
+bool
+spsc_queue_try_pop(spsc_queue_t *queue, void **item);
+
+void
+spsc_queue_fini(spsc_queue_t *queue);
+
+#endif	/* __SPSC_QUEUE_H__ */
@@ -32,6 +32,7 @@
  */
 
 #include <libsign.h>
+#include "io.h"
 
 static int show_verbose;
 
@@ -119,9 +120,138 @@ libsign_utils_file_exists(const char *file_path)
 	return !access(file_path, R_OK);
 }
 
+/*
+ * Slurp the content of a pipe or special file which cannot be mapped.
+ */
+static int
+read_file_content(int fd, uint8_t **out_buf, size_t *out_size)
+{
+	size_t buf_size = 0;
+	size_t size = 0;
+	uint8_t *buf = NULL;
+
+	while (1) {
+		if (size == buf_size) {
+			size_t new_size = buf_size ? buf_size * 2 : 65536;
+			uint8_t *new_buf = realloc(buf, new_size);
+
+			if (!new_buf) {
+				err("Failed to allocate memory for input "
+				    "file\n");
+				free(buf);
+				return EXIT_FAILURE;
+			}
+
+			buf = new_buf;
+			buf_size = new_size;
+		}
+
+		ssize_t len = read(fd, buf + size, buf_size - size);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+
+			err("Failed to read input file\n");
+			free(buf);
+			return EXIT_FAILURE;
+		}
+
+		if (!len)
+			break;
+
+		size += len;
+	}
+
+	if (!size) {
+		err("Empty input file\n");
+		free(buf);
+		return EXIT_FAILURE;
+	}
+
+	*out_buf = buf;
+	*out_size = size;
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Read the whole content of a file through the I/O policy in effect.
+ */
+int
+libsign_utils_read_fd(int fd, libsign_file_map_t *map)
+{
+	io_reader_t reader;
+
+	if (io_reader_open(&reader, fd))
+		return EXIT_FAILURE;
+
+	int rc = EXIT_FAILURE;
+
+	if (reader.size < 0) {
+		rc = read_file_content(fd, &map->data, &map->size);
+		goto out;
+	}
+
+	if (!reader.size) {
+		err("Empty input file\n");
+		goto out;
+	}
+
+	if ((uint64_t)reader.size > SIZE_MAX) {
+		err("Input file too large to load\n");
+		goto out;
+	}
+
+	uint8_t *buf = malloc(reader.size);
+	if (!buf) {
+		err("Failed to allocate memory for input file\n");
+		goto out;
+	}
+
+	size_t size = 0;
+
+	while (1) {
+		const uint8_t *data;
+		ssize_t len = io_reader_read(&reader, &data);
+		if (len < 0) {
+			free(buf);
+			goto out;
+		}
+
+		if (!len)
+			break;
+
+		/* The file grows while being read */
+		if ((size_t)len > reader.size - size) {
+			err("Input file changed while being read\n");
+			free(buf);
+			goto out;
+		}
+
+		memcpy(buf + size, data, len);
+		size += len;
+	}
+
+	if (!size) {
+		err("Empty input file\n");
+		free(buf);
+		goto out;
+	}
+
+	map->data = buf;
+	map->size = size;
+	rc = EXIT_SUCCESS;
+
+out:
+	map->mapped = false;
+	io_reader_close(&reader);
+
+	return rc;
+}
+
 int
 libsign_utils_load_file(const char *path, uint8_t **out_buf,
-			unsigned int *out_size)
+			size_t *out_size)
 {
 	dbg("Reading file %s ...\n", path);
 
@@ -140,79 +270,146 @@ libsign_utils_load_file(const char *path, uint8_t **out_buf,
 		return EXIT_FAILURE;
 	}
 
-	FILE *fp = fopen(path, "rb");
-	if (!fp) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
 		dbg("Failed to open input file\n");
 		return EXIT_FAILURE;
 	}
 
-	int rc = EXIT_FAILURE;
+	libsign_file_map_t map;
+	int rc = libsign_utils_read_fd(fd, &map);
+
+	close(fd);
+
+	if (rc)
+		return rc;
+
+	*out_buf = map.data;
+	*out_size = map.size;
 
-	if (fseek(fp, 0, SEEK_END)) {
-		err("Failed to seek the end of file\n");
-		goto err;
+	return EXIT_SUCCESS;
+}
+
+int
+libsign_utils_map_fd(int fd, libsign_file_map_t *map)
+{
+	if (fd < 0) {
+		err("Invalid file descriptor to map\n");
+		return EXIT_FAILURE;
 	}
 
-	unsigned int size = ftell(fp);
-	if (!size) {
-		err("Empty input file\n");
-		goto err;
+	if (!map) {
+		err("Invalid file map\n");
+		return EXIT_FAILURE;
 	}
 
-	rewind(fp);
+	struct stat st;
 
-	uint8_t *buf = (uint8_t *)malloc(size);
-	if (!buf) {
-		err("Failed to allocate memory for input file\n");
-		goto err;
+	if (fstat(fd, &st)) {
+		err("Failed to stat input file\n");
+		return EXIT_FAILURE;
 	}
 
-	if (fread(buf, size, 1, fp) != 1) {
-		err("Failed to read input file\n");
-		free(buf);
-	} else {
-		*out_buf = buf;
-		*out_size = size;
-		rc = EXIT_SUCCESS;
+	if (!S_ISREG(st.st_mode))
+		goto fallback;
+
+	/* Mapping the file would bring it into the page cache */
+	if (libsign_io_policy() == LIBSIGN_IO_POLICY_DIRECT)
+		return libsign_utils_read_fd(fd, map);
+
+	if (!st.st_size) {
+		err("Empty input file\n");
+		return EXIT_FAILURE;
 	}
 
-err:
-	fclose(fp);
+	if ((uint64_t)st.st_size > SIZE_MAX) {
+		err("Input file too large to map\n");
+		return EXIT_FAILURE;
+	}
 
-	return rc;
+	void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (addr == MAP_FAILED) {
+		/* Some file systems don't support mmap() */
+		dbg("Failed to map input file, falling back to read()\n");
+		goto fallback;
+	}
+
+	madvise(addr, st.st_size, MADV_SEQUENTIAL);
+	if (libsign_io_policy() == LIBSIGN_IO_POLICY_READAHEAD)
+		madvise(addr, st.st_size, MADV_WILLNEED);
+
+	map->data = addr;
+	map->size = st.st_size;
+	map->mapped = true;
+
+	return EXIT_SUCCESS;
+
+fallback:
+	if (read_file_content(fd, &map->data, &map->size))
+		return EXIT_FAILURE;
+
+	map->mapped = false;
+
+	return EXIT_SUCCESS;
 }
 
 int
-libsign_utils_save_file(const char *path, uint8_t *buf,
-			unsigned int size)
+libsign_utils_map_file(const char *path, libsign_file_map_t *map)
 {
-	dbg("Saving file %s ...\n", path);
+	dbg("Mapping file %s ...\n", path);
 
-	FILE *fp = fopen(path, "w");
-	if (!fp) {
-		err("Failed to create output file\n");
+	if (!path || !path[0]) {
+		err("Invalid file path to map\n");
 		return EXIT_FAILURE;
 	}
 
-	if (fwrite(buf, size, 1, fp) != 1) {
-		fclose(fp);
-		err("Failed to write output file\n");
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		dbg("Failed to open input file\n");
 		return EXIT_FAILURE;
 	}
 
-	fclose(fp);
+	int rc = libsign_utils_map_fd(fd, map);
 
-	return EXIT_SUCCESS;
+	close(fd);
+
+	return rc;
+}
+
+void
+libsign_utils_unmap_file(libsign_file_map_t *map)
+{
+	if (!map || !map->data)
+		return;
+
+	if (map->mapped)
+		munmap(map->data, map->size);
+	else
+		free(map->data);
+
+	map->data = NULL;
+	map->size = 0;
+}
+
+int
+libsign_utils_save_file(const char *path, uint8_t *buf,
+			size_t size)
+{
+	libsign_writer_t writer;
+
+	libsign_writer_init(&writer, LIBSIGN_DURABILITY_NONE, 0);
+
+	return libsign_writer_save(&writer, path, buf, size);
 }
 
 void
 libsign_utils_hex_dump(const char *prompt, uint8_t *data,
-		       unsigned int data_size)
+		       size_t data_size)
 {
 	if (prompt)
-		dbg("%s (%d-byte): ", prompt, data_size);
+		dbg("%s (%zu-byte): ", prompt, data_size);
 
-	for (unsigned int i = 0; i < data_size; ++i)
+	for (size_t i = 0; i < data_size; ++i)
 		dbg_cont("%02x", data[i]);
 
 	dbg_cont("\n");
@@ -0,0 +1,389 @@
+/*
+ * Copyright (c) 2017, Wind River Systems, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1) Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2) Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3) Neither the name of Wind River Systems nor the names of its contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Author:
+ *        Lans Zhang <jia.zhang@windriver.com>
+ */
+
+#include <libsign.h>
+
+/*
+ * The output file is written to a temporary file in the same directory
+ * and then renamed over the final path, so a crash never leaves a
+ * truncated output file behind. The durability policy decides when
+ * the data and the renames are committed to the storage. The rename is
+ * deferred until the commit under the batch policy or with the writer
+ * deferred, and dropped by the abort.
+ */
+
+static unsigned long temp_counter;
+
+static char *
+build_temp_path(const char *path)
+{
+	const char *base = strrchr(path, '/');
+	int dir_len = base ? base - path + 1 : 0;
+	char *temp_path;
+
+	base = path + dir_len;
+
+	if (asprintf(&temp_path, "%.*s.%s.%d.%lu.tmp", dir_len, path, base,
+		     getpid(),
+		     __atomic_add_fetch(&temp_counter, 1,
+					__ATOMIC_RELAXED)) < 0)
+		return NULL;
+
+	return temp_path;
+}
+
+static int
+sync_dir(const char *path)
+{
+	const char *base = strrchr(path, '/');
+	char *dir;
+
+	if (base == path)
+		dir = strdup("/");
+	else if (base)
+		dir = strndup(path, base - path);
+	else
+		dir = strdup(".");
+	if (!dir)
+		return EXIT_FAILURE;
+
+	int rc = EXIT_FAILURE;
+	int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd >= 0) {
+		if (!fsync(fd))
+			rc = EXIT_SUCCESS;
+		close(fd);
+	}
+
+	if (rc)
+		err("Failed to sync the directory %s\n", dir);
+
+	free(dir);
+
+	return rc;
+}
+
+static int
+write_all(int fd, const uint8_t *buf, size_t size)
+{
+	while (size) {
+		ssize_t len = write(fd, buf, size);
+
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return EXIT_FAILURE;
+		}
+
+		buf += len;
+		size -= len;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+int
+libsign_writer_init(libsign_writer_t *writer, LIBSIGN_DURABILITY durability,
+		    unsigned long flags)
+{
+	if (!writer)
+		return EXIT_FAILURE;
+
+	if (durability != LIBSIGN_DURABILITY_NONE &&
+	    durability != LIBSIGN_DURABILITY_BATCH &&
+	    durability != LIBSIGN_DURABILITY_FILE) {
+		err("Invalid durability policy %d\n", durability);
+		return EXIT_FAILURE;
+	}
+
+	memset(writer, 0, sizeof(*writer));
+	writer->durability = durability;
+	writer->flags = flags;
+	pthread_mutex_init(&writer->lock, NULL);
+
+	return EXIT_SUCCESS;
+}
+
+static int
+commit_pending(libsign_writer_t *writer);
+
+static int
+add_pending(libsign_writer_t *writer, char *temp_path, const char *path,
+	    dev_t dev)
+{
+	libsign_writer_entry_t *entry;
+
+	char *final_path = strdup(path);
+	if (!final_path)
+		return EXIT_FAILURE;
+
+	pthread_mutex_lock(&writer->lock);
+
+	/* Only the deferred writer holds all files until the commit */
+	if (!(writer->flags & LIBSIGN_WRITER_FLAGS_DEFERRED) &&
+	    writer->nr_pending == LIBSIGN_WRITER_MAX_PENDING) {
+		if (commit_pending(writer))
+			goto err;
+	}
+
+	if (writer->nr_pending == writer->max_pending) {
+		unsigned int max_pending = writer->max_pending ?
+					   writer->max_pending * 2 : 64;
+
+		entry = realloc(writer->pending,
+				max_pending * sizeof(*entry));
+		if (!entry)
+			goto err;
+
+		writer->pending = entry;
+		writer->max_pending = max_pending;
+	}
+
+	entry = writer->pending + writer->nr_pending++;
+	entry->temp_path = temp_path;
+	entry->path = final_path;
+	entry->dev = dev;
+	entry->renamed = false;
+
+	pthread_mutex_unlock(&writer->lock);
+
+	return EXIT_SUCCESS;
+
+err:
+	pthread_mutex_unlock(&writer->lock);
+	free(final_path);
+
+	return EXIT_FAILURE;
+}
+
+int
+libsign_writer_save(libsign_writer_t *writer, const char *path,
+		    uint8_t *buf, size_t size)
+{
+	dbg("Saving file %s ...\n", path);
+
+	if (!writer || !path || !path[0] || (size && !buf))
+		return EXIT_FAILURE;
+
+	char *temp_path = build_temp_path(path);
+	if (!temp_path)
+		return EXIT_FAILURE;
+
+	int fd = open(temp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+		      0666);
+	if (fd < 0) {
+		err("Failed to create output file %s\n", path);
+		free(temp_path);
+		return EXIT_FAILURE;
+	}
+
+	struct stat st;
+
+	if (write_all(fd, buf, size)) {
+		err("Failed to write output file %s\n", path);
+		goto err;
+	}
+
+	if (writer->durability == LIBSIGN_DURABILITY_FILE && fsync(fd)) {
+		err("Failed to sync output file %s\n", path);
+		goto err;
+	}
+
+	bool deferred = writer->durability == LIBSIGN_DURABILITY_BATCH ||
+			(writer->flags & LIBSIGN_WRITER_FLAGS_DEFERRED);
+
+	if (deferred && fstat(fd, &st)) {
+		err("Failed to stat output file %s\n", path);
+		goto err;
+	}
+
+	if (close(fd)) {
+		fd = -1;
+		err("Failed to close output file %s\n", path);
+		goto err;
+	}
+	fd = -1;
+
+	/* Defer the rename until the writer is committed */
+	if (deferred) {
+		if (add_pending(writer, temp_path, path, st.st_dev))
+			goto err;
+
+		return EXIT_SUCCESS;
+	}
+
+	if (rename(temp_path, path)) {
+		err("Failed to rename output file %s\n", path);
+		goto err;
+	}
+
+	free(temp_path);
+
+	if (writer->durability == LIBSIGN_DURABILITY_FILE)
+		return sync_dir(path);
+
+	return EXIT_SUCCESS;
+
+err:
+	if (fd >= 0)
+		close(fd);
+	unlink(temp_path);
+	free(temp_path);
+
+	return EXIT_FAILURE;
+}
+
+/*
+ * Sync each file system holding the pending files once. The first call
+ * commits the data of the temporary files, and the second one commits
+ * the renames.
+ */
+static int
+sync_pending_fs(libsign_writer_t *writer)
+{
+	for (unsigned int i = 0; i < writer->nr_pending; ++i) {
+		libsign_writer_entry_t *entry = writer->pending + i;
+		unsigned int j;
+
+		for (j = 0; j < i; ++j) {
+			if (writer->pending[j].dev == entry->dev)
+				break;
+		}
+
+		/* Already synced */
+		if (j != i)
+			continue;
+
+		const char *path = entry->renamed ? entry->path :
+						    entry->temp_path;
+		int fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			err("Failed to open %s\n", path);
+			return EXIT_FAILURE;
+		}
+
+		int rc = syncfs(fd);
+		close(fd);
+		if (rc) {
+			err("Failed to sync the file system of %s\n",
+			    entry->path);
+			return EXIT_FAILURE;
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
+
+static void
+release_pending(libsign_writer_t *writer)
+{
+	for (unsigned int i = 0; i < writer->nr_pending; ++i) {
+		libsign_writer_entry_t *entry = writer->pending + i;
+
+		if (!entry->renamed)
+			unlink(entry->temp_path);
+
+		free(entry->temp_path);
+		free(entry->path);
+	}
+
+	free(writer->pending);
+	writer->pending = NULL;
+	writer->nr_pending = writer->max_pending = 0;
+}
+
+static int
+commit_pending(libsign_writer_t *writer)
+{
+	if (!writer->nr_pending)
+		return EXIT_SUCCESS;
+
+	bool batch = writer->durability == LIBSIGN_DURABILITY_BATCH;
+	int rc = EXIT_SUCCESS;
+
+	if (batch) {
+		rc = sync_pending_fs(writer);
+		if (rc)
+			goto out;
+	}
+
+	for (unsigned int i = 0; i < writer->nr_pending; ++i) {
+		libsign_writer_entry_t *entry = writer->pending + i;
+
+		if (rename(entry->temp_path, entry->path)) {
+			err("Failed to rename output file %s\n", entry->path);
+			rc = EXIT_FAILURE;
+			continue;
+		}
+
+		entry->renamed = true;
+
+		/* The data is synced when the file is saved */
+		if (writer->durability == LIBSIGN_DURABILITY_FILE &&
+		    sync_dir(entry->path))
+			rc = EXIT_FAILURE;
+	}
+
+	if (batch && sync_pending_fs(writer))
+		rc = EXIT_FAILURE;
+
+out:
+	release_pending(writer);
+
+	return rc;
+}
+
+int
+libsign_writer_commit(libsign_writer_t *writer)
+{
+	if (!writer)
+		return EXIT_FAILURE;
+
+	pthread_mutex_lock(&writer->lock);
+	int rc = commit_pending(writer);
+	pthread_mutex_unlock(&writer->lock);
+
+	return rc;
+}
+
+void
+libsign_writer_abort(libsign_writer_t *writer)
+{
+	if (!writer)
+		return;
+
+	pthread_mutex_lock(&writer->lock);
+	release_pending(writer);
+	pthread_mutex_unlock(&writer->lock);
+}
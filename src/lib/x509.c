@@ -31,28 +31,191 @@
  *        Lans Zhang <jia.zhang@windriver.com>
  */
 
-#include <libsign.h>
+#include "keystore.h"
 
+/*
+ * A file may hold a bundle of certificates, e.g. the signer certificate
+ * followed by its chain, all PEM-encoded or DER-encoded back to back.
+ */
+typedef struct {
+	int refs;
+	unsigned int nr_cert;
+	X509 *certs[];
+} x509_bundle_t;
+
+static void
+free_bundle(void *object)
+{
+	x509_bundle_t *bundle = object;
+
+	if (__atomic_sub_fetch(&bundle->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	for (unsigned int i = 0; i < bundle->nr_cert; ++i)
+		X509_free(bundle->certs[i]);
+
+	free(bundle);
+}
+
+static int
+up_ref_bundle(void *object)
+{
+	x509_bundle_t *bundle = object;
+
+	__atomic_add_fetch(&bundle->refs, 1, __ATOMIC_RELAXED);
+
+	return 1;
+}
+
+static X509 *
+next_cert(BIO *bio, const uint8_t **data, const uint8_t *end)
+{
+	if (bio)
+		return PEM_read_bio_X509(bio, NULL, NULL, NULL);
+
+	if (*data == end)
+		return NULL;
+
+	return d2i_X509(NULL, data, end - *data);
+}
+
+static void *
+parse_bundle(const uint8_t *data, size_t size, const char *path)
+{
+	const uint8_t *end = data + size;
+	BIO *bio;
+	bool pem = keystore_pem(data, size, &bio);
+
+	if (pem && !bio)
+		return NULL;
+
+	STACK_OF(X509) *certs = sk_X509_new_null();
+	x509_bundle_t *bundle = NULL;
+	X509 *cert;
+
+	if (!certs)
+		goto out;
+
+	while ((cert = next_cert(bio, &data, end))) {
+		if (!sk_X509_push(certs, cert)) {
+			X509_free(cert);
+			goto out;
+		}
+	}
+
+	/* The PEM reader fails once no more certificate is found */
+	if (pem) {
+		unsigned long error = ERR_peek_last_error();
+
+		if (ERR_GET_LIB(error) != ERR_LIB_PEM ||
+		    ERR_GET_REASON(error) != PEM_R_NO_START_LINE)
+			goto out;
+
+		ERR_clear_error();
+	} else if (data != end)
+		goto out;
+
+	if (!sk_X509_num(certs))
+		goto out;
+
+	unsigned int nr_cert = sk_X509_num(certs);
+
+	bundle = malloc(sizeof(*bundle) + nr_cert * sizeof(X509 *));
+	if (!bundle)
+		goto out;
+
+	bundle->refs = 1;
+	bundle->nr_cert = nr_cert;
+	for (unsigned int i = 0; i < nr_cert; ++i)
+		bundle->certs[i] = sk_X509_value(certs, i);
+
+	sk_X509_free(certs);
+	certs = NULL;
+
+out:
+	if (!bundle) {
+		err("Failed to parse the X.509 certificate %s\n", path);
+		ERR_print_errors_fp(stderr);
+	}
+
+	sk_X509_pop_free(certs, X509_free);
+	BIO_free(bio);
+
+	return bundle;
+}
+
+static const keystore_type_t bundle_type = {
+	.parse = parse_bundle,
+	.up_ref = up_ref_bundle,
+	.free = free_bundle,
+};
+
+/*
+ * Return a reference to the first certificate in the file, shared by
+ * the process, which must be released with libsign_x509_unload().
+ */
 X509 *
 libsign_x509_load(const char *path)
 {
-	BIO *bio = BIO_new_file(path, "r");
-	if (!bio) {
-		err("Failed to open X.509 certificate %s\n", path);
+	x509_bundle_t *bundle = keystore_get(&bundle_type, path);
+	X509 *cert = NULL;
+
+	if (!bundle)
 		return NULL;
-	}
 
-	X509 *cert = PEM_read_bio_X509(bio, NULL, NULL, NULL);
-	BIO_free_all(bio);
-	if (!cert)
-		err("Failed to parse PEM-encoded X.509 certificate %s\n",
-		    path);
+	if (X509_up_ref(bundle->certs[0]))
+		cert = bundle->certs[0];
+
+	free_bundle(bundle);
 
 	return cert;
 }
 
+/*
+ * Return the references to all certificates in the file in order, each
+ * to be released with libsign_x509_unload(). Fail if there are more
+ * than max_cert of them.
+ */
+int
+libsign_x509_load_bundle(const char *path, X509 **certs,
+			 unsigned int max_cert, unsigned int *nr_cert)
+{
+	x509_bundle_t *bundle = keystore_get(&bundle_type, path);
+
+	if (!bundle)
+		return EXIT_FAILURE;
+
+	if (bundle->nr_cert > max_cert) {
+		err("Too many certificates in %s\n", path);
+		free_bundle(bundle);
+		return EXIT_FAILURE;
+	}
+
+	unsigned int i;
+
+	for (i = 0; i < bundle->nr_cert; ++i) {
+		if (!X509_up_ref(bundle->certs[i]))
+			break;
+
+		certs[i] = bundle->certs[i];
+	}
+
+	if (i < bundle->nr_cert) {
+		while (i--)
+			X509_free(certs[i]);
+
+		free_bundle(bundle);
+		return EXIT_FAILURE;
+	}
+
+	*nr_cert = bundle->nr_cert;
+	free_bundle(bundle);
+
+	return EXIT_SUCCESS;
+}
+
 void
 libsign_x509_unload(X509 *cert)
 {
-
+	X509_free(cert);
 }
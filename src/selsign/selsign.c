@@ -42,10 +42,6 @@
 #  define SELSIGN_CERT		"/etc/keys/SEL_x509.pem"
 #endif
 
-#ifndef SELSIGN_CA_CERT
-#  define SELSIGN_CA_CERT	"/etc/keys/SEL_ca_x509.pem"
-#endif
-
 static void
 show_banner(void)
 {
@@ -61,28 +57,96 @@ static void
 show_usage(const char *prog)
 {
 	info_cont("Usage: %s [options] --key <key_file> --cert <cert_file> "
-		  "<signed_file>\n"
+		  "<signed_file>...\n"
 		  "Sign a file for use with SELoader.\n\n"
 		  "Required arguments:\n"
-		  "    --key <key_file>      Signing key (PEM-encoded RSA "
-					    "private key)\n"
+		  "    --key <key_file>      Signing key (PEM-encoded or "
+					    "DER-encoded RSA, ECDSA\n"
+		  "                          P-256/P-384 or Ed25519 private "
+					    "key), or the\n"
+		  "                          pkcs11: URI of the key on a "
+					    "token, with the module and\n"
+		  "                          PIN taken from the URI or "
+					    "LIBSIGN_PKCS11_MODULE and\n"
+		  "                          LIBSIGN_PKCS11_PIN\n"
 		  "    --cert <cert_file>    Certificate corresponding to the "
-					    "signing key (PEM-encoded X.509 "
-					    "certificate)\n"
-		  "    <signed_file>         The file to be signed\n"
+					    "signing key\n"
+		  "                          (PEM-encoded or DER-encoded "
+					    "X.509 certificate),\n"
+		  "                          optionally followed by the "
+					    "certificate chain\n"
+		  "    <signed_file>         The file to be signed. More than "
+					    "one file may be specified\n"
 		  "Options:\n"
-		  "    --ca <cert_file>      CA certificate in certificate "
-					    "chain (PEM-encoded X.509 "
-					    "certificate)\n"
-		  "                          This option may be specified "
-					    "multiple times\n"
+		  "    --ca <cert_file>      CA certificates in the certificate "
+					    "chain (PEM-encoded or\n"
+		  "                          DER-encoded X.509 certificates), "
+					    "following those of\n"
+		  "                          --cert. This option may be "
+					    "specified multiple times\n"
+		  "    --cipher-alg <alg>    Fail unless the signing key is "
+					    "of <alg> (rsa, ecdsa-p256,\n"
+		  "                          ecdsa-p384 or ed25519)\n"
+		  "                          Default any of them\n"
 		  "    --detached-signature  Generate the detached signature "
 					    "(.p7s)\n"
 		  "    --content-attached    Content the signed content in "
 					    "the signature (.p7a)\n"
+		  "    --files-from <list>   Sign the files listed in <list>, "
+					    "one path per line, instead\n"
+		  "                          of <signed_file>. Read the list "
+					    "from stdin if <list> is -\n"
 		  "    --output <sig_file>   Write the signature to <sig_file> "
 					    "(DER-encoded PKCS#7 signature)\n"
-		  "                          Default <signed_file>.p7b\n",
+		  "                          Default <signed_file>.p7b. Only "
+					    "allowed for a single <signed_file>\n"
+		  "    --durability <policy> Durability of the signature files "
+					    "(none, batch or file)\n"
+		  "                          Default batch\n"
+		  "    --journal <file>      Record the signed files in "
+					    "<file>, and skip the files\n"
+		  "                          recorded with the same device, "
+					    "inode, size and mtime\n"
+		  "                          when run again, so that an "
+					    "interrupted run is resumed\n"
+		  "    --digest-backend <backend>\n"
+		  "                          Calculate the digest with openssl, "
+					    "or the experimental\n"
+		  "                          af_alg (kernel crypto API)\n"
+		  "                          Default openssl\n"
+		  "    --extra-digest <alg>  Also save the digest of "
+					    "<signed_file> to <signed_file>.<alg>\n"
+		  "                          (sha1, sha224, sha256, sha384 or "
+					    "sha512), calculated in the\n"
+		  "                          same pass. This option may be "
+					    "specified multiple times\n"
+		  "    --io-policy <policy>  Read the signed file via the page "
+					    "cache (buffered), with the\n"
+		  "                          readahead ahead of the hasher "
+					    "(readahead) or bypassing the\n"
+		  "                          page cache (direct)\n"
+		  "                          Default buffered\n"
+		  "    -j, --jobs <N>        Sign <N> files concurrently\n"
+		  "                          Default 1, or the number of CPUs "
+					    "if the jobserver of\n"
+		  "                          make is available, with each "
+					    "extra worker taking\n"
+		  "                          a job slot of make\n"
+		  "    --processes <N>       Sign the files with <N> forked "
+					    "worker processes instead\n"
+		  "                          of the threads\n"
+		  "    --placement <policy>  Place the workers on the CPUs "
+					    "in turn (compact), on the\n"
+		  "                          CPUs of the NUMA nodes in turn "
+					    "(scatter), on the nodes\n"
+		  "                          in turn (numa), or leave them "
+					    "to the scheduler (none)\n"
+		  "                          Default none\n"
+		  "    --memory-limit <size> Hold at most <size> bytes of the "
+					    "signed files in memory\n"
+		  "                          at once, with an optional K, M "
+					    "or G suffix\n"
+		  "                          Default unlimited\n",
 		  prog);
 }
 
@@ -95,18 +159,172 @@ show_version(void)
 static int opt_quite;
 static char *opt_key = SELSIGN_KEY;
 static char *opt_cert = SELSIGN_CERT;
-static char *opt_ca_cert = SELSIGN_CA_CERT;
+/* The signer certificate followed by the CA certificates */
+static const char *opt_certs[SIGNLET_MAX_NR_CERT + 1];
+static unsigned int nr_ca_cert;
 static char *opt_digest_alg = "sha256";
-static char *opt_cipher_alg = "rsa";
+static LIBSIGN_CIPHER_ALG opt_cipher_alg = LIBSIGN_CIPHER_ALG_NONE;
 static char *opt_output;
-static char *opt_signed_file;
+static const char **opt_signed_files;
+static char *opt_files_from;
+static char *opt_journal;
+static unsigned int opt_jobs;
+static unsigned int opt_processes;
+static uint64_t opt_memory_limit;
+static LIBSIGN_PLACEMENT opt_placement = LIBSIGN_PLACEMENT_NONE;
 static bool opt_detached_signature = false;
 static bool opt_attached_content = false;
+static LIBSIGN_DURABILITY opt_durability = LIBSIGN_DURABILITY_BATCH;
+static LIBSIGN_DIGEST_ALG opt_extra_digest_algs[LIBSIGN_DIGEST_ALG_MAX];
+static unsigned int nr_extra_digest_alg;
+
+/* The long options without the short form */
+enum {
+	OPT_DURABILITY = 256,
+	OPT_DIGEST_BACKEND,
+	OPT_EXTRA_DIGEST,
+	OPT_IO_POLICY,
+	OPT_PROCESSES,
+	OPT_MEMORY_LIMIT,
+	OPT_PLACEMENT,
+	OPT_FILES_FROM,
+	OPT_JOURNAL,
+};
+
+static int
+parse_memory_limit(const char *limit)
+{
+	char *end;
+	unsigned long long size = strtoull(limit, &end, 0);
+	unsigned int shift = 0;
+
+	switch (*end) {
+	case 'G':
+		shift += 10;
+		/* Fall through */
+	case 'M':
+		shift += 10;
+		/* Fall through */
+	case 'K':
+		shift += 10;
+		++end;
+		break;
+	}
+
+	if (*end || !size || size > (UINT64_MAX >> shift)) {
+		err("Invalid memory limit %s\n", limit);
+		return EXIT_FAILURE;
+	}
+
+	opt_memory_limit = (uint64_t)size << shift;
+
+	return EXIT_SUCCESS;
+}
+
+static int
+parse_durability(const char *policy)
+{
+	if (!strcmp(policy, "none"))
+		opt_durability = LIBSIGN_DURABILITY_NONE;
+	else if (!strcmp(policy, "batch"))
+		opt_durability = LIBSIGN_DURABILITY_BATCH;
+	else if (!strcmp(policy, "file"))
+		opt_durability = LIBSIGN_DURABILITY_FILE;
+	else {
+		err("Unrecognized durability policy %s\n", policy);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+static int
+parse_placement(const char *policy)
+{
+	if (!strcmp(policy, "none"))
+		opt_placement = LIBSIGN_PLACEMENT_NONE;
+	else if (!strcmp(policy, "compact"))
+		opt_placement = LIBSIGN_PLACEMENT_COMPACT;
+	else if (!strcmp(policy, "scatter"))
+		opt_placement = LIBSIGN_PLACEMENT_SCATTER;
+	else if (!strcmp(policy, "numa"))
+		opt_placement = LIBSIGN_PLACEMENT_NUMA;
+	else {
+		err("Unrecognized placement policy %s\n", policy);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+static int
+parse_digest_backend(const char *backend)
+{
+	LIBSIGN_DIGEST_BACKEND digest_backend;
+
+	if (!strcmp(backend, "openssl"))
+		digest_backend = LIBSIGN_DIGEST_BACKEND_OPENSSL;
+	else if (!strcmp(backend, "af_alg")) {
+		warn("The digest backend af_alg is experimental\n");
+		digest_backend = LIBSIGN_DIGEST_BACKEND_AF_ALG;
+	} else {
+		err("Unrecognized digest backend %s\n", backend);
+		return EXIT_FAILURE;
+	}
+
+	/* The self test is run before switching the backend */
+	if (libsign_digest_set_backend(digest_backend)) {
+		err("Failed to use the digest backend %s\n", backend);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+static int
+parse_io_policy(const char *policy)
+{
+	LIBSIGN_IO_POLICY io_policy;
+
+	if (!strcmp(policy, "buffered"))
+		io_policy = LIBSIGN_IO_POLICY_BUFFERED;
+	else if (!strcmp(policy, "readahead"))
+		io_policy = LIBSIGN_IO_POLICY_READAHEAD;
+	else if (!strcmp(policy, "direct"))
+		io_policy = LIBSIGN_IO_POLICY_DIRECT;
+	else {
+		err("Unrecognized I/O policy %s\n", policy);
+		return EXIT_FAILURE;
+	}
+
+	return libsign_io_set_policy(io_policy);
+}
+
+static int
+parse_extra_digest(const char *name)
+{
+	LIBSIGN_DIGEST_ALG digest_alg = libsign_digest_alg_from_name(name);
+
+	if (digest_alg == LIBSIGN_DIGEST_ALG_NONE) {
+		err("Unrecognized digest algorithm %s\n", name);
+		return EXIT_FAILURE;
+	}
+
+	for (unsigned int i = 0; i < nr_extra_digest_alg; ++i) {
+		if (opt_extra_digest_algs[i] == digest_alg)
+			return EXIT_SUCCESS;
+	}
+
+	/* The list is always terminated by LIBSIGN_DIGEST_ALG_NONE */
+	opt_extra_digest_algs[nr_extra_digest_alg++] = digest_alg;
+
+	return EXIT_SUCCESS;
+}
 
 static int
 parse_options(int argc, char *argv[])
 {
-	char opts[] = "hVvqk:c:C:S:S:o:da";
+	char opts[] = "hVvqk:c:C:S:S:o:daj:";
 	struct option long_opts[] = {
 		{ "help", no_argument, NULL, 'h' },
 		{ "version", no_argument, NULL, 'V' },
@@ -120,6 +338,17 @@ parse_options(int argc, char *argv[])
 		{ "detached-signature", no_argument, NULL, 'd' },
 		{ "content-attached", no_argument, NULL, 'a' },
 		{ "output", required_argument, NULL, 'o' },
+		{ "jobs", required_argument, NULL, 'j' },
+		{ "durability", required_argument, NULL, OPT_DURABILITY },
+		{ "digest-backend", required_argument, NULL,
+		  OPT_DIGEST_BACKEND },
+		{ "extra-digest", required_argument, NULL, OPT_EXTRA_DIGEST },
+		{ "io-policy", required_argument, NULL, OPT_IO_POLICY },
+		{ "processes", required_argument, NULL, OPT_PROCESSES },
+		{ "memory-limit", required_argument, NULL, OPT_MEMORY_LIMIT },
+		{ "placement", required_argument, NULL, OPT_PLACEMENT },
+		{ "files-from", required_argument, NULL, OPT_FILES_FROM },
+		{ "journal", required_argument, NULL, OPT_JOURNAL },
 		{ NULL },	/* NULL terminated */
 	};
 
@@ -150,13 +379,23 @@ parse_options(int argc, char *argv[])
 			opt_cert = optarg;
 			break;
 		case 'C':
-			opt_ca_cert = optarg;
+			if (nr_ca_cert == SIGNLET_MAX_NR_CERT - 1) {
+				err("Too many CA certificates specified\n");
+				return EXIT_FAILURE;
+			}
+
+			opt_certs[++nr_ca_cert] = optarg;
 			break;
 		case 'D':
 			opt_digest_alg = optarg;
 			break;
 		case 'S':
-			opt_cipher_alg = optarg;
+			opt_cipher_alg = libsign_cipher_alg_from_name(optarg);
+			if (opt_cipher_alg == LIBSIGN_CIPHER_ALG_NONE) {
+				err("Unrecognized cipher algorithm %s\n",
+				    optarg);
+				return EXIT_FAILURE;
+			}
 			break;
 		case 'd':
 			opt_detached_signature = true;
@@ -167,6 +406,61 @@ parse_options(int argc, char *argv[])
 		case 'o':
 			opt_output = optarg;
 			break;
+		case 'j': {
+			char *end;
+			unsigned long jobs = strtoul(optarg, &end, 0);
+
+			if (*end || !jobs || jobs > UINT_MAX) {
+				err("Invalid number of jobs %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+
+			opt_jobs = jobs;
+			break;
+		}
+		case OPT_DURABILITY:
+			if (parse_durability(optarg))
+				return EXIT_FAILURE;
+			break;
+		case OPT_DIGEST_BACKEND:
+			if (parse_digest_backend(optarg))
+				return EXIT_FAILURE;
+			break;
+		case OPT_EXTRA_DIGEST:
+			if (parse_extra_digest(optarg))
+				return EXIT_FAILURE;
+			break;
+		case OPT_IO_POLICY:
+			if (parse_io_policy(optarg))
+				return EXIT_FAILURE;
+			break;
+		case OPT_PROCESSES: {
+			char *end;
+			unsigned long processes = strtoul(optarg, &end, 0);
+
+			if (*end || !processes || processes > UINT_MAX) {
+				err("Invalid number of processes %s\n",
+				    optarg);
+				return EXIT_FAILURE;
+			}
+
+			opt_processes = processes;
+			break;
+		}
+		case OPT_MEMORY_LIMIT:
+			if (parse_memory_limit(optarg))
+				return EXIT_FAILURE;
+			break;
+		case OPT_PLACEMENT:
+			if (parse_placement(optarg))
+				return EXIT_FAILURE;
+			break;
+		case OPT_FILES_FROM:
+			opt_files_from = optarg;
+			break;
+		case OPT_JOURNAL:
+			opt_journal = optarg;
+			break;
 		case '?':
 		default:
 			err("Unrecognized option\n");
@@ -187,19 +481,48 @@ parse_options(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
+	if (opt_files_from) {
+		if (argc != optind || opt_output) {
+			err("Neither <signed_file> nor the output file can be "
+			    "specified with --files-from\n");
+			return EXIT_FAILURE;
+		}
+
+		return EXIT_SUCCESS;
+	}
+
 	/* <signed_file> is not specified */
-	if (argc != optind + 1) {
+	if (argc < optind + 1) {
 		show_usage(argv[0]);
 		return EXIT_FAILURE;
 	}
 
-	opt_signed_file = argv[optind];
-	if (!opt_signed_file || !opt_signed_file[0]) {
-		err("Invalid path of signed file specified\n");
-		show_usage(argv[0]);
+	/* argv[] is terminated by NULL */
+	opt_signed_files = (const char **)argv + optind;
+	for (int i = optind; i < argc; ++i) {
+		if (!argv[i][0]) {
+			err("Invalid path of signed file specified\n");
+			show_usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (opt_output && argc != optind + 1) {
+		err("The output file cannot be specified for multiple "
+		    "signed files\n");
 		return EXIT_FAILURE;
 	}
 
+	if (!opt_jobs) {
+		long nr_cpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+		/* Scale with the free job slots of make */
+		if (libsign_jobserver_available() && nr_cpu > 1)
+			opt_jobs = nr_cpu;
+		else
+			opt_jobs = 1;
+	}
+
 	if (opt_detached_signature == true &&
 	    opt_attached_content == true) {
 		err("Invalid signature format specified\n");
@@ -216,6 +539,41 @@ parse_options(int argc, char *argv[])
 	return EXIT_SUCCESS;
 }
 
+static char *files_from_line;
+static size_t files_from_size;
+
+/*
+ * Stream the signed files from the list, so that a list of any length
+ * is signed in constant memory.
+ */
+static int
+next_listed_file(void *data, const char **signed_file,
+		 const char **output_file)
+{
+	FILE *fp = data;
+	ssize_t len;
+
+	while ((len = getline(&files_from_line, &files_from_size, fp)) >= 0) {
+		if (len && files_from_line[len - 1] == '\n')
+			files_from_line[--len] = '\0';
+
+		/* Skip the empty lines */
+		if (len) {
+			*signed_file = files_from_line;
+			return EXIT_SUCCESS;
+		}
+	}
+
+	if (ferror(fp)) {
+		err("Failed to read the list of signed files\n");
+		return EXIT_FAILURE;
+	}
+
+	*signed_file = NULL;
+
+	return EXIT_SUCCESS;
+}
+
 static void
 exit_notify(void)
 {
@@ -244,37 +602,72 @@ main(int argc, char **argv)
 	} else
 		flags |= SIGNLET_FLAGS_DETACHED_SIGNATURE;
 
-	const char *signed_file_list[] = {
-		opt_signed_file,
-		NULL
-	};
-	const char *cert_list[] = {
-		opt_cert,
+	const char *output_file_list[] = {
+		opt_output,
 		NULL
 	};
+	opt_certs[0] = opt_cert;
 	const char *id = "SELoader";
 	signlet_request_t request = {
 		.siglet = id,
-		.signed_file_list = signed_file_list,
-		.output_file_list = NULL,
+		.signed_file_list = opt_signed_files,
+		.output_file_list = opt_output ? output_file_list : NULL,
 		.key = opt_key,
-		.cert_list = cert_list,
+		.cert_list = opt_certs,
 		.digest_alg = LIBSIGN_DIGEST_ALG_SHA256,
-		.cipher_alg = LIBSIGN_CIPHER_ALG_RSA,
+		.cipher_alg = opt_cipher_alg,
 		.flags = flags,
+		.durability = opt_durability,
+		.extra_digest_algs = opt_extra_digest_algs,
+		.jobs = opt_jobs,
+		.processes = opt_processes,
+		.placement = opt_placement,
+		.memory_limit = opt_memory_limit,
+		.journal = opt_journal,
 	};
 
-	rc = signlet_request(&request);
-	if (rc)
-		return rc;
+	FILE *files_from = NULL;
 
-	rc = signlet_wait(id);
-	if (rc) {
-		signlet_cancel(id);
-		return rc;
+	if (opt_files_from) {
+		if (strcmp(opt_files_from, "-"))
+			files_from = fopen(opt_files_from, "re");
+		else
+			files_from = stdin;
+
+		if (!files_from) {
+			err("Failed to open the list of signed files %s\n",
+			    opt_files_from);
+			return EXIT_FAILURE;
+		}
+
+		request.signed_file_list = NULL;
+		request.next_file = next_listed_file;
+		request.next_file_data = files_from;
 	}
 
-	signlet_finish(id);
+	const char *job_id;
 
-	return EXIT_SUCCESS;
+	rc = signlet_request(&request, &job_id);
+	if (rc)
+		goto out;
+
+	rc = signlet_wait(job_id);
+
+	uint64_t peak;
+
+	if ((opt_memory_limit || libsign_utils_verbose()) &&
+	    !signlet_memory_peak(job_id, &peak))
+		info("Peak file data in memory: %llu bytes\n",
+		     (unsigned long long)peak);
+
+	signlet_finish(job_id);
+
+out:
+	if (files_from && files_from != stdin)
+		fclose(files_from);
+	free(files_from_line);
+
+	libsign_fini();
+
+	return rc;
 }
@@ -39,28 +39,29 @@
 
 #define SELoader_signaturelet_id		"SELoader"
 
+/*
+ * BIO_write() takes an int length, so split the large content.
+ */
 static int
-construct_sel_signature(uint8_t *sig_content, unsigned sig_content_size,
-			unsigned long flags, BIO **out_signed_data)
+bio_write_all(BIO *bio, const uint8_t *data, size_t data_size)
 {
-	BIO *signed_data;
-
-	signed_data = BIO_new(BIO_s_mem());
-	if (!signed_data)
-		return EXIT_FAILURE;
+	while (data_size) {
+		int len = data_size > INT_MAX ? INT_MAX : (int)data_size;
 
-	BIO *tag_directory;
+		if (BIO_write(bio, data, len) != len)
+			return EXIT_FAILURE;
 
-	tag_directory = BIO_new(BIO_s_mem());
-	if (!signed_data)
-		return EXIT_FAILURE;
-
-	BIO *payload;
+		data += len;
+		data_size -= len;
+	}
 
-	payload = BIO_new(BIO_s_mem());
-	if (!signed_data)
-		return EXIT_FAILURE;
+	return EXIT_SUCCESS;
+}
 
+static int
+construct_sel_signature(uint8_t *sig_content, size_t sig_content_size,
+			unsigned long flags, BIO **out_signed_data)
+{
 	SEL_SIGNATURE_HEADER header;
 
 	memcpy((char *)&header.Magic, SelSigantureMagic,
@@ -69,59 +70,71 @@ construct_sel_signature(uint8_t *sig_content, unsigned sig_content_size,
 	header.HeaderSize = sizeof(header);
 	header.Flags = 0;
 
+	SEL_SIGNATURE_TAG tags[2];
+	SEL_SIGNATURE_TAG_HASH_ALGORITHM hash_alg;
 	unsigned int nr_tag = 0;
-	unsigned int payload_size = 0;
+	uint32_t payload_size = 0;
 
 	if (!(flags & SIGNLET_FLAGS_CONTENT_ATTACHED)) {
-		SEL_SIGNATURE_TAG hash_alg_tag;
+		SEL_SIGNATURE_TAG *hash_alg_tag = tags + nr_tag++;
 
-		hash_alg_tag.Tag = SelSignatureTagHashAlgorithm;
-		hash_alg_tag.Revision = 0;
-		hash_alg_tag.Reserved = 0;
-		hash_alg_tag.Flags = 0;
-		hash_alg_tag.DataOffset = payload_size;
-		hash_alg_tag.DataSize = sizeof(SEL_SIGNATURE_TAG_HASH_ALGORITHM);
-		BIO_write(tag_directory, &hash_alg_tag, sizeof(hash_alg_tag));
-		++nr_tag;
-
-		SEL_SIGNATURE_TAG_HASH_ALGORITHM hash_alg;
+		hash_alg_tag->Tag = SelSignatureTagHashAlgorithm;
+		hash_alg_tag->Revision = 0;
+		hash_alg_tag->Reserved = 0;
+		hash_alg_tag->Flags = 0;
+		hash_alg_tag->DataOffset = payload_size;
+		hash_alg_tag->DataSize = sizeof(SEL_SIGNATURE_TAG_HASH_ALGORITHM);
 
 		hash_alg.Algorithm = SelHashAlgorithmSha256;
-		BIO_write(payload, &hash_alg, sizeof(hash_alg));
 
-		payload_size += hash_alg_tag.DataSize;
+		payload_size += hash_alg_tag->DataSize;
 	}
 
-	SEL_SIGNATURE_TAG content_tag;
+	/* The size of payload is 32-bit in SELoader signature */
+	if (sig_content_size > UINT32_MAX - payload_size) {
+		err("The signed content (%zu-byte) is too large for SELoader "
+		    "signature\n", sig_content_size);
+		return EXIT_FAILURE;
+	}
 
-	content_tag.Tag = SelSignatureTagContent;
-	content_tag.Revision = 0;
-	content_tag.Reserved = 0;
-	content_tag.Flags = 0;
-	content_tag.DataOffset = payload_size;
-	content_tag.DataSize = sig_content_size;
-	BIO_write(tag_directory, &content_tag, sizeof(content_tag));
-	++nr_tag;
+	SEL_SIGNATURE_TAG *content_tag = tags + nr_tag++;
 
-	BIO_write(payload, sig_content, sig_content_size);
-	payload_size += content_tag.DataSize;
+	content_tag->Tag = SelSignatureTagContent;
+	content_tag->Revision = 0;
+	content_tag->Reserved = 0;
+	content_tag->Flags = 0;
+	content_tag->DataOffset = payload_size;
+	content_tag->DataSize = sig_content_size;
+
+	payload_size += content_tag->DataSize;
 
 	header.TagDirectorySize = nr_tag * sizeof(SEL_SIGNATURE_TAG);
 	header.NumberOfTag = nr_tag;
 	header.PayloadSize = payload_size;
 
-	BIO_write(signed_data, &header, header.HeaderSize);
+	BIO *signed_data;
 
-	char *write_data;
-	long write_len;
+	signed_data = BIO_new(BIO_s_mem());
+	if (!signed_data)
+		return EXIT_FAILURE;
+
+	/* The payload is written without the intermediate copy */
+	if (bio_write_all(signed_data, (uint8_t *)&header, header.HeaderSize))
+		goto err;
+
+	if (bio_write_all(signed_data, (uint8_t *)tags,
+			  header.TagDirectorySize))
+		goto err;
 
-	write_len = BIO_get_mem_data(tag_directory, &write_data);
-	BIO_write(signed_data, write_data, write_len);
-	BIO_free(tag_directory);
+	if (!(flags & SIGNLET_FLAGS_CONTENT_ATTACHED) &&
+	    bio_write_all(signed_data, (uint8_t *)&hash_alg, sizeof(hash_alg)))
+		goto err;
 
-	write_len = BIO_get_mem_data(payload, &write_data);
-	BIO_write(signed_data, write_data, write_len);
-	BIO_free(payload);
+	if (bio_write_all(signed_data, sig_content, sig_content_size))
+		goto err;
+
+	char *write_data;
+	long write_len;
 
 	write_len = BIO_get_mem_data(signed_data, &write_data);
 	libsign_utils_hex_dump("SELoader signature", (uint8_t *)write_data,
@@ -130,94 +143,205 @@ construct_sel_signature(uint8_t *sig_content, unsigned sig_content_size,
 	*out_signed_data = signed_data;
 
 	return EXIT_SUCCESS;
+err:
+	BIO_free(signed_data);
+
+	return EXIT_FAILURE;
 }
 
+/*
+ * PKCS7_sign() doesn't support EdDSA, so the signed data is built here
+ * the way of RFC 8419 for CMS: the content is digested with SHA-512 and
+ * the authenticated attributes are signed with pure Ed25519. The content
+ * attached is limited to int by ASN1_OCTET_STRING_set().
+ */
 static int
-SELoader_sign(libsign_signaturelet_t *siglet, uint8_t *data,
-	      unsigned int data_size, const char *key, const char **cert_list,
-	      unsigned int nr_cert, uint8_t **out_sig,
-	      unsigned int *out_sig_size, unsigned long flags)
+pkcs7_sign_eddsa(const uint8_t *content, size_t content_size,
+		 int sign_flags, EVP_PKEY *key, X509 **cert_list,
+		 unsigned int nr_cert, uint8_t **out_sig,
+		 size_t *out_sig_size)
 {
-	EVP_PKEY *privkey;
+	X509 *cert = cert_list[0];
+	bool attached = !(sign_flags & PKCS7_DETACHED);
 
-	privkey = libsign_key_load(key);
-	if (!privkey) {
-		err("Failed to load the private key %s\n", key);
+	if (attached && content_size > INT_MAX) {
+		err("The signed content (%zu-byte) is too large for Ed25519 "
+		    "signature\n", content_size);
 		return EXIT_FAILURE;
 	}
 
-	X509 *x509_certs[nr_cert];
-	int i = 0;
+	uint8_t digest[EVP_MAX_MD_SIZE];
+	unsigned int digest_size;
 
-	for (i = 0; i < (int)nr_cert; ++i) {
-		x509_certs[i] = libsign_x509_load(cert_list[i]);
-		if (!x509_certs[i]) {
-			err("Failed to load the X.509 certificate %s\n",
-			    cert_list[i]);
-			goto err;
-		}
+	if (!EVP_Digest(content, content_size, digest, &digest_size,
+			EVP_sha512(), NULL)) {
+		ERR_print_errors_fp(stderr);
+		return EXIT_FAILURE;
 	}
 
-	int sign_flags;
-	BIO *signed_data;
-	unsigned int sig_content_size;
+	PKCS7 *pkcs7 = PKCS7_new();
+	PKCS7_SIGNER_INFO *si = PKCS7_SIGNER_INFO_new();
+	EVP_MD_CTX *md_ctx = EVP_MD_CTX_new();
+	uint8_t *attrs = NULL;
+	uint8_t *sig = NULL;
+	int rc = EXIT_FAILURE;
 
-	if (!(flags & SIGNLET_FLAGS_DETACHED_SIGNATURE)) {
-		uint8_t *sig_content;
-		uint8_t *digest = NULL;
-		int rc;
+	if (!pkcs7 || !si || !md_ctx)
+		goto out;
 
-		if (!(flags & SIGNLET_FLAGS_CONTENT_ATTACHED)) {
-			rc = libsign_digest_calculate(siglet->digest_alg, data,
-						      data_size, &digest);
-			if (rc)
-				goto err;
+	if (!PKCS7_set_type(pkcs7, NID_pkcs7_signed) ||
+	    !PKCS7_content_new(pkcs7, NID_pkcs7_data))
+		goto out;
 
-			unsigned int digest_size;
+	/* The signer certificate comes first as PKCS7_sign() does */
+	for (unsigned int i = 0; i < nr_cert; ++i) {
+		if (!PKCS7_add_certificate(pkcs7, cert_list[i]))
+			goto out;
+	}
 
-			libsign_digest_size(siglet->digest_alg, &digest_size);
+	if (attached) {
+		if (!ASN1_OCTET_STRING_set(pkcs7->d.sign->contents->d.data,
+					   content, (int)content_size))
+			goto out;
+	} else if (!PKCS7_set_detached(pkcs7, 1))
+		goto out;
 
-			libsign_utils_hex_dump("Hash of signed content",
-					       digest, digest_size);
+	ASN1_INTEGER *serial = ASN1_INTEGER_dup(X509_get0_serialNumber(cert));
+	if (!serial)
+		goto out;
 
-			sig_content = digest;
-			sig_content_size = digest_size;
-		} else {
-			sig_content = data;
-			sig_content_size = data_size;
-		}
+	ASN1_INTEGER_free(si->issuer_and_serial->serial);
+	si->issuer_and_serial->serial = serial;
 
-		rc = construct_sel_signature(sig_content, sig_content_size,
-					     flags, &signed_data);
-		free(digest);
-		if (rc)
-			goto err;
+	if (!ASN1_INTEGER_set(si->version, 1) ||
+	    !X509_NAME_set(&si->issuer_and_serial->issuer,
+			   X509_get_issuer_name(cert)) ||
+	    !X509_ALGOR_set0(si->digest_alg, OBJ_nid2obj(NID_sha512),
+			     V_ASN1_NULL, NULL) ||
+	    !X509_ALGOR_set0(si->digest_enc_alg, OBJ_nid2obj(NID_ED25519),
+			     V_ASN1_UNDEF, NULL))
+		goto out;
 
-		sig_content_size = BIO_ctrl_pending(signed_data);
-		sign_flags = PKCS7_BINARY;
-	} else {
-		signed_data = BIO_new_mem_buf(data, data_size);
-		if (!signed_data)
-			goto err;
+	if (!PKCS7_add_attrib_content_type(si, NULL) ||
+	    !PKCS7_add0_attrib_signing_time(si, NULL) ||
+	    !PKCS7_add1_attrib_digest(si, digest, digest_size))
+		goto out;
 
-		sign_flags = PKCS7_DETACHED;
-		sig_content_size = 0;
-	}
+	/* Encoded as SET OF, which also sorts the attributes of si */
+	int attrs_len = ASN1_item_i2d((ASN1_VALUE *)si->auth_attr, &attrs,
+				      ASN1_ITEM_rptr(PKCS7_ATTR_SIGN));
+	size_t sig_size;
 
-	/* XXX: support to use CA list */
-	PKCS7 *pkcs7 = PKCS7_sign(x509_certs[0], privkey, NULL,
-				  signed_data, sign_flags);
-	BIO_free(signed_data);
-	while (--i >= 0)
-		libsign_x509_unload(x509_certs[i]);
-	libsign_key_unload(privkey);
+	if (attrs_len <= 0 ||
+	    EVP_DigestSignInit(md_ctx, NULL, NULL, NULL, key) <= 0 ||
+	    EVP_DigestSign(md_ctx, NULL, &sig_size, attrs, attrs_len) <= 0)
+		goto out;
+
+	sig = OPENSSL_malloc(sig_size);
+	if (!sig || EVP_DigestSign(md_ctx, sig, &sig_size, attrs,
+				   attrs_len) <= 0)
+		goto out;
+
+	ASN1_STRING_set0(si->enc_digest, sig, (int)sig_size);
+	sig = NULL;
+
+	if (!PKCS7_add_signer(pkcs7, si))
+		goto out;
+	si = NULL;
+
+	int der_len = i2d_PKCS7(pkcs7, NULL);
+	if (der_len <= 0)
+		goto out;
+
+	uint8_t *der = malloc(der_len);
+	if (!der)
+		goto out;
+
+	*out_sig = der;
+	*out_sig_size = der_len;
+	i2d_PKCS7(pkcs7, &der);
+	rc = EXIT_SUCCESS;
+
+out:
+	if (rc)
+		ERR_print_errors_fp(stderr);
+	OPENSSL_free(sig);
+	OPENSSL_free(attrs);
+	EVP_MD_CTX_free(md_ctx);
+	PKCS7_SIGNER_INFO_free(si);
+	PKCS7_free(pkcs7);
+
+	return rc;
+}
+
+/*
+ * Sign with the full PKCS7_sign(), which builds everything from scratch.
+ * The certificates following the signer certificate are its chain.
+ */
+static int
+pkcs7_sign_full(const uint8_t *content, size_t content_size, int sign_flags,
+		EVP_PKEY *key, X509 **cert_list, unsigned int nr_cert,
+		uint8_t **out_sig, size_t *out_sig_size)
+{
+	if (EVP_PKEY_base_id(key) == EVP_PKEY_ED25519)
+		return pkcs7_sign_eddsa(content, content_size, sign_flags,
+					key, cert_list, nr_cert, out_sig,
+					out_sig_size);
+
+	STACK_OF(X509) *chain = NULL;
+
+	if (nr_cert > 1) {
+		chain = sk_X509_new_null();
+		if (!chain)
+			return EXIT_FAILURE;
+
+		for (unsigned int i = 1; i < nr_cert; ++i) {
+			if (!sk_X509_push(chain, cert_list[i])) {
+				sk_X509_free(chain);
+				return EXIT_FAILURE;
+			}
+		}
+	}
 
+	/*
+	 * The signed content is fed in pieces instead of through a memory
+	 * BIO, because the length of a memory BIO is limited to int.
+	 */
+	PKCS7 *pkcs7 = PKCS7_sign(cert_list[0], key, chain, NULL,
+				  sign_flags | PKCS7_PARTIAL);
+	sk_X509_free(chain);
 	if (!pkcs7) {
 		ERR_print_errors_fp(stderr);
 		return EXIT_FAILURE;
 	}
 
-	unsigned int sig_size = i2d_PKCS7(pkcs7, NULL);
+	BIO *p7bio = PKCS7_dataInit(pkcs7, NULL);
+	if (!p7bio) {
+		ERR_print_errors_fp(stderr);
+		PKCS7_free(pkcs7);
+		return EXIT_FAILURE;
+	}
+
+	int rc = bio_write_all(p7bio, content, content_size);
+	if (!rc) {
+		(void)BIO_flush(p7bio);
+		if (!PKCS7_dataFinal(pkcs7, p7bio))
+			rc = EXIT_FAILURE;
+	}
+	BIO_free_all(p7bio);
+
+	if (rc) {
+		ERR_print_errors_fp(stderr);
+		PKCS7_free(pkcs7);
+		return EXIT_FAILURE;
+	}
+
+	int sig_size = i2d_PKCS7(pkcs7, NULL);
+	if (sig_size <= 0) {
+		ERR_print_errors_fp(stderr);
+		PKCS7_free(pkcs7);
+		return EXIT_FAILURE;
+	}
 
 	uint8_t *tmp, *sig;
 	tmp = sig = malloc(sig_size);
@@ -232,21 +356,686 @@ SELoader_sign(libsign_signaturelet_t *siglet, uint8_t *data,
 	*out_sig = sig;
 	*out_sig_size = sig_size;
 
-	libsign_utils_hex_dump("Signature dump", sig, sig_size);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Only the message digest and the signing time in the authenticated
+ * attributes, and the signature over them, differ among the signatures
+ * made with the same key and certificate. So a signer session takes a
+ * template signature made by pkcs7_sign_full() once, and keeps its DER
+ * encoding split around these fields. The signature of a file is then
+ * assembled from the pieces, producing the same encoding as
+ * pkcs7_sign_full() would do.
+ */
+
+/* The sessions live as long as the signaturelet */
+#define SIGNER_SESSION_MAX		8
+
+#define DER_TAG_INTEGER			0x02
+#define DER_TAG_OCTET_STRING		0x04
+#define DER_TAG_OID			0x06
+#define DER_TAG_SEQUENCE		0x30
+#define DER_TAG_SET			0x31
+#define DER_TAG_CONTEXT_0		0xa0
+
+/* A part of the template */
+typedef struct {
+	size_t offset;
+	size_t len;
+} der_piece_t;
+
+typedef struct signer_session {
+	struct signer_session *next;
+	/* The references held by the session */
+	EVP_PKEY *key;
+	X509 *cert_list[SIGNLET_MAX_NR_CERT];
+	unsigned int nr_cert;
+	int sign_flags;
+	/* Set if the template cannot be used, so PKCS7_sign() is used */
+	bool failed;
+	const EVP_MD *md;
+	/* The digest of signing the attributes, or NULL for EdDSA */
+	const EVP_MD *sign_md;
+	uint8_t *der;
+	der_piece_t signed_data_oid;
+	/* The version and the digest algorithms of SignedData */
+	der_piece_t signed_data_prefix;
+	der_piece_t content_oid;
+	bool attached;
+	/* The certificates and CRLs */
+	der_piece_t certs;
+	/* The version, issuer and serial, and digest algorithm */
+	der_piece_t signer_info_prefix;
+	/* The content of the authenticated attributes */
+	der_piece_t attrs;
+	/* The values patched in the attributes, relative to them */
+	der_piece_t signing_time;
+	der_piece_t message_digest;
+	der_piece_t digest_enc_alg;
+} signer_session_t;
+
+static signer_session_t *signer_sessions;
+static unsigned int nr_signer_session;
+static pthread_mutex_t signer_session_lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct {
+	uint8_t tag;
+	/* The offsets of the tag, the value and the end of the value */
+	size_t offset;
+	size_t value;
+	size_t end;
+} der_tlv_t;
+
+static bool
+der_read(const uint8_t *der, size_t end, size_t offset, uint8_t tag,
+	 der_tlv_t *tlv)
+{
+	if (offset >= end || end - offset < 2 || der[offset] != tag)
+		return false;
+
+	size_t len = der[offset + 1];
+	size_t value = offset + 2;
+
+	if (len & 0x80) {
+		unsigned int nr = len & 0x7f;
+
+		if (!nr || nr > sizeof(size_t) || nr > end - value)
+			return false;
+
+		for (len = 0; nr; --nr)
+			len = (len << 8) | der[value++];
+	}
+
+	if (len > end - value)
+		return false;
+
+	tlv->tag = tag;
+	tlv->offset = offset;
+	tlv->value = value;
+	tlv->end = value + len;
+
+	return true;
+}
+
+static der_piece_t
+der_piece(size_t start, size_t end)
+{
+	der_piece_t piece = {
+		.offset = start,
+		.len = end - start,
+	};
+
+	return piece;
+}
+
+/* The size of the tag and the length */
+static size_t
+der_header_size(size_t len)
+{
+	size_t size = 2;
+
+	if (len < 0x80)
+		return size;
+
+	for (; len; len >>= 8)
+		++size;
+
+	return size;
+}
+
+static uint8_t *
+der_put_header(uint8_t *out, uint8_t tag, size_t len)
+{
+	size_t nr = der_header_size(len) - 2;
+
+	*out++ = tag;
+	if (!nr) {
+		*out++ = len;
+		return out;
+	}
+
+	*out++ = 0x80 | nr;
+	while (nr--)
+		*out++ = len >> (nr * 8);
+
+	return out;
+}
+
+static uint8_t *
+der_put_piece(uint8_t *out, const signer_session_t *session,
+	      const der_piece_t *piece)
+{
+	memcpy(out, session->der + piece->offset, piece->len);
+
+	return out + piece->len;
+}
+
+/*
+ * Locate the signing time and the message digest in the authenticated
+ * attributes.
+ */
+static bool
+parse_attrs(signer_session_t *session)
+{
+	static const uint8_t signing_time_oid[] = {
+		DER_TAG_OID, 9, 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01,
+		0x09, 0x05
+	};
+	static const uint8_t message_digest_oid[] = {
+		DER_TAG_OID, 9, 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01,
+		0x09, 0x04
+	};
+	const uint8_t *der = session->der;
+	size_t end = session->attrs.offset + session->attrs.len;
+	size_t offset = session->attrs.offset;
+
+	while (offset < end) {
+		der_tlv_t attr, oid, values, value;
+
+		if (!der_read(der, end, offset, DER_TAG_SEQUENCE, &attr) ||
+		    !der_read(der, attr.end, attr.value, DER_TAG_OID, &oid) ||
+		    !der_read(der, attr.end, oid.end, DER_TAG_SET, &values) ||
+		    values.value == values.end)
+			return false;
+
+		/* A single value */
+		if (!der_read(der, values.end, values.value, der[values.value],
+			      &value) || value.end != values.end)
+			return false;
+
+		size_t oid_len = oid.end - oid.offset;
+		der_piece_t piece = der_piece(value.offset - session->attrs.offset,
+					      value.end - session->attrs.offset);
+
+		if (oid_len == sizeof(signing_time_oid) &&
+		    !memcmp(der + oid.offset, signing_time_oid, oid_len))
+			session->signing_time = piece;
+		else if (oid_len == sizeof(message_digest_oid) &&
+			 !memcmp(der + oid.offset, message_digest_oid,
+				 oid_len)) {
+			/* Only the content of the octet string is patched */
+			if (!der_read(der, value.end, value.offset,
+				      DER_TAG_OCTET_STRING, &value) ||
+			    value.end - value.value !=
+			    (size_t)EVP_MD_get_size(session->md))
+				return false;
+
+			session->message_digest =
+				der_piece(value.value - session->attrs.offset,
+					  value.end - session->attrs.offset);
+		}
+
+		offset = attr.end;
+	}
+
+	return session->signing_time.len && session->message_digest.len;
+}
+
+/*
+ * Split the template into the pieces. Anything unexpected leaves the
+ * session to PKCS7_sign().
+ */
+static bool
+parse_template(signer_session_t *session, size_t der_len)
+{
+	const uint8_t *der = session->der;
+	der_tlv_t content_info, oid, explicit, signed_data, version,
+		  digest_algs, inner, signer_infos, signer_info, si_version,
+		  issuer, digest_alg, attrs, enc_alg, enc_digest;
+
+	if (!der_read(der, der_len, 0, DER_TAG_SEQUENCE, &content_info) ||
+	    content_info.end != der_len ||
+	    !der_read(der, content_info.end, content_info.value, DER_TAG_OID,
+		      &oid) ||
+	    !der_read(der, content_info.end, oid.end, DER_TAG_CONTEXT_0,
+		      &explicit) ||
+	    !der_read(der, explicit.end, explicit.value, DER_TAG_SEQUENCE,
+		      &signed_data) ||
+	    !der_read(der, signed_data.end, signed_data.value,
+		      DER_TAG_INTEGER, &version) ||
+	    !der_read(der, signed_data.end, version.end, DER_TAG_SET,
+		      &digest_algs) ||
+	    !der_read(der, signed_data.end, digest_algs.end,
+		      DER_TAG_SEQUENCE, &inner))
+		return false;
+
+	session->signed_data_oid = der_piece(oid.offset, oid.end);
+	session->signed_data_prefix = der_piece(version.offset,
+						digest_algs.end);
+
+	der_tlv_t content_oid;
+
+	if (!der_read(der, inner.end, inner.value, DER_TAG_OID,
+		      &content_oid))
+		return false;
+
+	session->content_oid = der_piece(content_oid.offset, content_oid.end);
+	session->attached = content_oid.end != inner.end;
+
+	/* The certificates and CRLs are up to the signer infos */
+	size_t offset = inner.end;
+
+	while (offset < signed_data.end && der[offset] != DER_TAG_SET) {
+		der_tlv_t skipped;
+
+		if (!der_read(der, signed_data.end, offset, der[offset],
+			      &skipped))
+			return false;
+
+		offset = skipped.end;
+	}
+
+	session->certs = der_piece(inner.end, offset);
+
+	/* A single signer without the unauthenticated attributes */
+	if (!der_read(der, signed_data.end, offset, DER_TAG_SET,
+		      &signer_infos) ||
+	    signer_infos.end != signed_data.end ||
+	    !der_read(der, signer_infos.end, signer_infos.value,
+		      DER_TAG_SEQUENCE, &signer_info) ||
+	    signer_info.end != signer_infos.end ||
+	    !der_read(der, signer_info.end, signer_info.value,
+		      DER_TAG_INTEGER, &si_version) ||
+	    !der_read(der, signer_info.end, si_version.end, DER_TAG_SEQUENCE,
+		      &issuer) ||
+	    !der_read(der, signer_info.end, issuer.end, DER_TAG_SEQUENCE,
+		      &digest_alg) ||
+	    !der_read(der, signer_info.end, digest_alg.end, DER_TAG_CONTEXT_0,
+		      &attrs) ||
+	    !der_read(der, signer_info.end, attrs.end, DER_TAG_SEQUENCE,
+		      &enc_alg) ||
+	    !der_read(der, signer_info.end, enc_alg.end,
+		      DER_TAG_OCTET_STRING, &enc_digest) ||
+	    enc_digest.end != signer_info.end)
+		return false;
+
+	session->signer_info_prefix = der_piece(si_version.offset,
+						digest_alg.end);
+	session->attrs = der_piece(attrs.value, attrs.end);
+	session->digest_enc_alg = der_piece(enc_alg.offset, enc_alg.end);
+
+	return parse_attrs(session);
+}
+
+static const EVP_MD *
+template_md(const uint8_t *der, size_t der_len)
+{
+	const EVP_MD *md = NULL;
+	PKCS7 *pkcs7 = d2i_PKCS7(NULL, &der, der_len);
+
+	if (!pkcs7)
+		return NULL;
+
+	STACK_OF(PKCS7_SIGNER_INFO) *signer_infos =
+		PKCS7_get_signer_info(pkcs7);
+
+	if (signer_infos && sk_PKCS7_SIGNER_INFO_num(signer_infos) == 1) {
+		PKCS7_SIGNER_INFO *si =
+			sk_PKCS7_SIGNER_INFO_value(signer_infos, 0);
+		const ASN1_OBJECT *obj;
+
+		X509_ALGOR_get0(&obj, NULL, NULL, si->digest_alg);
+		md = EVP_get_digestbyobj(obj);
+	}
+
+	PKCS7_free(pkcs7);
+
+	return md;
+}
+
+static void
+free_session(signer_session_t *session)
+{
+	EVP_PKEY_free(session->key);
+	for (unsigned int i = 0; i < session->nr_cert; ++i)
+		X509_free(session->cert_list[i]);
+	free(session->der);
+	free(session);
+}
+
+static signer_session_t *
+create_session(EVP_PKEY *key, X509 **cert_list, unsigned int nr_cert,
+	       int sign_flags)
+{
+	signer_session_t *session = calloc(1, sizeof(*session));
+	if (!session)
+		return NULL;
+
+	if (!EVP_PKEY_up_ref(key)) {
+		free(session);
+		return NULL;
+	}
+	session->key = key;
+
+	for (unsigned int i = 0; i < nr_cert; ++i) {
+		if (!X509_up_ref(cert_list[i])) {
+			free_session(session);
+			return NULL;
+		}
+		session->cert_list[session->nr_cert++] = cert_list[i];
+	}
+	session->sign_flags = sign_flags;
+
+	static const uint8_t content[] = { 0 };
+	size_t der_len;
+
+	session->failed = pkcs7_sign_full(content, sizeof(content), sign_flags,
+					  key, cert_list, nr_cert,
+					  &session->der, &der_len);
+	if (!session->failed) {
+		session->md = template_md(session->der, der_len);
+		session->failed = !session->md ||
+				  !parse_template(session, der_len);
+		if (EVP_PKEY_base_id(key) != EVP_PKEY_ED25519)
+			session->sign_md = session->md;
+	}
+
+	if (session->failed)
+		dbg("Signing without the template\n");
+
+	return session;
+}
+
+/*
+ * Return the session for the key and the certificates, or NULL if too
+ * many are created.
+ */
+static signer_session_t *
+get_session(EVP_PKEY *key, X509 **cert_list, unsigned int nr_cert,
+	    int sign_flags)
+{
+	signer_session_t *session;
+
+	if (nr_cert > SIGNLET_MAX_NR_CERT)
+		return NULL;
+
+	pthread_mutex_lock(&signer_session_lock);
+
+	for (session = signer_sessions; session; session = session->next) {
+		if (session->key == key && session->nr_cert == nr_cert &&
+		    !memcmp(session->cert_list, cert_list,
+			    nr_cert * sizeof(*cert_list)) &&
+		    session->sign_flags == sign_flags)
+			break;
+	}
+
+	if (!session && nr_signer_session < SIGNER_SESSION_MAX) {
+		session = create_session(key, cert_list, nr_cert, sign_flags);
+		if (session) {
+			session->next = signer_sessions;
+			signer_sessions = session;
+			++nr_signer_session;
+		}
+	}
+
+	pthread_mutex_unlock(&signer_session_lock);
+
+	return session;
+}
+
+static void
+release_sessions(void)
+{
+	while (signer_sessions) {
+		signer_session_t *session = signer_sessions;
+
+		signer_sessions = session->next;
+		free_session(session);
+	}
+
+	nr_signer_session = 0;
+}
+
+/*
+ * Assemble the signature from the template. Return a negative value if
+ * the template doesn't fit, e.g. the encoding of the signing time is
+ * longer after 2049, or the signing time can't be taken, so that the
+ * full PKCS7_sign() is fallen back to.
+ */
+static int
+session_sign(const signer_session_t *session, const uint8_t *content,
+	     size_t content_size, uint8_t **out_sig, size_t *out_sig_size)
+{
+	size_t attrs_len = session->attrs.len;
+	uint8_t attrs[der_header_size(attrs_len) + attrs_len];
+	uint8_t *attrs_value = der_put_header(attrs, DER_TAG_SET, attrs_len);
+	unsigned int digest_size;
+	int rc = -1;
+
+	memcpy(attrs_value, session->der + session->attrs.offset, attrs_len);
 
-	info("SELoader PKCS#7 %s signature (signed content %d-byte) "
+	ASN1_TIME *now = X509_gmtime_adj(NULL, 0);
+	if (!now)
+		return rc;
+
+	uint8_t *signing_time = attrs_value + session->signing_time.offset;
+
+	if (i2d_ASN1_TIME(now, NULL) == (int)session->signing_time.len) {
+		i2d_ASN1_TIME(now, &signing_time);
+		rc = EXIT_SUCCESS;
+	}
+	ASN1_TIME_free(now);
+	if (rc)
+		return rc;
+
+	rc = EXIT_FAILURE;
+
+	if (!EVP_Digest(content, content_size,
+			attrs_value + session->message_digest.offset,
+			&digest_size, session->md, NULL))
+		return rc;
+
+	/* The attributes are signed in the encoding of SET OF */
+	EVP_MD_CTX *md_ctx = EVP_MD_CTX_new();
+	size_t sig_size;
+	uint8_t *sig = NULL;
+
+	if (!md_ctx)
+		return rc;
+
+	if (EVP_DigestSignInit(md_ctx, NULL, session->sign_md, NULL,
+			       session->key) <= 0 ||
+	    EVP_DigestSign(md_ctx, NULL, &sig_size, attrs,
+			   sizeof(attrs)) <= 0)
+		goto out;
+
+	sig = malloc(sig_size);
+	if (!sig || EVP_DigestSign(md_ctx, sig, &sig_size, attrs,
+				   sizeof(attrs)) <= 0)
+		goto out;
+
+	/* Calculate the lengths from the inside out */
+	size_t signer_info_len = session->signer_info_prefix.len +
+				 der_header_size(attrs_len) + attrs_len +
+				 session->digest_enc_alg.len +
+				 der_header_size(sig_size) + sig_size;
+	size_t signer_infos_len = der_header_size(signer_info_len) +
+				  signer_info_len;
+	size_t octet_len = der_header_size(content_size) + content_size;
+	size_t explicit_content_len = der_header_size(octet_len) + octet_len;
+	size_t inner_len = session->content_oid.len +
+			   (session->attached ? explicit_content_len : 0);
+	size_t signed_data_len = session->signed_data_prefix.len +
+				 der_header_size(inner_len) + inner_len +
+				 session->certs.len +
+				 der_header_size(signer_infos_len) +
+				 signer_infos_len;
+	size_t explicit_len = der_header_size(signed_data_len) +
+			      signed_data_len;
+	size_t content_info_len = session->signed_data_oid.len +
+				  der_header_size(explicit_len) +
+				  explicit_len;
+	size_t der_len = der_header_size(content_info_len) +
+			 content_info_len;
+
+	uint8_t *der = malloc(der_len);
+	if (!der)
+		goto out;
+
+	uint8_t *p = der_put_header(der, DER_TAG_SEQUENCE, content_info_len);
+
+	p = der_put_piece(p, session, &session->signed_data_oid);
+	p = der_put_header(p, DER_TAG_CONTEXT_0, explicit_len);
+	p = der_put_header(p, DER_TAG_SEQUENCE, signed_data_len);
+	p = der_put_piece(p, session, &session->signed_data_prefix);
+	p = der_put_header(p, DER_TAG_SEQUENCE, inner_len);
+	p = der_put_piece(p, session, &session->content_oid);
+	if (session->attached) {
+		p = der_put_header(p, DER_TAG_CONTEXT_0, octet_len);
+		p = der_put_header(p, DER_TAG_OCTET_STRING, content_size);
+		memcpy(p, content, content_size);
+		p += content_size;
+	}
+	p = der_put_piece(p, session, &session->certs);
+	p = der_put_header(p, DER_TAG_SET, signer_infos_len);
+	p = der_put_header(p, DER_TAG_SEQUENCE, signer_info_len);
+	p = der_put_piece(p, session, &session->signer_info_prefix);
+	p = der_put_header(p, DER_TAG_CONTEXT_0, attrs_len);
+	memcpy(p, attrs_value, attrs_len);
+	p += attrs_len;
+	p = der_put_piece(p, session, &session->digest_enc_alg);
+	p = der_put_header(p, DER_TAG_OCTET_STRING, sig_size);
+	memcpy(p, sig, sig_size);
+
+	*out_sig = der;
+	*out_sig_size = der_len;
+	rc = EXIT_SUCCESS;
+
+out:
+	if (rc)
+		ERR_print_errors_fp(stderr);
+	free(sig);
+	EVP_MD_CTX_free(md_ctx);
+
+	return rc;
+}
+
+static int
+pkcs7_sign(const uint8_t *content, size_t content_size, int sign_flags,
+	   EVP_PKEY *key, X509 **cert_list, unsigned int nr_cert,
+	   uint8_t **out_sig, size_t *out_sig_size)
+{
+	int rc = -1;
+
+	if (!nr_cert) {
+		err("The signer certificate is not specified\n");
+		return EXIT_FAILURE;
+	}
+
+	signer_session_t *session = get_session(key, cert_list, nr_cert,
+						sign_flags);
+
+	if (session && !session->failed)
+		rc = session_sign(session, content, content_size, out_sig,
+				  out_sig_size);
+
+	if (rc < 0)
+		rc = pkcs7_sign_full(content, content_size, sign_flags, key,
+				     cert_list, nr_cert, out_sig,
+				     out_sig_size);
+
+	if (!rc)
+		libsign_utils_hex_dump("Signature dump", *out_sig,
+				       *out_sig_size);
+
+	return rc;
+}
+
+static void
+show_signature_info(size_t sig_content_size, unsigned long flags)
+{
+	info("SELoader PKCS#7 %s signature (signed content %zu-byte) "
 	     "generated\n", flags & SIGNLET_FLAGS_DETACHED_SIGNATURE ?
 			    "detached" :
 			    flags & SIGNLET_FLAGS_CONTENT_ATTACHED ?
 			    "content-attached" : "attached", sig_content_size);
+}
 
-	return EXIT_SUCCESS;
-err:
-	while (--i >= 0)
-		libsign_x509_unload(x509_certs[i]);
-	libsign_key_unload(privkey);
+static int
+SELoader_sign_digest(libsign_signaturelet_t *siglet, uint8_t *digest,
+		     unsigned int digest_size, EVP_PKEY *key,
+		     X509 **cert_list, unsigned int nr_cert,
+		     uint8_t **out_sig, size_t *out_sig_size,
+		     unsigned long flags)
+{
+	libsign_utils_hex_dump("Hash of signed content", digest, digest_size);
 
-	return EXIT_FAILURE;
+	BIO *signed_data;
+	int rc;
+
+	rc = construct_sel_signature(digest, digest_size, flags,
+				     &signed_data);
+	if (rc)
+		return rc;
+
+	char *sig_content;
+	long sig_content_size = BIO_get_mem_data(signed_data, &sig_content);
+
+	rc = pkcs7_sign((uint8_t *)sig_content, sig_content_size,
+			PKCS7_BINARY, key, cert_list, nr_cert, out_sig,
+			out_sig_size);
+	BIO_free(signed_data);
+	if (!rc)
+		show_signature_info(sig_content_size, flags);
+
+	return rc;
+}
+
+static int
+SELoader_sign(libsign_signaturelet_t *siglet, uint8_t *data,
+	      size_t data_size, EVP_PKEY *key, X509 **cert_list,
+	      unsigned int nr_cert, uint8_t **out_sig,
+	      size_t *out_sig_size, unsigned long flags)
+{
+	int rc;
+
+	if (flags & SIGNLET_FLAGS_DETACHED_SIGNATURE) {
+		rc = pkcs7_sign(data, data_size, PKCS7_DETACHED, key,
+				cert_list, nr_cert, out_sig, out_sig_size);
+		if (!rc)
+			show_signature_info(0, flags);
+
+		return rc;
+	}
+
+	if (!(flags & SIGNLET_FLAGS_CONTENT_ATTACHED)) {
+		uint8_t *digest;
+
+		rc = libsign_digest_calculate(siglet->digest_alg, data,
+					      data_size, &digest);
+		if (rc)
+			return rc;
+
+		unsigned int digest_size;
+
+		libsign_digest_size(siglet->digest_alg, &digest_size);
+
+		rc = SELoader_sign_digest(siglet, digest, digest_size, key,
+					  cert_list, nr_cert, out_sig,
+					  out_sig_size, flags);
+		free(digest);
+
+		return rc;
+	}
+
+	BIO *signed_data;
+
+	rc = construct_sel_signature(data, data_size, flags, &signed_data);
+	if (rc)
+		return rc;
+
+	char *sig_content;
+	long sig_content_size = BIO_get_mem_data(signed_data, &sig_content);
+
+	rc = pkcs7_sign((uint8_t *)sig_content, sig_content_size,
+			PKCS7_BINARY, key, cert_list, nr_cert, out_sig,
+			out_sig_size);
+	BIO_free(signed_data);
+	if (!rc)
+		show_signature_info(sig_content_size, flags);
+
+	return rc;
 }
 
 static const signaturelet_suffix_pattern_t SELoader_p7a_pattern = {
@@ -263,13 +1052,22 @@ static const signaturelet_suffix_pattern_t *suffix_patterns[] = {
 	NULL
 };
 
+static const LIBSIGN_CIPHER_ALG extra_cipher_algs[] = {
+	LIBSIGN_CIPHER_ALG_ECDSA_P256,
+	LIBSIGN_CIPHER_ALG_ECDSA_P384,
+	LIBSIGN_CIPHER_ALG_ED25519,
+	LIBSIGN_CIPHER_ALG_NONE
+};
+
 static libsign_signaturelet_t SEloader_signaturelet = {
 	.id = SELoader_signaturelet_id,
 	.description = "SELoader PKCS#7 signature",
 	.digest_alg = LIBSIGN_DIGEST_ALG_SHA256,
 	.cipher_alg = LIBSIGN_CIPHER_ALG_RSA,
+	.extra_cipher_algs = extra_cipher_algs,
 	.detached = 1,
 	.sign = SELoader_sign,
+	.sign_digest = SELoader_sign_digest,
 	.suffix_pattern = suffix_patterns,
 };
 
@@ -283,4 +1081,5 @@ void __attribute__((destructor))
 SELoader_signaturelet_fini(void)
 {
 	signaturelet_unregister(SELoader_signaturelet_id);
+	release_sessions();
 }
@@ -1,4 +1,4 @@
-LIBSIGN_MAJOR_VERSION := 0
-LIBSIGN_MINOR_VERSION := 3
-LIBSIGN_REVISION := 2
+LIBSIGN_MAJOR_VERSION := 1
+LIBSIGN_MINOR_VERSION := 0
+LIBSIGN_REVISION := 0
 LIBSIGN_VERSION := $(LIBSIGN_MAJOR_VERSION).$(LIBSIGN_MINOR_VERSION).$(LIBSIGN_REVISION)